@@ -20,8 +20,10 @@
 
 using System;
 using System.IO;
+using System.Linq;
 using System.Windows;
 using System.Windows.Controls;
+using QuickLook.Common.Helpers;
 using QuickLook.Common.Plugin;
 using System.Runtime.InteropServices;
 using System.Windows.Media.Imaging;
@@ -41,6 +43,34 @@ namespace QuickLook.Plugin.FitsViewer
     };
 
 
+    // Mirrors Metrics in ViewerCore/metrics.h, timings are in nanoseconds
+    [StructLayout(LayoutKind.Sequential)]
+    public struct Metrics
+    {
+        public long openNs;
+        public long headerNs;
+        public long readNs;
+        public long debayerNs;
+        public long statsNs;
+        public long stretchNs;
+        public long packNs;
+        public long bytesRead;
+        public long pixelsProcessed;
+        public long threadsUsed;
+        public long peakBufferBytes;
+
+        public long TotalNs => openNs + headerNs + readNs + debayerNs + statsNs + stretchNs + packNs;
+
+        public override string ToString()
+        {
+            return $"open {openNs / 1000000}ms, header {headerNs / 1000000}ms, read {readNs / 1000000}ms, " +
+                $"debayer {debayerNs / 1000000}ms, stats {statsNs / 1000000}ms, " +
+                $"stretch {stretchNs / 1000000}ms, pack {packNs / 1000000}ms, {bytesRead} bytes read, " +
+                $"{pixelsProcessed} pixels, {threadsUsed} threads, {peakBufferBytes} peak buffer bytes";
+        }
+    };
+
+
     public class Plugin : IViewer
     {
         internal static class NativeMethods
@@ -65,6 +95,18 @@ namespace QuickLook.Plugin.FitsViewer
             [DllImport(@"viewer_core.dll", EntryPoint = "FitsImageDestroy", CallingConvention = CallingConvention.Cdecl)]
             public static extern void FitsImageDestroy64(IntPtr ptr);
 
+            [DllImport(@"viewer_core.dll", EntryPoint = "FitsImageProbe", CallingConvention = CallingConvention.Cdecl)]
+            public static extern int FitsImageProbe64(IntPtr path, out ImageDim outDim);
+
+            [DllImport(@"viewer_core.dll", EntryPoint = "FitsImageCreateEx", CallingConvention = CallingConvention.Cdecl)]
+            public static extern IntPtr FitsImageCreateEx64(IntPtr path, int maxWidth, int maxHeight);
+
+            [DllImport(@"viewer_core.dll", EntryPoint = "FitsImageSetMaxOutputSize", CallingConvention = CallingConvention.Cdecl)]
+            public static extern ImageDim FitsImageSetMaxOutputSize64(IntPtr ptr, int maxWidth, int maxHeight);
+
+            [DllImport(@"viewer_core.dll", EntryPoint = "FitsImageGetMetrics", CallingConvention = CallingConvention.Cdecl)]
+            public static extern void FitsImageGetMetrics64(IntPtr ptr, out Metrics metrics);
+
 
             [DllImport(@"viewer_core32.dll", EntryPoint = "FitsImageCreate", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Unicode)]
             public static extern IntPtr FitsImageCreate32(IntPtr path);
@@ -84,11 +126,65 @@ namespace QuickLook.Plugin.FitsViewer
             [DllImport(@"viewer_core32.dll", EntryPoint = "FitsImageDestroy", CallingConvention = CallingConvention.Cdecl)]
             public static extern void FitsImageDestroy32(IntPtr ptr);
 
+            [DllImport(@"viewer_core32.dll", EntryPoint = "FitsImageProbe", CallingConvention = CallingConvention.Cdecl)]
+            public static extern int FitsImageProbe32(IntPtr path, out ImageDim outDim);
+
+            [DllImport(@"viewer_core32.dll", EntryPoint = "FitsImageCreateEx", CallingConvention = CallingConvention.Cdecl)]
+            public static extern IntPtr FitsImageCreateEx32(IntPtr path, int maxWidth, int maxHeight);
+
+            [DllImport(@"viewer_core32.dll", EntryPoint = "FitsImageSetMaxOutputSize", CallingConvention = CallingConvention.Cdecl)]
+            public static extern ImageDim FitsImageSetMaxOutputSize32(IntPtr ptr, int maxWidth, int maxHeight);
+
+            [DllImport(@"viewer_core32.dll", EntryPoint = "FitsImageGetMetrics", CallingConvention = CallingConvention.Cdecl)]
+            public static extern void FitsImageGetMetrics32(IntPtr ptr, out Metrics metrics);
+
             public static IntPtr FitsImageCreate(string path)
             {
                 return Is64 ? FitsImageCreate64(Marshal.StringToHGlobalAnsi(path)) : FitsImageCreate32(Marshal.StringToHGlobalAnsi(path));
             }
 
+            public static bool FitsImageProbe(string path, out ImageDim outDim)
+            {
+                IntPtr pathPtr = Marshal.StringToHGlobalAnsi(path);
+                try
+                {
+                    return (Is64 ? FitsImageProbe64(pathPtr, out outDim) : FitsImageProbe32(pathPtr, out outDim)) != 0;
+                }
+                finally
+                {
+                    Marshal.FreeHGlobal(pathPtr);
+                }
+            }
+
+            public static IntPtr FitsImageCreateEx(string path, int maxWidth, int maxHeight)
+            {
+                // the core copies the path
+                IntPtr pathPtr = Marshal.StringToHGlobalAnsi(path);
+                try
+                {
+                    return Is64 ? FitsImageCreateEx64(pathPtr, maxWidth, maxHeight) : FitsImageCreateEx32(pathPtr, maxWidth, maxHeight);
+                }
+                finally
+                {
+                    Marshal.FreeHGlobal(pathPtr);
+                }
+            }
+
+            public static ImageDim FitsImageSetMaxOutputSize(IntPtr ptr, int maxWidth, int maxHeight)
+            {
+                return Is64 ? FitsImageSetMaxOutputSize64(ptr, maxWidth, maxHeight) : FitsImageSetMaxOutputSize32(ptr, maxWidth, maxHeight);
+            }
+
+            public static Metrics FitsImageGetMetrics(IntPtr ptr)
+            {
+                Metrics metrics;
+                if (Is64)
+                    FitsImageGetMetrics64(ptr, out metrics);
+                else
+                    FitsImageGetMetrics32(ptr, out metrics);
+                return metrics;
+            }
+
             public static ImageDim FitsImageGetMeta(IntPtr ptr)
             {
                 return Is64 ? FitsImageGetMeta64(ptr) : FitsImageGetMeta32(ptr);
@@ -140,6 +236,9 @@ namespace QuickLook.Plugin.FitsViewer
         }
 
 
+        // Decodes slower than this are reported in the QuickLook log
+        private const long SlowDecodeNs = 2000000000;
+
         public int Priority => 0;
         private ImagePanel _ip;
         private IntPtr _fitsImagePtr;
@@ -150,15 +249,22 @@ namespace QuickLook.Plugin.FitsViewer
 
         public bool CanHandle(string path)
         {
-            return !Directory.Exists(path) && (path.ToLower().EndsWith(".fits") ||
-                path.ToLower().EndsWith(".fit") || path.ToLower().EndsWith(".fts"));
+            // .fz: fpack'ed tile-compressed images, .fits.fz included
+            var lower = path.ToLower();
+            return !Directory.Exists(path) && (lower.EndsWith(".fits") ||
+                lower.EndsWith(".fit") || lower.EndsWith(".fts") || lower.EndsWith(".fz") ||
+                lower.EndsWith(".fits.gz") || lower.EndsWith(".fit.gz") || lower.EndsWith(".fts.gz"));
         }
 
 
         public void Prepare(string path, ContextObject context)
         {
-            _fitsImagePtr = NativeMethods.FitsImageCreate(path);
-            ImageDim outputDim = NativeMethods.FitsImageGetOutputDim(_fitsImagePtr);
+            // Header-only probe, the image itself is opened in View
+            if (!NativeMethods.FitsImageProbe(path, out ImageDim outputDim))
+            {
+                _fitsImagePtr = NativeMethods.FitsImageCreate(path);
+                outputDim = NativeMethods.FitsImageGetOutputDim(_fitsImagePtr);
+            }
 
             var size = new Size(outputDim.nx, outputDim.ny);
             context.SetPreferredSizeFit(size, 0.8);
@@ -167,13 +273,32 @@ namespace QuickLook.Plugin.FitsViewer
 
         public void View(string path, ContextObject context)
         {
-            var header = NativeMethods.FitsImageGetHeader(_fitsImagePtr);
+            // Decode no larger than the window, the core picks the downscale factor.
+            // PreferredSize is in DIPs, the bitmap is shown at the device pixels of the screen.
+            var scale = DeviceScale();
+            int maxWidth = (int)Math.Ceiling(context.PreferredSize.Width * scale.X);
+            int maxHeight = (int)Math.Ceiling(context.PreferredSize.Height * scale.Y);
+
+            ImageDim outputDim;
+            if (_fitsImagePtr == IntPtr.Zero)
+            {
+                _fitsImagePtr = NativeMethods.FitsImageCreateEx(path, maxWidth, maxHeight);
+                outputDim = NativeMethods.FitsImageGetOutputDim(_fitsImagePtr);
+            }
+            else
+            {
+                outputDim = NativeMethods.FitsImageSetMaxOutputSize(_fitsImagePtr, maxWidth, maxHeight);
+            }
 
-            ImageDim outputDim = NativeMethods.FitsImageGetOutputDim(_fitsImagePtr);
+            var header = NativeMethods.FitsImageGetHeader(_fitsImagePtr);
 
             byte[] img = new byte[outputDim.nx * outputDim.ny * outputDim.nc];
             NativeMethods.FitsImageGetPixData(_fitsImagePtr, img);
 
+            var metrics = NativeMethods.FitsImageGetMetrics(_fitsImagePtr);
+            if (metrics.TotalNs > SlowDecodeNs)
+                ProcessHelper.WriteLog($"Slow FITS decode {path}: {metrics}");
+
             BitmapSource bitmapSource;
             int rawStride = outputDim.nx * outputDim.nc;
             if (outputDim.nc == 3)
@@ -194,10 +319,26 @@ namespace QuickLook.Plugin.FitsViewer
             context.IsBusy = false;
         }
 
+        // Device pixels per DIP: those of the viewer window, or the system DPI before it shows up
+        private static Vector DeviceScale()
+        {
+            var window = Application.Current?.Windows.OfType<Window>().FirstOrDefault(w => w.IsActive) ?? Application.Current?.MainWindow;
+            if (window != null && PresentationSource.FromVisual(window) != null)
+            {
+                var dpi = VisualTreeHelper.GetDpi(window);
+                return new Vector(dpi.DpiScaleX, dpi.DpiScaleY);
+            }
+            using (var graphics = System.Drawing.Graphics.FromHwnd(IntPtr.Zero))
+            {
+                return new Vector(graphics.DpiX / 96.0, graphics.DpiY / 96.0);
+            }
+        }
+
         public void Cleanup()
         {
             if (_fitsImagePtr != IntPtr.Zero)
                 NativeMethods.FitsImageDestroy(_fitsImagePtr);
+            _fitsImagePtr = IntPtr.Zero;
 
             _ip?.Dispose();
             _ip = null;
@@ -0,0 +1,188 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+#include "pch.h"
+#include "FitsHeader.h"
+#include "GzipFile.h"
+#include <fstream>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+
+
+constexpr int FitsBlockSize = 2880;
+constexpr int FitsCardSize = 80;
+
+
+static string trimRight(const string& s) {
+	size_t end = s.find_last_not_of(' ');
+	return end == string::npos ? "" : s.substr(0, end + 1);
+}
+
+
+// Value part of a card, quotes and trailing spaces stripped for strings,
+// comment stripped for everything else.
+static string cardValue(const char *card) {
+	if (card[8] != '=' || card[9] != ' ')
+		return "";
+
+	const char *p = card + 10;
+	const char *end = card + FitsCardSize;
+	while (p < end && *p == ' ') p++;
+
+	string value;
+	if (p < end && *p == '\'') {
+		for (p++; p < end; p++) {
+			if (*p == '\'') {
+				// '' is an escaped quote
+				if (p + 1 < end && p[1] == '\'') {
+					value += '\'';
+					p++;
+				}
+				else break;
+			}
+			else value += *p;
+		}
+		return trimRight(value);
+	}
+
+	while (p < end && *p != '/') value += *p++;
+	return trimRight(value);
+}
+
+
+// Cards of one header unit up to its END card, values as returned by cardValue.
+// The unit must start with firstKey, SIMPLE for the primary header, XTENSION for extensions.
+// readBlock(char *) fills one block, from the file or from the inflated stream.
+template <typename ReadBlock>
+static bool readHeaderUnit(const ReadBlock& readBlock, const char *firstKey, std::map<string, string> *cards, long long *nbBlocks) {
+	char block[FitsBlockSize];
+	bool first = true;
+
+	while (readBlock(block)) {
+		if (first && trimRight(string(block, 8)) != firstKey)
+			return false;
+		first = false;
+		(*nbBlocks)++;
+
+		for (int i = 0; i < FitsBlockSize; i += FitsCardSize) {
+			const char *card = block + i;
+			string key = trimRight(string(card, 8));
+			if (key == "END")
+				return true;
+			if (!key.empty())
+				(*cards)[key] = cardValue(card);
+		}
+	}
+	return false;
+}
+
+
+static long long cardInt(const std::map<string, string>& cards, const char *key, long long fallback = 0) {
+	auto it = cards.find(key);
+	return it == cards.end() ? fallback : atoll(it->second.c_str());
+}
+
+
+static double cardDouble(const std::map<string, string>& cards, const char *key, double fallback) {
+	auto it = cards.find(key);
+	return it == cards.end() ? fallback : atof(it->second.c_str());
+}
+
+
+static string cardString(const std::map<string, string>& cards, const char *key) {
+	auto it = cards.find(key);
+	return it == cards.end() ? "" : it->second;
+}
+
+
+// prefix is "" for plain images and "Z" for the original keywords of a compressed one
+static void readGeometry(const std::map<string, string>& cards, const string& prefix, FitsHeaderInfo *info) {
+	info->bitpix = static_cast<int>(cardInt(cards, (prefix + "BITPIX").c_str()));
+	info->naxis = static_cast<int>(cardInt(cards, (prefix + "NAXIS").c_str()));
+	for (int i = 0; i < 3; i++) {
+		info->naxes[i] = cardInt(cards, (prefix + "NAXIS" + char('1' + i)).c_str());
+	}
+	info->bzero = cardDouble(cards, "BZERO", 0);
+	info->bscale = cardDouble(cards, "BSCALE", 1);
+
+	// Layout keywords of a compressed image live in its extension, keep the primary ones otherwise
+	string bayer = cardString(cards, "BAYERPAT");
+	if (!bayer.empty()) {
+		info->bayerPattern = bayer;
+		info->bayerOffset[0] = static_cast<int>(cardDouble(cards, "XBAYROFF", cardDouble(cards, "BAYOFFX", 0)));
+		info->bayerOffset[1] = static_cast<int>(cardDouble(cards, "YBAYROFF", cardDouble(cards, "BAYOFFY", 0)));
+	}
+	string rowOrder = cardString(cards, "ROWORDER");
+	if (!rowOrder.empty())
+		info->rowOrder = rowOrder;
+}
+
+
+template <typename ReadBlock>
+static bool probeHeaderUnits(const ReadBlock& readBlock, FitsHeaderInfo *info) {
+	std::map<string, string> cards;
+	long long nbBlocks = 0;
+	if (!readHeaderUnit(readBlock, "SIMPLE", &cards, &nbBlocks))
+		return false;
+
+	readGeometry(cards, "", info);
+	info->dataOffset = nbBlocks * FitsBlockSize;
+	if (info->naxis != 0) {
+		if (info->gzipped)
+			info->cards.swap(cards);
+		return true;
+	}
+
+	// Empty primary, the data unit has no blocks and the extension header follows.
+	// fpack puts the compressed image there as a binary table with ZIMAGE = T.
+	std::map<string, string> ext;
+	if (!readHeaderUnit(readBlock, "XTENSION", &ext, &nbBlocks))
+		return true;
+	if (cardString(ext, "XTENSION") != "BINTABLE" || cardString(ext, "ZIMAGE") != "T")
+		return true;
+
+	readGeometry(ext, "Z", info);
+	info->dataOffset = nbBlocks * FitsBlockSize;
+	info->compressed = true;
+	info->hdu = 2;
+	info->tileSize[0] = cardInt(ext, "ZTILE1", info->naxes[0]);
+	info->tileSize[1] = cardInt(ext, "ZTILE2", 1);
+	info->compressedBytes = cardInt(ext, "NAXIS1") * cardInt(ext, "NAXIS2") + cardInt(ext, "PCOUNT");
+	info->compression = cardString(ext, "ZCMPTYPE");
+	return true;
+}
+
+
+bool probeFitsHeader(const string& path, FitsHeaderInfo *info) {
+	if (GzipFile::isGzip(path)) {
+		GzipFile file;
+		if (!file.open(path))
+			return false;
+		info->gzipped = true;
+		return probeHeaderUnits([&](char *block) { return file.read(block, FitsBlockSize); }, info);
+	}
+
+	std::ifstream f(path, std::ios::binary);
+	if (!f.is_open())
+		return false;
+	return probeHeaderUnits([&](char *block) { return static_cast<bool>(f.read(block, FitsBlockSize)); }, info);
+}
@@ -0,0 +1,68 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+#pragma once
+#include <string>
+#include <map>
+
+using std::string;
+
+
+// Geometry and layout keywords of the image HDU, parsed straight from the
+// 2880-byte header blocks without going through cfitsio/CCfits.
+// The image is the primary HDU, or the first extension when the primary is empty
+// and that extension is a tile-compressed image (fpack'ed .fz files).
+struct FitsHeaderInfo
+{
+	int bitpix;
+	int naxis;
+	long long naxes[3];
+	string bayerPattern;   // raw BAYERPAT value, not sanitized
+	int bayerOffset[2];    // XBAYROFF/YBAYROFF, or BAYOFFX/BAYOFFY
+	string rowOrder;       // raw ROWORDER value
+	double bzero;
+	double bscale;
+	long long dataOffset;  // byte offset of the image data unit
+
+	// Tile-compressed images: geometry above comes from the ZBITPIX/ZNAXISn keywords
+	bool compressed;
+	int hdu;                   // 1-based HDU number of the image, cfitsio numbering
+	long long tileSize[2];     // ZTILE1, ZTILE2
+	long long compressedBytes; // binary table plus heap
+	string compression;        // ZCMPTYPE
+
+	// gzip-wrapped file, the offsets above are positions in the inflated stream
+	bool gzipped;
+
+	// Every card of the image header, values as written in the file. Only filled for
+	// gzipped files, which are decoded without ever being opened by CCfits.
+	std::map<string, string> cards;
+
+	FitsHeaderInfo() : bitpix(0), naxis(0), naxes{ 0, 0, 0 }, bayerOffset{ 0, 0 }, bzero(0), bscale(1), dataOffset(0),
+		compressed(false), hdu(1), tileSize{ 0, 0 }, compressedBytes(0), gzipped(false) {}
+};
+
+
+// Scans the primary header of path and stops at the END card, or at the END card
+// of the first extension if it holds a compressed image.
+// gzip-wrapped files are inflated on the fly when built with zlib.
+// Returns false if the file can't be read or isn't a FITS file.
+bool probeFitsHeader(const string& path, FitsHeaderInfo *info);
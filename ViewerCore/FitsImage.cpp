@@ -22,8 +22,17 @@
 #include "FitsImage.h"
 #include "Stretch.h"
 #include "debayer.h"
-#include "downscale.h"
+#include "bilinear.h"
+#include "vng.h"
+#include "binning.h"
+#include "mosaicstats.h"
+#include "directread.h"
+#include "compressedread.h"
+#include "gzipread.h"
+#include "pixeltraits.h"
+#include "threadpool.h"
 #include "log.h"
+#include <cstring>
 
 
 inline const char * const BoolToString(bool b) {
@@ -31,7 +40,7 @@ inline const char * const BoolToString(bool b) {
 }
 
 
-std::map<string, string> readImageHeader(PHDU& image) {
+std::map<string, string> readImageHeader(HDU& image) {
 	image.readAllKeys();
 	auto header = image.keyWord();
 
@@ -55,13 +64,173 @@ std::map<string, string> readImageHeader(PHDU& image) {
 }
 
 
-FitsImage::FitsImage(string path) : _inDim{}, _outDim{}
+// The keywords of a compressed image HDU describe the binary table holding the tiles,
+// show the geometry of the image itself instead
+static void restoreUncompressedKeys(std::map<string, string>& header) {
+	static const char *const tableKeys[] = { "XTENSION", "PCOUNT", "GCOUNT", "TFIELDS", "THEAP", "ZIMAGE" };
+	for (const char *key : tableKeys) {
+		header.erase(key);
+	}
+	for (auto it = header.begin(); it != header.end();) {
+		const string& key = it->first;
+		if (key.compare(0, 5, "TTYPE") == 0 || key.compare(0, 5, "TFORM") == 0) {
+			it = header.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+
+	static const char *const imageKeys[] = { "BITPIX", "NAXIS", "NAXIS1", "NAXIS2", "NAXIS3" };
+	for (const char *key : imageKeys) {
+		auto it = header.find(string("Z") + key);
+		header.erase(key);
+		if (it != header.end()) {
+			header[key] = it->second;
+			header.erase(it);
+		}
+	}
+}
+
+
+// Header map of a gzipped file from the probed cards, logicals spelled like readImageHeader does
+static std::map<string, string> headerFromCards(const std::map<string, string>& cards) {
+	std::map<string, string> ret;
+	for (const auto& card : cards) {
+		if (card.second == "T" || card.second == "F") {
+			ret[card.first] = BoolToString(card.second == "T");
+		}
+		else {
+			ret[card.first] = card.second;
+		}
+	}
+	return ret;
+}
+
+
+// Plain images in a gzip stream are streamed by gzipread.h instead of being opened by CCfits
+static bool isStreamable(const FitsHeaderInfo& info) {
+	if (!info.gzipped || info.compressed || info.naxis < 2 || info.naxis > 3)
+		return false;
+	if (info.naxes[0] <= 0 || info.naxes[1] <= 0 || (info.naxis == 3 && info.naxes[2] != 3))
+		return false;
+	return info.bitpix == 8 || info.bitpix == 16 || info.bitpix == 32 || info.bitpix == -32 || info.bitpix == -64;
+}
+
+
+// Bayer offset keyword of the header, alias being the older spelling
+static int bayerOffset(const std::map<string, string>& header, const char *key, const char *alias) {
+	auto it = header.find(key);
+	if (it == header.end())
+		it = header.find(alias);
+	return it == header.end() ? 0 : static_cast<int>(atof(it->second.c_str()));
+}
+
+
+static bool isTopDownRowOrder(const string& roworder) {
+	return roworder.compare("BOTTOM-UP") != 0;
+}
+
+
+// Empty if the pattern isn't supported, otherwise the pattern of the first photosite of the
+// mosaic (xOffset, yOffset being the Bayer offsets of a subframe) flipped to top-down order
+static string sanitizeBayerPattern(string bayer, int xOffset, int yOffset, bool isTopDown) {
+	if (!(bayer.compare("RGGB") == 0 || bayer.compare("BGGR") == 0 || bayer.compare("GRBG") == 0 || bayer.compare("GBRG") == 0)) {
+		return "";
+	}
+	bayer = shiftBayerPattern(bayer, xOffset, yOffset);
+	if (!isTopDown) {
+		bayer = flipBayerPatternVertically(bayer);
+	}
+	return bayer;
+}
+
+
+static ImageDim outputDimFor(const ImageDim& inDim, const string& bayer, int factor = 1, DebayerMode mode = DebayerMode::SuperPixel) {
+	ImageDim outDim{};
+	if (inDim.nc == 1 && bayer.empty()) {
+		// mono
+		writeToLogFile("Mono");
+		outDim = { inDim.nx / factor, inDim.ny / factor, 1, 8 };
+	}
+	else {
+		if (inDim.nc == 3) {
+			// 3ch image
+			writeToLogFile("3Ch");
+			outDim = { inDim.nx / factor, inDim.ny / factor, 3, 8 };
+		}
+		else if (inDim.nc == 1 && !bayer.empty()) {
+			// bayer image
+			writeToLogFile("Bayer");
+			outDim = { inDim.nx / (2 * factor), inDim.ny / (2 * factor), 3, 8 };
+			if (mode != DebayerMode::SuperPixel) {
+				// every photosite of the whole CFA cells kept by the decimation
+				outDim.nx *= 2;
+				outDim.ny *= 2;
+			}
+		}
+	}
+	return outDim;
+}
+
+
+FitsImage::FitsImage(string path) : _inDim{}, _outDim{}, _imageHDU(nullptr), _path(path), _isStreamed(false), _downscaleFactor(1), _debayerMode(DebayerMode::SuperPixel), _metrics{}
 {
 	writeToLogFile("FitsImage constructor");
 
+	// Layout info for the direct reader, bitpix stays 0 if the header can't be scanned
+	{
+		StageTimer timer(_metrics.headerNs, "header");
+		if (!probeFitsHeader(path, &_headerInfo)) {
+			_headerInfo = FitsHeaderInfo();
+		}
+	}
+
+	if (isStreamable(_headerInfo)) {
+		// cfitsio would inflate the whole file in memory on open
+		_isStreamed = true;
+		header = headerFromCards(_headerInfo.cards);
+		_inDim.nx = static_cast<int>(_headerInfo.naxes[0]);
+		_inDim.ny = static_cast<int>(_headerInfo.naxes[1]);
+		_inDim.nc = _headerInfo.naxis == 3 ? 3 : 1;
+		_inDim.depth = _headerInfo.bitpix;
+	}
+	else if (!openImageHDU()) {
+		return;
+	}
+
+	// BAYERPAT
+	string bayer;
+	auto it = header.find("BAYERPAT");
+	if (it != header.end()) {
+		bayer = it->second;
+	}
+
+	// XBAYROFF/YBAYROFF, BAYOFFX/BAYOFFY for older software
+	const int xOffset = bayerOffset(header, "XBAYROFF", "BAYOFFX");
+	const int yOffset = bayerOffset(header, "YBAYROFF", "BAYOFFY");
+
+	// ROWORDER
+	_isTopDown = true;
+	it = header.find("ROWORDER");
+	if (it != header.end()) {
+		_isTopDown = isTopDownRowOrder(it->second);
+	}
+
+	_sanitizedBayerMode = sanitizeBayerPattern(bayer, xOffset, yOffset, _isTopDown);
+	_outDim = outputDimFor(_inDim, _sanitizedBayerMode);
+	writeToLogFile("FitsImage constructor finish");
+}
+
+
+// Opens the file with CCfits and reads the keywords and geometry of the image HDU
+bool FitsImage::openImageHDU()
+{
 	try
     {
-		pInfile = std::unique_ptr<FITS>(new FITS(path, Read, true));
+		// Header only, pixels are read once in getImagePix straight into the pipeline buffer
+		StageTimer timer(_metrics.openNs, "open");
+		pInfile = std::unique_ptr<FITS>(new FITS(_path, Read, false));
     }
     catch (std::exception& e)
     {
@@ -69,143 +238,737 @@ FitsImage::FitsImage(string path) : _inDim{}, _outDim{}
     }
 	if (!pInfile) {
 		writeToLogFile("CCFits failed");
-		return;
+		return false;
+	}
+	try
+	{
+		// cfitsio presents a compressed image as an image HDU with the uncompressed geometry
+		_imageHDU = _headerInfo.compressed ? static_cast<HDU *>(&pInfile->extension(_headerInfo.hdu - 1)) : &pInfile->pHDU();
+	}
+	catch (std::exception& e)
+	{
+		writeToLogFile(e.what());
+		return false;
 	}
-	PHDU& imageHDU = pInfile->pHDU();
+	HDU& imageHDU = *_imageHDU;
 
 	if (imageHDU.axes() == 0) {
 		writeToLogFile("Image HDU has 0 axes");
-		return;
+		return false;
+	}
+	{
+		StageTimer timer(_metrics.headerNs, "header");
+		header = readImageHeader(imageHDU);
+		if (_headerInfo.compressed) {
+			restoreUncompressedKeys(header);
+		}
 	}
-	header = readImageHeader(imageHDU);
 
 	_inDim.nx = static_cast<int>(imageHDU.axis(0));
 	_inDim.ny = static_cast<int>(imageHDU.axis(1));
 	_inDim.nc = static_cast<int>(imageHDU.axes() == 3 ? 3 : 1);
 	_inDim.depth = static_cast<int>(imageHDU.bitpix());
+	return true;
+}
 
-	// BAYERPAT
-	string bayer;
-	auto it = header.find("BAYERPAT");
-	if (it != header.end()) {
-		// has bayer kw in the header
-		bayer = it->second;
-		if (!(bayer.compare("RGGB") == 0 || bayer.compare("BGGR") == 0 || bayer.compare("GRBG") == 0 || bayer.compare("GBRG") == 0)) {
-			bayer = "";
+
+// Mosaic rows a full resolution debayer reads above and below the rows it produces
+static int debayerHalo(DebayerMode mode) {
+	return mode == DebayerMode::VNG ? VngHalo : 1;
+}
+
+
+// Full resolution debayer of rows [row0, row1), see bilinearRows for the buffer layout
+template <typename T>
+void debayerRows(DebayerMode mode, const string& bayer, const T *rows, size_t rowStride, int firstRow, int width, int height,
+	int row0, int row1, T *out, size_t planeSize) {
+	if (mode == DebayerMode::VNG)
+		vngRows(rows, rowStride, firstRow, width, height, row0, row1, VngPattern(bayer), out, planeSize);
+	else
+		bilinearRows(rows, rowStride, firstRow, width, height, row0, row1, BilinearWeights(bayer), out, planeSize);
+}
+
+
+// Layout specific reduction to the output planes: the debayer of a mosaic, nothing for the
+// other layouts since the downscale already happened at read time.
+// alongside, if set, reads the unreduced content while the reduction runs.
+template <typename T>
+void reduce(std::valarray<T>& content, const ImageDim& inDim, const ImageDim& outDim, const string& bayer, DebayerMode mode, Metrics& metrics,
+	const std::function<void()>& alongside, LayoutTag<PixelLayout::Mono>) {
+	if (alongside)
+		alongside();
+}
+
+
+template <typename T>
+void reduce(std::valarray<T>& content, const ImageDim& inDim, const ImageDim& outDim, const string& bayer, DebayerMode mode, Metrics& metrics,
+	const std::function<void()>& alongside, LayoutTag<PixelLayout::Bayer>) {
+	writeToLogFile("debayer start " + bayer);
+
+	const size_t nbFinalPix = static_cast<size_t>(outDim.nx) * outDim.ny * 3;
+	std::valarray<T> debayered = std::valarray<T>(nbFinalPix);
+	metrics.peakBufferBytes = std::max<int64_t>(metrics.peakBufferBytes, (content.size() + debayered.size()) * sizeof(T));
+	auto debayer = [&]() {
+		StageTimer timer(metrics.debayerNs, "debayer");
+		if (mode == DebayerMode::SuperPixel) {
+			super_pixel(content, debayered, inDim.nx, inDim.ny, bayer, 1);
+		}
+		else {
+			debayerRows(mode, bayer, &content[0], static_cast<size_t>(inDim.nx), 0, outDim.nx, outDim.ny, 0, outDim.ny,
+				&debayered[0], static_cast<size_t>(outDim.nx) * outDim.ny);
 		}
+	};
+	if (alongside) {
+		// both only read the mosaic, their parallel loops share the pool
+		parallel_for(0, 2, [&](int task) {
+			if (task == 0)
+				debayer();
+			else
+				alongside();
+		});
+	}
+	else {
+		debayer();
 	}
+	// swap rather than assign, no third full-size buffer
+	content.swap(debayered);
+}
 
-	// ROWORDER
-	_isTopDown = true;
-	it = header.find("ROWORDER");
-	if (it != header.end()) {
-		string roworder = it->second;
-		if (roworder.compare("BOTTOM-UP") == 0) {
-			_isTopDown = false;
-			if (!bayer.empty()) {
-				bayer = flipBayerPatternVertically(bayer);
-			}
-		}
+
+template <typename T>
+void reduce(std::valarray<T>& content, const ImageDim& inDim, const ImageDim& outDim, const string& bayer, DebayerMode mode, Metrics& metrics,
+	const std::function<void()>& alongside, LayoutTag<PixelLayout::Color>) {
+	if (alongside)
+		alongside();
+}
+
+
+// content is left linear, the stretch is applied while writing the bitmap
+template <typename Traits>
+void process(std::valarray<typename Traits::type>& content, const ImageDim& inDim, const ImageDim& outDim, const string& bayer, DebayerMode mode,
+	unsigned char *pixData, bool shouldFlipV, Metrics& metrics, const StretchParams *knownParams = nullptr) {
+	typedef typename Traits::type T;
+	writeToLogFile("Process start");
+
+	// statistics may already be gathered by a streamed read, those of a Bayer image are
+	// taken on its mosaic while it is being debayered
+	StretchParams stretchParams;
+	std::function<void()> mosaicStats;
+	if (Traits::layout == PixelLayout::Bayer && !knownParams) {
+		mosaicStats = [&]() {
+			StageTimer timer(metrics.statsNs, "stats");
+			computeParamsMosaic(content, inDim.nx, inDim.ny, bayer, Traits::bitpix, &stretchParams);
+		};
 	}
 
-	_sanitizedBayerMode = bayer;
+	reduce(content, inDim, outDim, bayer, mode, metrics, mosaicStats, LayoutTag<Traits::layout>());
+	writeToLogFile("Debayer finish. Stretch start");
 
-	if (_inDim.nc == 1 && bayer.empty()) {
-		// mono
-		writeToLogFile("Mono");
-		_outDim = { _inDim.nx, _inDim.ny, 1, 8 };
+	if (knownParams) {
+		stretchParams = *knownParams;
+	}
+	else if (!mosaicStats) {
+		StageTimer timer(metrics.statsNs, "stats");
+		computeParamsAllChannels(content, &stretchParams, Traits::bitpix, outDim);
+	}
+	std::vector<StretchLUT<T>> luts;
+	{
+		StageTimer timer(metrics.stretchNs, "stretch");
+		luts = buildStretchLUTs<Traits::outChannels, T>(stretchParams);
+	}
+	{
+		StageTimer timer(metrics.packNs, "pack");
+		packBitmap<Traits::outChannels>(content, luts, outDim, pixData, shouldFlipV);
+	}
+	writeToLogFile("Process finish");
+}
+
+
+static void logFitsError(const char *what, int status) {
+	char errText[FLEN_STATUS];
+	fits_get_errstatus(status, errText);
+	writeToLogFile(string_format("%s failed: %s", what, errText));
+}
+
+
+// Dimensions of the buffer produced by readImagePix for a given downscale factor.
+// Bayer images keep whole 2x2 CFA cells so the result is still a mosaic with the same pattern.
+static ImageDim decimatedDim(const ImageDim& inDim, bool isBayer, int factor) {
+	ImageDim dim = inDim;
+	if (factor <= 1)
+		return dim;
+
+	if (isBayer) {
+		dim.nx = 2 * (inDim.nx / (2 * factor));
+		dim.ny = 2 * (inDim.ny / (2 * factor));
 	}
 	else {
-		if (_inDim.nc == 3) {
-			// 3ch image
-			writeToLogFile("3Ch");
-			_outDim = { _inDim.nx, _inDim.ny, 3, 8 };
+		dim.nx = inDim.nx / factor;
+		dim.ny = inDim.ny / factor;
+	}
+	return dim;
+}
+
+
+// Reads the primary image with cfitsio directly into buffer, every factor-th row and column only.
+// PHDU::read would first cache the image inside CCfits and then copy it into the valarray.
+template <typename T>
+bool readImagePix(fitsfile *fptr, const ImageDim& inDim, bool isBayer, int factor, std::valarray<T>& buffer) {
+	const ImageDim dim = decimatedDim(inDim, isBayer, factor);
+	const LONGLONG nbPix = static_cast<LONGLONG>(dim.nx) * dim.ny * dim.nc;
+	if (nbPix <= 0)
+		return false;
+	buffer.resize(static_cast<size_t>(nbPix));
+
+	int status = 0;
+	int anynul = 0;
+	T nulval = 0;
+
+	if (factor <= 1) {
+		fits_read_img(fptr, FitsDataType<T>::value, 1, nbPix, &nulval, &buffer[0], &anynul, &status);
+		if (status) {
+			logFitsError("fits_read_img", status);
+			return false;
 		}
-		else if (_inDim.nc == 1 && !bayer.empty()) {
-			// bayer image
-			writeToLogFile("Bayer");
-			_outDim = { _inDim.nx / 2, _inDim.ny / 2, 3, 8 };
+		return true;
+	}
+
+	if (!isBayer) {
+		// strided subset read, cfitsio skips the unused rows
+		long fpixel[3] = { 1, 1, 1 };
+		long lpixel[3] = { (dim.nx - 1) * factor + 1, (dim.ny - 1) * factor + 1, dim.nc };
+		long inc[3] = { factor, factor, 1 };
+		fits_read_subset(fptr, FitsDataType<T>::value, fpixel, lpixel, inc, &nulval, &buffer[0], &anynul, &status);
+		if (status) {
+			logFitsError("fits_read_subset", status);
+			return false;
 		}
+		return true;
 	}
-	writeToLogFile("FitsImage constructor finish");
+
+	// Bayer: one strided read per CFA site, then interleave the 4 sites back into a mosaic
+	const int cellsX = dim.nx / 2;
+	const int cellsY = dim.ny / 2;
+	const int step = 2 * factor;
+	std::valarray<T> site(static_cast<size_t>(cellsX) * cellsY);
+
+	for (int dy = 0; dy < 2; dy++) {
+		for (int dx = 0; dx < 2; dx++) {
+			long fpixel[2] = { 1 + dx, 1 + dy };
+			long lpixel[2] = { 1 + dx + (cellsX - 1) * step, 1 + dy + (cellsY - 1) * step };
+			long inc[2] = { step, step };
+			fits_read_subset(fptr, FitsDataType<T>::value, fpixel, lpixel, inc, &nulval, &site[0], &anynul, &status);
+			if (status) {
+				logFitsError("fits_read_subset", status);
+				return false;
+			}
+
+			parallel_for(0, cellsY, [&](int i) {
+				for (int j = 0; j < cellsX; j++) {
+					buffer[static_cast<size_t>(2 * i + dy) * dim.nx + 2 * j + dx] = site[static_cast<size_t>(i) * cellsX + j];
+				}
+			});
+		}
+	}
+	return true;
 }
 
 
+template <typename Traits>
+void FitsImage::decode(unsigned char *pixData)
+{
+	if (_isStreamed) {
+		decodeStreamed<Traits>(pixData);
+		return;
+	}
+	if (decodeStrips<Traits>(pixData))
+		return;
+	if (decodeBinned<Traits>(pixData))
+		return;
+
+	typedef typename Traits::type T;
+	fitsfile *fptr = pInfile->fitsPointer();
+	const bool isBayer = Traits::layout == PixelLayout::Bayer;
+
+	// Decimation happens at read time, the pipeline sees an already downscaled image
+	const ImageDim readDim = decimatedDim(_inDim, isBayer, _downscaleFactor);
+
+	std::valarray<T> contents;
+	int nbLanes = 0;
+	{
+		StageTimer timer(_metrics.readNs, "read");
+		if (!readImagePixMapped(_path, _headerInfo, readDim, isBayer, _downscaleFactor, contents)
+			&& !readCompressedImagePix(_path, _headerInfo, readDim, isBayer, _downscaleFactor, contents, &nbLanes)
+			&& !readImagePix(fptr, _inDim, isBayer, _downscaleFactor, contents))
+			return;
+	}
+	// a compressed read runs on as many cfitsio handles as it could open, one without a
+	// reentrant cfitsio
+	if (nbLanes > 0)
+		_metrics.threadsUsed = nbLanes;
+	const int64_t nbSamples = static_cast<int64_t>(contents.size());
+	_metrics.pixelsProcessed = nbSamples;
+	const int sampleBytes = _headerInfo.bitpix != 0 ? std::abs(_headerInfo.bitpix) / 8 : static_cast<int>(sizeof(T));
+	_metrics.bytesRead = _headerInfo.compressed ? _headerInfo.dataOffset + _headerInfo.compressedBytes
+		: _headerInfo.dataOffset + nbSamples * sampleBytes;
+	_metrics.peakBufferBytes = nbSamples * sizeof(T);
+
+	process<Traits>(contents, readDim, _outDim, _sanitizedBayerMode, _debayerMode, pixData, !_isTopDown, _metrics);
+}
+
+
+// Downscaled super pixel previews of mapped Bayer images: every output pixel is the mean of
+// the factor x factor CFA cells it covers, debayered and binned while the file is read.
+// Returns false for other images, which are decimated at read time.
+template <typename Traits>
+bool FitsImage::decodeBinned(unsigned char *pixData)
+{
+	typedef typename Traits::type T;
+	if (Traits::layout != PixelLayout::Bayer || _debayerMode != DebayerMode::SuperPixel || _downscaleFactor <= 1)
+		return false;
+
+	std::valarray<T> contents;
+	{
+		// the debayer is fused into the read
+		StageTimer timer(_metrics.readNs, "read");
+		if (!readImagePixBinned(_path, _headerInfo, _outDim, _sanitizedBayerMode, _downscaleFactor, contents))
+			return false;
+	}
+	const int64_t sourceRows = 2 * static_cast<int64_t>(_downscaleFactor) * _outDim.ny;
+	_metrics.pixelsProcessed = sourceRows * _headerInfo.naxes[0];
+	_metrics.bytesRead = _headerInfo.dataOffset + sourceRows * _headerInfo.naxes[0] * (std::abs(_headerInfo.bitpix) / 8);
+	_metrics.peakBufferBytes = static_cast<int64_t>(contents.size() * sizeof(T));
+
+	typedef PipelineTraits<Traits::bitpix, PixelLayout::Color, T> Reduced;
+	process<Reduced>(contents, _outDim, _outDim, "", DebayerMode::SuperPixel, pixData, !_isTopDown, _metrics);
+	return true;
+}
+
+
+// Statistics gathered strip by strip: exact histograms for 8 and 16 bit samples, the
+// same sample set as computeParamsAllChannels, or computeParamsMosaic for the colour
+// planes of a mosaic, for the other types
+template <typename T, bool = std::is_integral<T>::value && sizeof(T) <= 2>
+struct StripStats
+{
+	StreamingSamples<T> samples;
+
+	StripStats(const std::vector<size_t>& planeSizes, int bitdepth) : samples(planeSizes, bitdepth) {}
+	void add(int ch, const T *data, size_t n) { samples.add(ch, data, n); }
+	const StretchParams *params(StretchParams *params) {
+		samples.computeParams(params);
+		return params;
+	}
+};
+
+
 template <typename T>
-void process(std::valarray<T>& content, const ImageDim& inDim, const ImageDim& outDim, string bayer, int df) {
-	writeToLogFile("Process start");
+struct StripStats<T, true>
+{
+	StreamingHistograms<T> histograms;
+
+	StripStats(const std::vector<size_t>& planeSizes, int) : histograms(static_cast<int>(planeSizes.size())) {}
+	void add(int ch, const T *data, size_t n) { histograms.add(ch, data, n); }
+	const StretchParams *params(StretchParams *params) const {
+		histograms.computeParams(params);
+		return params;
+	}
+};
+
+
+// gzip-wrapped files: every inflated strip is debayered into the output planes and added
+// to the statistics while the next one is being inflated. The full mosaic never exists,
+// the read timing includes the debayer and statistics work it overlaps with.
+template <typename Traits>
+void FitsImage::decodeStreamed(unsigned char *pixData)
+{
+	typedef typename Traits::type T;
+	const bool isBayer = Traits::layout == PixelLayout::Bayer;
+	const ImageDim readDim = decimatedDim(_inDim, isBayer, _downscaleFactor);
+	const size_t outPlaneSize = static_cast<size_t>(_outDim.nx) * _outDim.ny;
+
+	std::valarray<T> contents(outPlaneSize * _outDim.nc);
+	std::valarray<T> debayered;
+	// statistics of a Bayer image are taken on the mosaic rows, see mosaicstats.h
+	const int cellsX = readDim.nx / 2;
+	StripStats<T> stats(isBayer ? mosaicPlaneSizes(cellsX, readDim.ny / 2) : std::vector<size_t>(_outDim.nc, outPlaneSize), Traits::bitpix);
+	std::vector<T> sites;
 
-	if (inDim.nc == 1) {
-		if (df > 1 && bayer.empty()) {
-			writeToLogFile("downscale start");
+	// Full resolution rows need the mosaic rows around them: each strip is appended to the
+	// last rows of the previous one, and its last rows wait for the next strip
+	const bool isFullRes = isBayer && _debayerMode != DebayerMode::SuperPixel;
+	const int halo = debayerHalo(_debayerMode);
+	std::valarray<T> window;
+	size_t windowSamples = 0;
+	int nextRow = 0;
 
-			// mono
-			downscale_mono(content, inDim.nx, inDim.ny, df);
+	auto fullResSink = [&](long k0, long k1, const std::valarray<T>& strip) {
+		const int m0 = static_cast<int>(2 * k0);
+		const int m1 = static_cast<int>(2 * k1);
+		const int first = std::max(nextRow - halo, 0);
+		const int last = m1 == _outDim.ny ? m1 : m1 - halo;
+		const size_t carried = static_cast<size_t>(m0 - first) * readDim.nx;
+		const size_t stripSamples = static_cast<size_t>(m1 - m0) * readDim.nx;
+		{
+			StageTimer timer(_metrics.debayerNs, "debayer");
+			if (window.size() < carried + stripSamples) {
+				std::valarray<T> grown(carried + stripSamples);
+				if (carried > 0)
+					std::copy_n(&window[0] + windowSamples - carried, carried, &grown[0]);
+				window.swap(grown);
+			}
+			else if (carried < windowSamples) {
+				std::copy(&window[0] + windowSamples - carried, &window[0] + windowSamples, &window[0]);
+			}
+			std::copy_n(&strip[0], stripSamples, &window[carried]);
+			windowSamples = carried + stripSamples;
+			debayerRows(_debayerMode, _sanitizedBayerMode, &window[0], static_cast<size_t>(readDim.nx), first, _outDim.nx, _outDim.ny,
+				nextRow, last, &contents[static_cast<size_t>(nextRow) * _outDim.nx], outPlaneSize);
 		}
-		else if (!bayer.empty()) {
-			writeToLogFile("debayer start " +  bayer);
 
-			// bayered 
-			int nbFinalPix = outDim.nx * outDim.ny * 3;
-			std::valarray<T> debayered = std::valarray<T>(nbFinalPix);
-			super_pixel(content, debayered, inDim.nx, inDim.ny, bayer, df);
-			content = debayered;
+		StageTimer timer(_metrics.statsNs, "stats");
+		addMosaicRows(&strip[0], static_cast<size_t>(readDim.nx), m0, m1, cellsX, _sanitizedBayerMode, stats, sites);
+		nextRow = last;
+	};
+
+	auto sink = [&](int c, long k0, long k1, const std::valarray<T>& strip) {
+		if (isFullRes) {
+			fullResSink(k0, k1, strip);
+			return;
+		}
+		const size_t stripPlaneSize = static_cast<size_t>(k1 - k0) * _outDim.nx;
+		const size_t rowOffset = static_cast<size_t>(k0) * _outDim.nx;
+		if (isBayer) {
+			StageTimer timer(_metrics.debayerNs, "debayer");
+			// the first strip is the tallest
+			if (debayered.size() < 3 * stripPlaneSize)
+				debayered.resize(3 * stripPlaneSize);
+			super_pixel(strip, debayered, readDim.nx, static_cast<int>(2 * (k1 - k0)), _sanitizedBayerMode, 1);
+			for (int ch = 0; ch < 3; ch++) {
+				std::copy_n(&debayered[ch * stripPlaneSize], stripPlaneSize, &contents[ch * outPlaneSize + rowOffset]);
+			}
 		}
+		else {
+			std::copy_n(&strip[0], stripPlaneSize, &contents[c * outPlaneSize + rowOffset]);
+		}
+
+		StageTimer timer(_metrics.statsNs, "stats");
+		if (isBayer)
+			addMosaicRows(&strip[0], static_cast<size_t>(readDim.nx), static_cast<int>(2 * k0), static_cast<int>(2 * k1), cellsX, _sanitizedBayerMode, stats, sites);
+		else
+			stats.add(c, &contents[c * outPlaneSize + rowOffset], stripPlaneSize);
+	};
+
+	GzipFile file;
+	size_t stripBytes = 0;
+	{
+		StageTimer timer(_metrics.readNs, "read");
+		if (file.open(_path))
+			stripBytes = readGzipStrips<T>(file, _headerInfo, readDim, isBayer, _downscaleFactor, sink);
 	}
-	else if (df > 1 && inDim.nc == 3) {
-		// 3 ch color
-		downscale_color(content, inDim.nx, inDim.ny, df);
+	if (stripBytes == 0) {
+		writeToLogFile("Streamed gzip read failed");
+		return;
 	}
-	writeToLogFile("Downscale and or debayer finish. Stretch start");
+	_metrics.pixelsProcessed = static_cast<int64_t>(readDim.nx) * readDim.ny * readDim.nc;
+	_metrics.bytesRead = file.compressedOffset();
+	_metrics.peakBufferBytes = static_cast<int64_t>((contents.size() + debayered.size() + window.size()) * sizeof(T) + stripBytes);
 
-	StretchParams stretchParams;
-	computeParamsAllChannels(content, &stretchParams, inDim.depth, outDim);
-	stretchAllChannels(content, stretchParams, outDim);
-	writeToLogFile("Process finish");
+	// the layout is already reduced to the output planes
+	typedef PipelineTraits<Traits::bitpix, Traits::layout == PixelLayout::Mono ? PixelLayout::Mono : PixelLayout::Color, T> Reduced;
+	StretchParams params;
+	process<Reduced>(contents, _outDim, _outDim, "", DebayerMode::SuperPixel, pixData, !_isTopDown, _metrics, stats.params(&params));
 }
 
 
-template <typename T>
-void setBitmap(const std::valarray<T>& contents, const ImageDim& outDim, unsigned char *pixData, bool shouldFlipV=false) {
-	writeToLogFile("setBitMap start");
-	auto& size = outDim;
+// Mapped images whose full-size buffers would exceed this are decoded strip by strip,
+// see FitsImageSetMemoryBudget
+static int64_t stripMemoryBudget = int64_t(256) << 20;
+
+// Sample bytes of one strip of the bounded-memory path, mosaic rows included
+constexpr size_t StripBytes = size_t(4) << 20;
 
-	int nbPixPerPlane = size.nx*size.ny;
+// Largest file window mapped at once by the strip path
+constexpr uint64_t MapWindowBytes = uint64_t(64) << 20;
 
-	for (int i = 0; i < size.ny; i++) {
-		int rowIdx = shouldFlipV ? size.ny - i - 1 : i;
+// Images above this are never mapped whole, a 32-bit process has 2 to 4 GB of address space
+constexpr uint64_t MaxWholeMapBytes = sizeof(void *) >= 8 ? ~uint64_t(0) : uint64_t(1) << 30;
 
-		for (int j = 0; j < size.nx; j++) {
-			for (int c = 0; c < size.nc; c++) {
-				pixData[(i * size.nx + j) * size.nc + c] = contents[rowIdx * size.nx + j + nbPixPerPlane * c];
+
+// Out-of-core decode of large mapped images: the output is produced in strips of a fixed
+// number of rows, twice. The first pass only feeds the statistics, the second one stretches
+// and packs every strip into the bitmap. The file is mapped one window of source rows at a
+// time and the sample buffers hold one strip, so files larger than memory or than the
+// address space go through a fixed budget. The price is a second conversion of the samples.
+template <typename Traits>
+bool FitsImage::decodeStrips(unsigned char *pixData)
+{
+	typedef typename Traits::type T;
+	const bool isBayer = Traits::layout == PixelLayout::Bayer;
+	const ImageDim readDim = decimatedDim(_inDim, isBayer, _downscaleFactor);
+	const size_t readSamples = static_cast<size_t>(readDim.nx) * readDim.ny * readDim.nc;
+	const size_t outPlaneSize = static_cast<size_t>(_outDim.nx) * _outDim.ny;
+	const size_t fullBytes = (readSamples + (isBayer ? 3 * outPlaneSize : 0)) * sizeof(T);
+	if (!isMappable(_headerInfo) || outPlaneSize == 0)
+		return false;
+	const uint64_t planeBytes = imagePlaneBytes(_headerInfo);
+	if (static_cast<int64_t>(fullBytes) <= stripMemoryBudget && planeBytes * readDim.nc <= MaxWholeMapBytes)
+		return false;
+
+	MappedFile file;
+	if (!file.openWindowed(_path) || !hasImageData(file.fileSize(), _headerInfo))
+		return false;
+	writeToLogFile("Strip decode start");
+
+	// rows [row0, row1) of channel c of the decimated image, as many rows per window as fit
+	const uint64_t rowBytes = static_cast<uint64_t>(_headerInfo.naxes[0]) * (std::abs(_headerInfo.bitpix) / 8);
+	auto readRows = [&](int c, int row0, int row1, T *dst) {
+		for (int r0 = row0; r0 < row1;) {
+			const uint64_t first = sourceRow(r0, isBayer, _downscaleFactor);
+			int r1 = r0 + 1;
+			while (r1 < row1 && (sourceRow(r1, isBayer, _downscaleFactor) - first + 1) * rowBytes <= MapWindowBytes) {
+				r1++;
+			}
+			const uint64_t length = (sourceRow(r1 - 1, isBayer, _downscaleFactor) - first + 1) * rowBytes;
+			const unsigned char *window = file.map(_headerInfo.dataOffset + c * planeBytes + first * rowBytes, static_cast<size_t>(length));
+			if (!window)
+				return false;
+			readMappedRows(window, _headerInfo, readDim, isBayer, _downscaleFactor, r0, r1, dst + static_cast<size_t>(r0 - row0) * readDim.nx);
+			r0 = r1;
+		}
+		return true;
+	};
+
+	// enough rows for every worker of the pool, the last strip may be shorter.
+	// A full resolution output row comes from one mosaic row, a super pixel one from two.
+	const bool isFullRes = isBayer && _debayerMode != DebayerMode::SuperPixel;
+	const int halo = debayerHalo(_debayerMode);
+	// Binned previews have no mosaic buffer, see decodeBinned.
+	const bool isBinned = isBayer && _debayerMode == DebayerMode::SuperPixel && _downscaleFactor > 1;
+	const int mosaicRowsPerRow = isBinned ? 0 : isFullRes ? 1 : 2;
+	const size_t rowSamples = isBayer ? mosaicRowsPerRow * static_cast<size_t>(readDim.nx) + 3 * _outDim.nx : static_cast<size_t>(readDim.nx) * readDim.nc;
+	const int minRows = 2 * static_cast<int>(ThreadPool::instance().size());
+	const int stripRows = std::min(_outDim.ny, std::max(static_cast<int>(StripBytes / (rowSamples * sizeof(T))), minRows));
+	// full resolution strips also read the halo rows above and below
+	const int mosaicRows = isFullRes ? stripRows + 2 * halo : 2 * stripRows;
+	std::valarray<T> mosaic(isBayer && !isBinned ? static_cast<size_t>(readDim.nx) * mosaicRows : 0);
+	const BinPattern binPattern(_sanitizedBayerMode);
+
+	// binned output rows [row0, row1) into dst, planes planeSize apart
+	const uint64_t binRowBytes = 2 * static_cast<uint64_t>(_downscaleFactor) * rowBytes;
+	auto readBinnedRows = [&](int row0, int row1, T *dst, size_t planeSize) {
+		const int windowRows = static_cast<int>(std::max<uint64_t>(1, MapWindowBytes / binRowBytes));
+		for (int r0 = row0; r0 < row1; r0 += windowRows) {
+			const int r1 = std::min(row1, r0 + windowRows);
+			const unsigned char *window = file.map(_headerInfo.dataOffset + r0 * binRowBytes, static_cast<size_t>((r1 - r0) * binRowBytes));
+			if (!window)
+				return false;
+			binMappedRows(window, _headerInfo, binPattern, _downscaleFactor, _outDim.nx, r0, r1, dst + static_cast<size_t>(r0 - row0) * _outDim.nx, planeSize);
+		}
+		return true;
+	};
+	std::valarray<T> strip(static_cast<size_t>(_outDim.nx) * stripRows * _outDim.nc);
+
+	// output rows [r0, r1) of every plane into strip, planes of (r1 - r0) rows
+	auto readStrip = [&](int r0, int r1) {
+		if (isBinned) {
+			StageTimer timer(_metrics.readNs, "read");
+			return readBinnedRows(r0, r1, &strip[0], static_cast<size_t>(r1 - r0) * _outDim.nx);
+		}
+		if (isFullRes) {
+			const int first = std::max(r0 - halo, 0);
+			{
+				StageTimer timer(_metrics.readNs, "read");
+				if (!readRows(0, first, std::min(r1 + halo, _outDim.ny), &mosaic[0]))
+					return false;
 			}
+			StageTimer timer(_metrics.debayerNs, "debayer");
+			debayerRows(_debayerMode, _sanitizedBayerMode, &mosaic[0], static_cast<size_t>(readDim.nx), first, _outDim.nx, _outDim.ny,
+				r0, r1, &strip[0], static_cast<size_t>(r1 - r0) * _outDim.nx);
+			return true;
+		}
+		if (isBayer) {
+			{
+				StageTimer timer(_metrics.readNs, "read");
+				if (!readRows(0, 2 * r0, 2 * r1, &mosaic[0]))
+					return false;
+			}
+			StageTimer timer(_metrics.debayerNs, "debayer");
+			super_pixel(mosaic, strip, readDim.nx, 2 * (r1 - r0), _sanitizedBayerMode, 1);
+			return true;
+		}
+		StageTimer timer(_metrics.readNs, "read");
+		const size_t stripPlaneSize = static_cast<size_t>(r1 - r0) * _outDim.nx;
+		for (int c = 0; c < readDim.nc; c++) {
+			if (!readRows(c, r0, r1, &strip[c * stripPlaneSize]))
+				return false;
 		}
+		return true;
+	};
+
+	// Bayer statistics are taken on the mosaic rows (see mosaicstats.h), the first pass
+	// doesn't debayer them
+	const bool isMosaicStats = isBayer && !isBinned;
+	const int cellsX = readDim.nx / 2;
+	StripStats<T> stats(isMosaicStats ? mosaicPlaneSizes(cellsX, readDim.ny / 2) : std::vector<size_t>(_outDim.nc, outPlaneSize), Traits::bitpix);
+	std::vector<T> sites;
+	for (int r0 = 0; r0 < _outDim.ny; r0 += stripRows) {
+		const int r1 = std::min(_outDim.ny, r0 + stripRows);
+		if (isMosaicStats) {
+			const int m0 = isFullRes ? r0 : 2 * r0;
+			const int m1 = isFullRes ? r1 : 2 * r1;
+			{
+				StageTimer timer(_metrics.readNs, "read");
+				if (!readRows(0, m0, m1, &mosaic[0]))
+					return false;
+			}
+			StageTimer timer(_metrics.statsNs, "stats");
+			addMosaicRows(&mosaic[0], static_cast<size_t>(readDim.nx), m0, m1, cellsX, _sanitizedBayerMode, stats, sites);
+			continue;
+		}
+		if (!readStrip(r0, r1))
+			return false;
+
+		StageTimer timer(_metrics.statsNs, "stats");
+		const size_t stripPlaneSize = static_cast<size_t>(r1 - r0) * _outDim.nx;
+		for (int ch = 0; ch < _outDim.nc; ch++) {
+			stats.add(ch, &strip[ch * stripPlaneSize], stripPlaneSize);
+		}
+	}
+
+	StretchParams params;
+	{
+		StageTimer timer(_metrics.statsNs, "stats");
+		stats.params(&params);
+	}
+	std::vector<StretchLUT<T>> luts;
+	{
+		StageTimer timer(_metrics.stretchNs, "stretch");
+		luts = buildStretchLUTs<Traits::outChannels, T>(params);
+	}
+
+	for (int r0 = 0; r0 < _outDim.ny; r0 += stripRows) {
+		const int r1 = std::min(_outDim.ny, r0 + stripRows);
+		if (!readStrip(r0, r1))
+			return false;
+
+		StageTimer timer(_metrics.packNs, "pack");
+		packRows<Traits::outChannels>(&strip[0], static_cast<size_t>(r1 - r0) * _outDim.nx, _outDim.nx, r1 - r0, r0, _outDim.ny,
+			luts, pixData, !_isTopDown);
 	}
-	
-	writeToLogFile("setBitMap finish");
+
+	// both passes read the samples, binned strips every row of the whole CFA cells they cover
+	const int64_t passSamples = isBinned ? 2 * static_cast<int64_t>(_downscaleFactor) * _outDim.ny * _headerInfo.naxes[0]
+		: static_cast<int64_t>(readSamples);
+	_metrics.pixelsProcessed = passSamples;
+	_metrics.bytesRead = _headerInfo.dataOffset + 2 * passSamples * (std::abs(_headerInfo.bitpix) / 8);
+	_metrics.peakBufferBytes = static_cast<int64_t>((mosaic.size() + strip.size()) * sizeof(T));
+	writeToLogFile("Strip decode finish");
+	return true;
+}
+
+
+template <int BITPIX, typename T>
+void FitsImage::decodeBitpix(unsigned char *pixData)
+{
+	if (_inDim.nc == 3)
+		decode<PipelineTraits<BITPIX, PixelLayout::Color, T>>(pixData);
+	else if (!_sanitizedBayerMode.empty())
+		decode<PipelineTraits<BITPIX, PixelLayout::Bayer, T>>(pixData);
+	else
+		decode<PipelineTraits<BITPIX, PixelLayout::Mono, T>>(pixData);
 }
 
 
 void FitsImage::getImagePix(unsigned char * pixData)
 {
-	PHDU& image = pInfile->pHDU();
+	if (!_imageHDU && !_isStreamed)
+		return;
+	// the serial fallback reads through the shared handle, which must point at the image
+	if (_imageHDU)
+		_imageHDU->makeThisCurrent();
 
-	const int downscale_factor = 1;
-	string bayer = _sanitizedBayerMode;
-	auto bitpix = image.bitpix();
+	// open and header timings belong to the constructor, the rest is per decode
+	const Metrics opened = _metrics;
+	_metrics = Metrics{};
+	_metrics.openNs = opened.openNs;
+	_metrics.headerNs = opened.headerNs;
+	_metrics.threadsUsed = ThreadPool::instance().size();
+	TraceScope trace("decode");
 
-	if (bitpix == Ishort) {
-		std::valarray<unsigned short> contents;
-		image.read(contents);
-		process(contents, _inDim, _outDim, bayer, downscale_factor);
-		setBitmap(contents, _outDim, pixData, !_isTopDown);
+	switch (_inDim.depth) {
+	case Ibyte:
+		decodeBitpix<8>(pixData);
+		break;
+	case Ishort:
+		decodeBitpix<16>(pixData);
+		break;
+	case Ilong:
+		// unsigned int only holds the usual BZERO 2^31 data, negative or scaled values need double
+		if (_headerInfo.bscale == 1 && _headerInfo.bzero == 2147483648.0)
+			decodeBitpix<32>(pixData);
+		else
+			decodeBitpix<32, double>(pixData);
+		break;
+	case Ifloat:
+		decodeBitpix<-32>(pixData);
+		break;
+	default:
+		// 64-bit integers and doubles
+		decodeBitpix<-64>(pixData);
+		break;
 	}
-	else {
-		std::valarray<float> contents;
-		image.read(contents);
-		process(contents, _inDim, _outDim, bayer, downscale_factor);
-		setBitmap(contents, _outDim, pixData, !_isTopDown);
+}
+
+
+void FitsImage::setDownscaleFactor(int factor)
+{
+	_downscaleFactor = factor < 1 ? 1 : factor;
+	_outDim = outputDimFor(_inDim, _sanitizedBayerMode, _downscaleFactor, _debayerMode);
+}
+
+
+void FitsImage::setDebayerMode(DebayerMode mode)
+{
+	_debayerMode = mode;
+	_outDim = outputDimFor(_inDim, _sanitizedBayerMode, _downscaleFactor, _debayerMode);
+}
+
+
+// Smallest factor that makes the output fit in maxWidth x maxHeight.
+// Decode, stretch and marshalling costs all drop with the square of it.
+void FitsImage::fitOutputSize(int maxWidth, int maxHeight)
+{
+	if (maxWidth <= 0 || maxHeight <= 0) {
+		setDownscaleFactor(1);
+		return;
+	}
+
+	const ImageDim fullDim = outputDimFor(_inDim, _sanitizedBayerMode, 1, _debayerMode);
+	const int fx = (fullDim.nx + maxWidth - 1) / maxWidth;
+	const int fy = (fullDim.ny + maxHeight - 1) / maxHeight;
+	setDownscaleFactor(std::max(fx, fy));
+	writeToLogFile(string_format("Downscale factor %d for %dx%d", _downscaleFactor, maxWidth, maxHeight));
+}
+
+
+bool FitsImage::probe(const string& path, ImageDim *outDim)
+{
+	FitsHeaderInfo info;
+	if (!probeFitsHeader(path, &info) || info.naxis < 2) {
+		writeToLogFile("Probe failed");
+		return false;
 	}
+
+	ImageDim inDim{};
+	inDim.nx = static_cast<int>(info.naxes[0]);
+	inDim.ny = static_cast<int>(info.naxes[1]);
+	inDim.nc = info.naxis == 3 ? 3 : 1;
+	inDim.depth = info.bitpix;
+
+	bool isTopDown = isTopDownRowOrder(info.rowOrder);
+	*outDim = outputDimFor(inDim, sanitizeBayerPattern(info.bayerPattern, info.bayerOffset[0], info.bayerOffset[1], isTopDown));
+	return true;
 }
 
 
@@ -220,3 +983,86 @@ ImageDim FitsImage::getFinalDim()
 	return _outDim;
 }
 
+
+extern "C" {
+	FitsImage *FitsImageCreate(const char * path) {
+		string str(path);
+
+		writeToLogFile(str);
+		return new FitsImage(str);
+	}
+
+	int FitsImageProbe(const char *path, ImageDim *outDim) {
+		return FitsImage::probe(string(path), outDim) ? 1 : 0;
+	}
+
+	FitsImage *FitsImageCreateEx(const char *path, int maxWidth, int maxHeight) {
+		FitsImage *fits = FitsImageCreate(path);
+		fits->fitOutputSize(maxWidth, maxHeight);
+		return fits;
+	}
+
+	ImageDim FitsImageGetDim(FitsImage *fits) {
+		return fits->getDim();
+	}
+
+	void FitsImageGetPixData(FitsImage *fits, unsigned char *data) {
+		return fits->getImagePix(data);
+	}
+
+	int FitsImageGetHeader(FitsImage *fits, char *buffer) {
+		string output = "";
+
+		auto m = fits->header;
+		for (auto it = m.begin(); it != m.end(); it++) {
+			output += (it->first) + ":" + (it->second) + "; ";
+		}
+
+		if (buffer != nullptr)
+			std::memcpy(buffer, output.c_str(), output.size() + 1);
+
+		return static_cast<int>(output.size());
+	}
+
+	void FitsImageSetDownscaleFactor(FitsImage *fits, int factor) {
+		fits->setDownscaleFactor(factor);
+	}
+
+	ImageDim FitsImageSetMaxOutputSize(FitsImage *fits, int maxWidth, int maxHeight) {
+		fits->fitOutputSize(maxWidth, maxHeight);
+		return fits->getFinalDim();
+	}
+
+	ImageDim FitsImageGetOutputDim(FitsImage *fits) {
+		return fits->getFinalDim();
+	}
+
+	ImageDim FitsImageSetDebayerMode(FitsImage *fits, int mode) {
+		fits->setDebayerMode(mode == 1 ? DebayerMode::Bilinear : mode == 2 ? DebayerMode::VNG : DebayerMode::SuperPixel);
+		return fits->getFinalDim();
+	}
+
+	void FitsImageDestroy(FitsImage *fits) {
+		delete fits;
+	}
+
+	void FitsImageGetMetrics(FitsImage *fits, Metrics *metrics) {
+		*metrics = fits->getMetrics();
+	}
+
+	void FitsImageSetThreadCount(int nbThreads) {
+		ThreadPool::instance().resize(nbThreads > 0 ? static_cast<unsigned>(nbThreads) : 0);
+	}
+
+	void FitsImageSetMemoryBudget(long long bytes) {
+		stripMemoryBudget = bytes > 0 ? bytes : 0;
+	}
+
+	void FitsImageSetTracing(int enabled) {
+		Tracer::instance().setEnabled(enabled != 0);
+	}
+
+	int FitsImageExportTrace(const char *path) {
+		return Tracer::instance().exportChromeTrace(path) ? 1 : 0;
+	}
+}
@@ -24,12 +24,17 @@
 #include <iostream>
 #include <CCfits/CCfits>
 #include "log.h"
+#include "FitsHeader.h"
+#include "threadpool.h"
+#include "platform.h"
+#include "metrics.h"
+#include "pixeltraits.h"
 
 using namespace CCfits;
 using std::string;
 
 
-__declspec(dllexport) typedef struct {
+typedef struct {
 	int nx;
 	int ny;
 	int nc;
@@ -37,11 +42,23 @@ __declspec(dllexport) typedef struct {
 } ImageDim;
 
 
+// How Bayer mosaics become RGB
+enum class DebayerMode
+{
+	SuperPixel = 0,     // one RGB pixel per 2x2 CFA cell, half resolution
+	Bilinear = 1,       // one RGB pixel per photosite, see bilinear.h
+	VNG = 2,            // same resolution, edge-aware and slower, see vng.h
+};
+
+
 class FitsImage
 {
 	ImageDim _inDim;
 	ImageDim _outDim;
 	std::unique_ptr<FITS> pInfile;
+	HDU *_imageHDU;       // owned by pInfile, the primary or the compressed image extension
+	string _path;
+	FitsHeaderInfo _headerInfo;
 
 public:
 	std::map<string, string> header;
@@ -50,48 +67,79 @@ public:
 	void getImagePix(unsigned char *pixData);
 	ImageDim getDim();
 	ImageDim getFinalDim();
+	void setDownscaleFactor(int factor);
+	void fitOutputSize(int maxWidth, int maxHeight);
+	void setDebayerMode(DebayerMode mode);
+	const Metrics& getMetrics() const { return _metrics; }
+
+	static bool probe(const string& path, ImageDim *outDim);
 
 private:
 	string _sanitizedBayerMode;
-	boolean _isTopDown;
+	bool _isTopDown;
+	bool _isStreamed;     // gzipped, decoded by gzipread.h without CCfits
+	int _downscaleFactor;
+	DebayerMode _debayerMode;
+	Metrics _metrics;
+
+	bool openImageHDU();
+	template <int BITPIX, typename T = typename BitpixTraits<BITPIX>::type> void decodeBitpix(unsigned char *pixData);
+	template <typename Traits> void decode(unsigned char *pixData);
+	template <typename Traits> void decodeStreamed(unsigned char *pixData);
+	template <typename Traits> bool decodeStrips(unsigned char *pixData);
+	template <typename Traits> bool decodeBinned(unsigned char *pixData);
 };
 
 extern "C" {
-	__declspec(dllexport) FitsImage *FitsImageCreate(const char * path) {
-		string str(path);
+	VIEWER_EXPORT FitsImage *FitsImageCreate(const char * path);
+
+	// Output dimensions from the header blocks only, no FitsImage needed.
+	// Returns 0 if the file can't be parsed.
+	VIEWER_EXPORT int FitsImageProbe(const char *path, ImageDim *outDim);
+
+	// Same as FitsImageCreate, with the downscale factor picked so that the
+	// output fits in maxWidth x maxHeight. Non-positive sizes mean full resolution.
+	VIEWER_EXPORT FitsImage *FitsImageCreateEx(const char *path, int maxWidth, int maxHeight);
+
+	VIEWER_EXPORT ImageDim FitsImageGetDim(FitsImage *fits);
+
+	VIEWER_EXPORT void FitsImageGetPixData(FitsImage *fits, unsigned char *data);
+
+	// Writes "key:value; " pairs to buffer if not null, returns their length
+	VIEWER_EXPORT int FitsImageGetHeader(FitsImage *fits, char *buffer);
+
+	// Preview mode: only every factor-th row and column is read from the file.
+	// Call before FitsImageGetOutputDim/FitsImageGetPixData.
+	VIEWER_EXPORT void FitsImageSetDownscaleFactor(FitsImage *fits, int factor);
 
-		writeToLogFile(str);
-		return new FitsImage(str);
-	}
+	// Re-targets an existing image, returns the new output dimensions
+	// that the buffer passed to FitsImageGetPixData must hold.
+	VIEWER_EXPORT ImageDim FitsImageSetMaxOutputSize(FitsImage *fits, int maxWidth, int maxHeight);
 
-	__declspec(dllexport) ImageDim FitsImageGetDim(FitsImage *fits) {
-		return fits->getDim();
-	}
+	VIEWER_EXPORT ImageDim FitsImageGetOutputDim(FitsImage *fits);
 
-	__declspec(dllexport) void FitsImageGetPixData(FitsImage *fits, unsigned char *data) {
-		return fits->getImagePix(data);
-	}
+	// 0 for super pixel (default), 1 for full resolution bilinear, 2 for full resolution VNG.
+	// Only Bayer images are affected.
+	// Call before FitsImageSetMaxOutputSize/FitsImageGetPixData, returns the new output dimensions.
+	VIEWER_EXPORT ImageDim FitsImageSetDebayerMode(FitsImage *fits, int mode);
 
-	__declspec(dllexport) int FitsImageGetHeader(FitsImage *fits, char *buffer) {
-		string output = "";
+	VIEWER_EXPORT void FitsImageDestroy(FitsImage *fits);
 
-		auto m = fits->header;
-		for (auto it = m.begin(); it != m.end(); it++) {
-			output += (it->first) + ":" + (it->second) + "; ";
-		}
+	// Stage timings and counters of the last FitsImageGetPixData, see metrics.h
+	VIEWER_EXPORT void FitsImageGetMetrics(FitsImage *fits, Metrics *metrics);
 
-		if (buffer != nullptr)
-			strcpy_s(buffer, output.size() + 1, output.c_str());
+	// Number of threads used by the decode pipeline, 0 for one per core.
+	// Must not be called while an image is being decoded.
+	VIEWER_EXPORT void FitsImageSetThreadCount(int nbThreads);
 
-		return output.size();
-	}
+	// Mapped images whose full-size sample buffers would take more than bytes (256 MB by default)
+	// are decoded in fixed-height strips, in two passes over the file. 0 streams every image.
+	// Must not be called while an image is being decoded.
+	VIEWER_EXPORT void FitsImageSetMemoryBudget(long long bytes);
 
-	__declspec(dllexport) ImageDim FitsImageGetOutputDim(FitsImage *fits) {
-		auto size = fits->getDim();
-		return fits->getFinalDim();
-	}
+	// Starts or stops recording pipeline stages and pool tasks. On by default in ENABLE_LOGGING builds.
+	VIEWER_EXPORT void FitsImageSetTracing(int enabled);
 
-	__declspec(dllexport) void FitsImageDestroy(FitsImage *fits) {
-		delete fits;
-	}
-}
\ No newline at end of file
+	// Writes the events recorded so far as Chrome trace-event JSON, returns 0 if the file can't be written.
+	VIEWER_EXPORT int FitsImageExportTrace(const char *path);
+}
@@ -0,0 +1,149 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+
+#include "pch.h"
+#include "GzipFile.h"
+#include <fstream>
+#include <vector>
+#include <algorithm>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+
+GzipFile::GzipFile() : _file(nullptr) {}
+
+
+GzipFile::~GzipFile()
+{
+	close();
+}
+
+
+bool GzipFile::isGzip(const string& path)
+{
+	std::ifstream f(path, std::ios::binary);
+	unsigned char magic[2] = {};
+	return f.read(reinterpret_cast<char *>(magic), 2) && magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+
+#ifdef HAVE_ZLIB
+bool GzipFile::supported()
+{
+	return true;
+}
+
+
+bool GzipFile::open(const string& path)
+{
+	close();
+	gzFile file = gzopen(path.c_str(), "rb");
+	if (!file)
+		return false;
+	// the default 8K input buffer means a syscall every few rows
+	gzbuffer(file, 256 * 1024);
+	_file = file;
+	return true;
+}
+
+
+void GzipFile::close()
+{
+	if (_file) {
+		gzclose_r(static_cast<gzFile>(_file));
+		_file = nullptr;
+	}
+}
+
+
+bool GzipFile::read(void *data, size_t size)
+{
+	if (!_file)
+		return false;
+	unsigned char *out = static_cast<unsigned char *>(data);
+	// gzread takes an unsigned int length
+	while (size > 0) {
+		const unsigned chunk = static_cast<unsigned>(std::min<size_t>(size, 1u << 30));
+		const int n = gzread(static_cast<gzFile>(_file), out, chunk);
+		if (n <= 0)
+			return false;
+		out += n;
+		size -= static_cast<size_t>(n);
+	}
+	return true;
+}
+
+
+bool GzipFile::skip(size_t size)
+{
+	std::vector<unsigned char> scratch(std::min<size_t>(size, 64 * 1024));
+	while (size > 0) {
+		const size_t chunk = std::min(size, scratch.size());
+		if (!read(scratch.data(), chunk))
+			return false;
+		size -= chunk;
+	}
+	return true;
+}
+
+
+long long GzipFile::compressedOffset() const
+{
+	return _file ? static_cast<long long>(gzoffset(static_cast<gzFile>(_file))) : 0;
+}
+#else
+bool GzipFile::supported()
+{
+	return false;
+}
+
+
+bool GzipFile::open(const string& path)
+{
+	return false;
+}
+
+
+void GzipFile::close()
+{
+}
+
+
+bool GzipFile::read(void *data, size_t size)
+{
+	return false;
+}
+
+
+bool GzipFile::skip(size_t size)
+{
+	return false;
+}
+
+
+long long GzipFile::compressedOffset() const
+{
+	return 0;
+}
+#endif
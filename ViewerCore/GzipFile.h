@@ -0,0 +1,57 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+
+#pragma once
+#include <string>
+#include <cstddef>
+
+using std::string;
+
+
+// Sequential reader of a gzip-wrapped file (.fits.gz), inflating as it goes.
+// Only functional in builds with zlib (HAVE_ZLIB), open fails otherwise and the
+// caller leaves the file to cfitsio, which inflates it whole in memory.
+class GzipFile
+{
+public:
+	GzipFile();
+	~GzipFile();
+	GzipFile(const GzipFile&) = delete;
+	GzipFile& operator=(const GzipFile&) = delete;
+
+	// Checks the gzip magic bytes, works without zlib
+	static bool isGzip(const string& path);
+	static bool supported();
+
+	bool open(const string& path);
+	void close();
+
+	// Inflates exactly size bytes, false on a truncated or corrupt stream
+	bool read(void *data, size_t size);
+	bool skip(size_t size);
+
+	// Compressed bytes consumed so far
+	long long compressedOffset() const;
+
+private:
+	void *_file;
+};
@@ -0,0 +1,220 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+#include "pch.h"
+#include "MappedFile.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+#ifdef _WIN32
+MappedFile::MappedFile() : _data(nullptr), _size(0), _view(nullptr), _viewSize(0), _fileSize(0),
+	_file(INVALID_HANDLE_VALUE), _mapping(nullptr) {}
+#else
+MappedFile::MappedFile() : _data(nullptr), _size(0), _view(nullptr), _viewSize(0), _fileSize(0), _fd(-1) {}
+#endif
+
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+
+#ifdef _WIN32
+bool MappedFile::openWindowed(const string& path)
+{
+	close();
+
+	_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (_file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(_file, &fileSize) || fileSize.QuadPart == 0) {
+		close();
+		return false;
+	}
+
+	_mapping = CreateFileMappingA(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (_mapping == nullptr) {
+		close();
+		return false;
+	}
+	_fileSize = static_cast<uint64_t>(fileSize.QuadPart);
+	return true;
+}
+
+
+bool MappedFile::open(const string& path)
+{
+	if (!openWindowed(path))
+		return false;
+	if (_fileSize > SIZE_MAX || !map(0, static_cast<size_t>(_fileSize))) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+
+const unsigned char *MappedFile::map(uint64_t offset, size_t length)
+{
+	if (_mapping == nullptr || length == 0 || offset + length > _fileSize)
+		return nullptr;
+	unmap();
+
+	static const uint64_t granularity = []() {
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return static_cast<uint64_t>(info.dwAllocationGranularity);
+	}();
+	const uint64_t start = offset - offset % granularity;
+	const size_t viewSize = static_cast<size_t>(offset - start) + length;
+	_view = static_cast<const unsigned char *>(MapViewOfFile(_mapping, FILE_MAP_READ,
+		static_cast<DWORD>(start >> 32), static_cast<DWORD>(start & 0xFFFFFFFF), viewSize));
+	if (_view == nullptr)
+		return nullptr;
+	_viewSize = viewSize;
+	_data = _view + (offset - start);
+	_size = length;
+	return _data;
+}
+
+
+void MappedFile::unmap()
+{
+	if (_view)
+		UnmapViewOfFile(_view);
+	_view = nullptr;
+	_viewSize = 0;
+	_data = nullptr;
+	_size = 0;
+}
+
+
+void MappedFile::close()
+{
+	unmap();
+	if (_mapping)
+		CloseHandle(_mapping);
+	if (_file != INVALID_HANDLE_VALUE)
+		CloseHandle(_file);
+	_fileSize = 0;
+	_mapping = nullptr;
+	_file = INVALID_HANDLE_VALUE;
+}
+#else
+bool MappedFile::open(const string& path)
+{
+	close();
+
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0
+		|| static_cast<unsigned long long>(st.st_size) > SIZE_MAX) {
+		::close(fd);
+		return false;
+	}
+
+	void *p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (p == MAP_FAILED)
+		return false;
+
+	madvise(p, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+	_view = _data = static_cast<const unsigned char *>(p);
+	_viewSize = _size = static_cast<size_t>(st.st_size);
+	_fileSize = static_cast<uint64_t>(st.st_size);
+	return true;
+}
+
+
+bool MappedFile::openWindowed(const string& path)
+{
+	close();
+
+	_fd = ::open(path.c_str(), O_RDONLY);
+	if (_fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(_fd, &st) != 0 || st.st_size == 0) {
+		close();
+		return false;
+	}
+	_fileSize = static_cast<uint64_t>(st.st_size);
+	return true;
+}
+
+
+const unsigned char *MappedFile::map(uint64_t offset, size_t length)
+{
+	if (_fd < 0 || length == 0 || offset + length > _fileSize)
+		return nullptr;
+	unmap();
+
+	static const uint64_t pageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+	const uint64_t start = offset - offset % pageSize;
+	const size_t viewSize = static_cast<size_t>(offset - start) + length;
+	void *p = mmap(nullptr, viewSize, PROT_READ, MAP_PRIVATE, _fd, static_cast<off_t>(start));
+	if (p == MAP_FAILED)
+		return nullptr;
+
+	// the whole window is about to be read, start the readahead for all of it
+	madvise(p, viewSize, MADV_WILLNEED);
+	_view = static_cast<const unsigned char *>(p);
+	_viewSize = viewSize;
+	_data = _view + (offset - start);
+	_size = length;
+	return _data;
+}
+
+
+void MappedFile::unmap()
+{
+	if (_view)
+		munmap(const_cast<unsigned char *>(_view), _viewSize);
+	_view = nullptr;
+	_viewSize = 0;
+	_data = nullptr;
+	_size = 0;
+}
+
+
+void MappedFile::close()
+{
+	unmap();
+	if (_fd >= 0)
+		::close(_fd);
+	_fd = -1;
+	_fileSize = 0;
+}
+#endif
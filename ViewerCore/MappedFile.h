@@ -0,0 +1,68 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+#pragma once
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+using std::string;
+
+
+// Read-only memory mapping of a whole file, or of one window of it at a time for files
+// that don't fit the address space
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool open(const string& path);
+	// Opens the file without mapping it, see map
+	bool openWindowed(const string& path);
+	void close();
+
+	// Maps bytes [offset, offset + length) of a file opened with openWindowed in place of
+	// the previous window. Returns the byte at offset, nullptr on failure.
+	const unsigned char *map(uint64_t offset, size_t length);
+
+	// whole file or current window
+	const unsigned char *data() const { return _data; }
+	size_t size() const { return _size; }
+	uint64_t fileSize() const { return _fileSize; }
+
+private:
+	void unmap();
+
+	const unsigned char *_data;
+	size_t _size;
+	const unsigned char *_view;   // start of the mapping, aligned below _data
+	size_t _viewSize;
+	uint64_t _fileSize;
+#ifdef _WIN32
+	void *_file;
+	void *_mapping;
+#else
+	int _fd;              // kept open by openWindowed only
+#endif
+};
@@ -24,9 +24,22 @@
 #define Stretch_h
 
 #include "FitsImage.h"
-#include <ppl.h>
-
-using namespace concurrency;
+#include "threadpool.h"
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <algorithm>
+#include <type_traits>
+#include <limits>
+#include <cmath>
+
+#if defined(__SSSE3__) || defined(__AVX__)
+#define STRETCH_SSSE3
+#include <tmmintrin.h>
+#elif defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define STRETCH_SSE2
+#include <emmintrin.h>
+#endif
 
 
 struct StretchParams1Channel
@@ -59,41 +72,13 @@ struct StretchParams
 };
 
 
-template <typename T>
-T median(std::valarray<T>& values) {
-	const int middle = (int)(values.size() / 2);
-	std::nth_element(std::begin(values), std::begin(values) + middle, std::end(values));
-	return values[middle];
-}
-
-
+// Turns the median and the median absolute deviation of a channel into stretch parameters
 // See section 8.5.7 in above link  https://pixinsight.com/doc/docs/XISF-1.0-spec/XISF-1.0-spec.html
-template <typename T>
-void computeParamsOneChannel(std::valarray<T>& buffer, int offset, StretchParams1Channel *params, int inputRange, int height, int width) {
-	// Find the median sample.
-	constexpr int maxSamples = 500000;
-	const int sampleBy = width * height < maxSamples ? 1 : width * height / maxSamples;
-	// Find the Median deviation: 1.4826 * median of abs(sample[i] - median).
-	const int numSamples = width * height / sampleBy;
-	std::valarray<T> samples = buffer[std::slice(offset, numSamples, sampleBy)];
-	T medianSample = median(samples);
-
-	auto& deviations = samples;
-
-    // Can't use abs because of unsigned value substraction
-    for (int i=0; i<numSamples; i++) {
-        if (medianSample > samples[i])
-            deviations[i] = medianSample - samples[i];
-        else {
-            deviations[i] = samples[i] - medianSample;
-        }
-    }
-	
+inline void setParamsFromMedianAndMAD(StretchParams1Channel *params, float medianSample, float medDev, int inputRange) {
     // Maximum possible input value (e.g. 1024*64 - 1 for a 16 bit unsigned int).
     params->max_input = inputRange > 1 ? inputRange - 1 : inputRange;
     
 	// Shift everything to 0 -> 1.0.
-	const float medDev = median(deviations);
 	const float normalizedMedian = medianSample / static_cast<float>(inputRange);
 	const float MADN = 1.4826 * medDev / static_cast<float>(inputRange);
 	const bool upperHalf = normalizedMedian > 0.5;
@@ -125,57 +110,375 @@ void computeParamsOneChannel(std::valarray<T>& buffer, int offset, StretchParams
 }
 
 
+// Pixels per tile of the parallel statistics passes, small enough to stay in L2
+constexpr size_t StatsTileSize = 1 << 16;
+
+
+// Element-wise sum of two partial histograms, the join of the histogram reductions
+template <typename Count>
+void addHistogram(std::vector<Count>& into, const std::vector<uint32_t>& from) {
+	for (size_t b = 0; b < into.size(); b++) {
+		into[b] += from[b];
+	}
+}
+
+
+// Exact value at sorted position rank of values, all of them within [lo, hi]. A 64K-bin
+// histogram built in parallel tiles narrows the search down to one bin, nth_element then
+// only runs on the values of that bin. values is reordered.
+template <typename T>
+T parallelSelect(std::vector<T>& values, size_t rank, T lo, T hi) {
+	constexpr size_t nbBins = 65536;
+	if (!(hi > lo))
+		return lo;
+
+	const double scale = (nbBins - 1) / (static_cast<double>(hi) - static_cast<double>(lo));
+	auto binOf = [&](T v) {
+		double x = (static_cast<double>(v) - static_cast<double>(lo)) * scale;
+		x = x > 0 ? x : 0;
+		x = x < nbBins - 1 ? x : nbBins - 1;
+		return static_cast<size_t>(x);
+	};
+
+	const std::vector<uint32_t> histogram = parallel_reduce(values.size(), StatsTileSize, std::vector<uint32_t>(nbBins, 0),
+		[&](size_t begin, size_t end, std::vector<uint32_t>& h) {
+			for (size_t i = begin; i < end; i++) {
+				h[binOf(values[i])]++;
+			}
+		}, addHistogram<uint32_t>);
+
+	size_t below = 0;
+	size_t bin = 0;
+	for (; bin < nbBins - 1 && below + histogram[bin] <= rank; bin++) {
+		below += histogram[bin];
+	}
+
+	std::vector<T> candidates = parallel_reduce(values.size(), StatsTileSize, std::vector<T>(),
+		[&](size_t begin, size_t end, std::vector<T>& local) {
+			for (size_t i = begin; i < end; i++) {
+				if (binOf(values[i]) == bin) local.push_back(values[i]);
+			}
+		},
+		[](std::vector<T>& into, const std::vector<T>& from) {
+			into.insert(into.end(), from.begin(), from.end());
+		});
+
+	const size_t localRank = std::min(rank - below, candidates.size() - 1);
+	std::nth_element(candidates.begin(), candidates.begin() + localRank, candidates.end());
+	return candidates[localRank];
+}
+
+
+// Distance between two statistics samples of a channel of nbPix pixels: up to 500k
+// samples are taken, every sampleBy-th pixel starting from the first one
+inline size_t sampleSpacing(size_t nbPix) {
+	constexpr size_t maxSamples = 500000;
+	return nbPix < maxSamples ? 1 : nbPix / maxSamples;
+}
+
+
+// NaN and infinite pixels of floating point images carry no level, the statistics skip them
 template <typename T>
-void stretchOneChannel(std::valarray<T>& buffer, int offset,
-	const StretchParams1Channel& stretch_params,
-	int image_height, int image_width) {
-	// We're outputting uint8, so the max output is 255.
-	constexpr int maxOutput = 255;
+inline bool isFiniteSample(T v, std::true_type) {
+	return std::isfinite(v);
+}
 
-	// Maximum possible input value (e.g. 1024*64 - 1 for a 16 bit unsigned int).
-	int maxInput = stretch_params.max_input;
+template <typename T>
+inline bool isFiniteSample(T, std::false_type) {
+	return true;
+}
+
+template <typename T>
+inline bool isFiniteSample(T v) {
+	return isFiniteSample(v, std::is_floating_point<T>());
+}
 
-	const float midtones = stretch_params.midtones;
-	const float highlights = stretch_params.highlights;
-	const float shadows = stretch_params.shadows;
 
-	// Precomputed expressions moved out of the loop.
-	// hightlights - shadows, protecting for divide-by-0, in a 0->1.0 scale.
-	const float hsRangeFactor = highlights == shadows ? 1.0f : 1.0f / (highlights - shadows);
-	// Shadow and highlight values translated to the ADU scale.
-	const T nativeShadows = shadows * maxInput;
-	const T nativeHighlights = highlights * maxInput;
-	// Constants based on above needed for the stretch calculations.
-	const float k1 = (midtones - 1) * hsRangeFactor * maxOutput / maxInput;
-	const float k2 = ((2 * midtones) - 1) * hsRangeFactor / maxInput;
+// Min and max of the finite samples of a channel and the number of the others, the
+// accumulator of the sampling reductions
+template <typename T>
+struct SampleRange
+{
+	T lo = std::numeric_limits<T>::max();
+	T hi = std::numeric_limits<T>::lowest();
+	size_t nonFinite = 0;
+
+	void add(T v) {
+		if (!isFiniteSample(v)) {
+			nonFinite++;
+			return;
+		}
+		if (v < lo) lo = v;
+		if (v > hi) hi = v;
+	}
+
+	void merge(const SampleRange& from) {
+		lo = std::min(lo, from.lo);
+		hi = std::max(hi, from.hi);
+		nonFinite += from.nonFinite;
+	}
+};
+
+
+// Drops the samples range has counted as non finite, false if none is left
+template <typename T>
+bool keepFiniteSamples(std::vector<T>& samples, const SampleRange<T>& range) {
+	if (range.nonFinite > 0) {
+		samples.erase(std::remove_if(samples.begin(), samples.end(), [](T v) { return !isFiniteSample(v); }), samples.end());
+	}
+	return !samples.empty();
+}
+
+
+// Median and MAD of the samples of a channel, all of them within [lo, hi]. samples is reordered.
+template <typename T>
+void setParamsFromSamples(std::vector<T>& samples, T lo, T hi, StretchParams1Channel *params, int inputRange) {
+	const size_t middle = samples.size() / 2;
+	const T medianSample = parallelSelect(samples, middle, lo, hi);
 
+	auto& deviations = samples;
 
-	for (int i = offset; i < offset + image_width * image_height; i++) {
-		const T input = buffer[i];
-		if (input < nativeShadows)
-			buffer[i] = 0;
-		else if (input >= nativeHighlights)
-			buffer[i] = maxOutput;
-		else {
-			const T inputFloored = (input - nativeShadows);
-			buffer[i] = (inputFloored * k1) / (inputFloored * k2 - midtones);
+    // Can't use abs because of unsigned value substraction
+	parallel_for_tiles(samples.size(), StatsTileSize, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			if (medianSample > samples[i])
+				deviations[i] = medianSample - samples[i];
+			else {
+				deviations[i] = samples[i] - medianSample;
+			}
 		}
+	});
+	const T maxDev = std::max<T>(hi - medianSample, medianSample - lo);
+
+	const float medDev = parallelSelect(deviations, middle, T(0), maxDev);
+	setParamsFromMedianAndMAD(params, medianSample, medDev, inputRange);
+}
+
+
+// Median and MAD from a sample of up to 500k pixels, for any pixel type.
+// Sampling, min/max and both selections run in parallel tiles so that a single
+// channel uses all cores.
+template <typename T>
+void computeParamsOneChannelSampled(std::valarray<T>& buffer, size_t offset, StretchParams1Channel *params, int inputRange, int height, int width) {
+	const size_t nbPix = static_cast<size_t>(width) * height;
+	// Find the median sample.
+	const size_t sampleBy = sampleSpacing(nbPix);
+	// Find the Median deviation: 1.4826 * median of abs(sample[i] - median).
+	const size_t numSamples = nbPix / sampleBy;
+	if (numSamples == 0)
+		return;
+
+	const T *data = &buffer[offset];
+	std::vector<T> samples(numSamples);
+	const SampleRange<T> range = parallel_reduce(samples.size(), StatsTileSize, SampleRange<T>(),
+		[&](size_t begin, size_t end, SampleRange<T>& local) {
+			for (size_t i = begin; i < end; i++) {
+				const T v = data[i * sampleBy];
+				samples[i] = v;
+				local.add(v);
+			}
+		},
+		[](SampleRange<T>& into, const SampleRange<T>& from) {
+			into.merge(from);
+		});
+	if (keepFiniteSamples(samples, range))
+		setParamsFromSamples(samples, range.lo, range.hi, params, inputRange);
+}
+
+
+// Value at sorted position rank, i.e. the smallest bin whose cumulative count exceeds rank.
+// Same element as nth_element picks for the median.
+inline int histogramRank(const std::vector<uint64_t>& histogram, uint64_t rank) {
+	uint64_t cumulative = 0;
+	for (size_t v = 0; v < histogram.size(); v++) {
+		cumulative += histogram[v];
+		if (cumulative > rank)
+			return static_cast<int>(v);
+	}
+	return static_cast<int>(histogram.size()) - 1;
+}
+
+
+// Pixels per partial histogram reduction, few enough for 32-bit bins
+constexpr size_t HistogramSliceSize = size_t(1) << 31;
+
+
+// Adds n values of an 8 or 16 bit channel to histogram: per-chunk 32-bit partial histograms
+// over cache-sized tiles, merged into the 64-bit counts
+template <typename T>
+void accumulateHistogram(const T *data, size_t n, std::vector<uint64_t>& histogram) {
+	for (size_t first = 0; first < n; first += HistogramSliceSize) {
+		const T *slice = data + first;
+		const std::vector<uint32_t> partial = parallel_reduce(std::min(n - first, HistogramSliceSize), StatsTileSize,
+			std::vector<uint32_t>(histogram.size(), 0),
+			[&](size_t begin, size_t end, std::vector<uint32_t>& h) {
+				for (size_t i = begin; i < end; i++) {
+					h[slice[i]]++;
+				}
+			}, addHistogram<uint32_t>);
+		addHistogram(histogram, partial);
+	}
+}
+
+
+// Median and MAD read from the cumulative sums of the histogram of all nbPix pixels
+inline void setParamsFromHistogram(const std::vector<uint64_t>& histogram, uint64_t nbPix, StretchParams1Channel *params, int inputRange) {
+	const size_t nbBins = histogram.size();
+	const uint64_t middle = nbPix / 2;
+	const int medianSample = histogramRank(histogram, middle);
+
+	// Histogram of |v - median| folded around the median
+	std::vector<uint64_t> deviations(nbBins, 0);
+	for (size_t v = 0; v < nbBins; v++) {
+		deviations[std::abs(static_cast<int>(v) - medianSample)] += histogram[v];
 	}
+	const int medDev = histogramRank(deviations, middle);
 
+	setParamsFromMedianAndMAD(params, static_cast<float>(medianSample), static_cast<float>(medDev), inputRange);
 }
 
 
+// Exact median and MAD over all pixels of an 8 or 16 bit channel, no sample copy and
+// no partial sort
 template <typename T>
-int calculateFloatInputRange(std::valarray<T>& buffer, int offset, int height, int width)
+void computeParamsOneChannelHistogram(const std::valarray<T>& buffer, size_t offset, StretchParams1Channel *params, int inputRange, int height, int width) {
+	const size_t nbPix = static_cast<size_t>(width) * height;
+	if (nbPix == 0)
+		return;
+
+	std::vector<uint64_t> histogram(size_t(1) << (8 * sizeof(T)), 0);
+	accumulateHistogram(&buffer[offset], nbPix, histogram);
+	setParamsFromHistogram(histogram, nbPix, params, inputRange);
+}
+
+
+template <typename T>
+void computeParamsOneChannel(std::valarray<T>& buffer, size_t offset, StretchParams1Channel *params, int inputRange, int height, int width, std::true_type) {
+	computeParamsOneChannelHistogram(buffer, offset, params, inputRange, height, width);
+}
+
+
+template <typename T>
+void computeParamsOneChannel(std::valarray<T>& buffer, size_t offset, StretchParams1Channel *params, int inputRange, int height, int width, std::false_type) {
+	computeParamsOneChannelSampled(buffer, offset, params, inputRange, height, width);
+}
+
+
+// 8 and 16 bit integers go through the exact histogram path, everything else is sampled
+template <typename T>
+void computeParamsOneChannel(std::valarray<T>& buffer, size_t offset, StretchParams1Channel *params, int inputRange, int height, int width) {
+	typedef std::integral_constant<bool, std::is_integral<T>::value && sizeof(T) <= 2> useHistogram;
+	computeParamsOneChannel(buffer, offset, params, inputRange, height, width, useHistogram());
+}
+
+
+// Midtones transfer function of one channel on native input values, output in 0 -> 255
+template <typename T>
+struct MidtonesTransfer
+{
+	T nativeShadows;
+	T nativeHighlights;
+	float k1;
+	float k2;
+	float midtones;
+
+	explicit MidtonesTransfer(const StretchParams1Channel& stretch_params) {
+		// We're outputting uint8, so the max output is 255.
+		constexpr int maxOutput = 255;
+
+		// Maximum possible input value (e.g. 1024*64 - 1 for a 16 bit unsigned int).
+		int maxInput = stretch_params.max_input;
+
+		midtones = stretch_params.midtones;
+		const float highlights = stretch_params.highlights;
+		const float shadows = stretch_params.shadows;
+
+		// hightlights - shadows, protecting for divide-by-0, in a 0->1.0 scale.
+		const float hsRangeFactor = highlights == shadows ? 1.0f : 1.0f / (highlights - shadows);
+		// Shadow and highlight values translated to the ADU scale.
+		nativeShadows = shadows * maxInput;
+		nativeHighlights = highlights * maxInput;
+		// Constants based on above needed for the stretch calculations.
+		k1 = (midtones - 1) * hsRangeFactor * maxOutput / maxInput;
+		k2 = ((2 * midtones) - 1) * hsRangeFactor / maxInput;
+	}
+
+	unsigned char operator()(T input) const {
+		if (!(input >= nativeShadows))
+			return 0;
+		if (input >= nativeHighlights)
+			return 255;
+		const T inputFloored = (input - nativeShadows);
+		const float out = (inputFloored * k1) / (inputFloored * k2 - midtones);
+		return static_cast<unsigned char>(std::min(std::max(out, 0.0f), 255.0f));
+	}
+};
+
+
+// Precomputed stretch of one channel. 8 and 16 bit integers index the table with the raw
+// value, other types are quantized to a 16 bit index over 0 -> max_input first.
+template <typename T>
+class StretchLUT
+{
+	typedef std::integral_constant<bool, std::is_integral<T>::value && sizeof(T) <= 2> isDirect;
+
+public:
+	static constexpr size_t quantizedSize = 65536;
+
+	explicit StretchLUT(const StretchParams1Channel& params) {
+		MidtonesTransfer<T> transfer(params);
+		build(transfer, params, isDirect());
+	}
+
+	unsigned char operator()(T input) const {
+		return _table[index(input, isDirect())];
+	}
+
+private:
+	std::vector<unsigned char> _table;
+	float _scale;
+
+	void build(const MidtonesTransfer<T>& transfer, const StretchParams1Channel& params, std::true_type) {
+		_scale = 1;
+		_table.resize(size_t(1) << (8 * sizeof(T)));
+		for (size_t v = 0; v < _table.size(); v++) {
+			_table[v] = transfer(static_cast<T>(v));
+		}
+	}
+
+	void build(const MidtonesTransfer<T>& transfer, const StretchParams1Channel& params, std::false_type) {
+		const float maxInput = params.max_input > 0 ? static_cast<float>(params.max_input) : 1.0f;
+		_scale = (quantizedSize - 1) / maxInput;
+		_table.resize(quantizedSize);
+		for (size_t i = 0; i < quantizedSize; i++) {
+			_table[i] = transfer(static_cast<T>(i / _scale));
+		}
+	}
+
+	size_t index(T input, std::true_type) const {
+		return static_cast<size_t>(input);
+	}
+
+	size_t index(T input, std::false_type) const {
+		// written so that NaN ends up at 0
+		float x = static_cast<float>(input) * _scale;
+		x = x > 0.0f ? x : 0.0f;
+		x = x < float(quantizedSize - 1) ? x : float(quantizedSize - 1);
+		return static_cast<size_t>(x + 0.5f);
+	}
+};
+
+
+// 1, 256 or 65536 depending on the largest of n floating point samples, non finite ones left out
+template <typename T>
+int floatInputRange(const T *samples, size_t n)
 {
-    constexpr int maxSamples = 500000;
-    const int sampleBy = width * height < maxSamples ? 1 : width * height / maxSamples;
-    const int numSamples = width * height / sampleBy;
-    std::valarray<T> samples = buffer[std::slice(offset, numSamples, sampleBy)];
-    
     int currentMax = 0;
-    for (int i=0; i<numSamples; i++) {
+    for (size_t i=0; i<n; i++) {
         T sample = samples[i];
+        if (!isFiniteSample(sample)) {
+            continue;
+        }
         if (sample > 255) {
             return 65536;
         }
@@ -189,13 +492,29 @@ int calculateFloatInputRange(std::valarray<T>& buffer, int offset, int height, i
 
 
 template <typename T>
-int getRange(int bitdepth, std::valarray<T>& buffer, int offset, int height, int width) {
+int calculateFloatInputRange(std::valarray<T>& buffer, size_t offset, int height, int width)
+{
+    const size_t nbPix = static_cast<size_t>(width) * height;
+    const size_t sampleBy = sampleSpacing(nbPix);
+    const size_t numSamples = nbPix / sampleBy;
+    std::valarray<T> samples = buffer[std::slice(offset, numSamples, sampleBy)];
+    return numSamples > 0 ? floatInputRange(&samples[0], numSamples) : 1;
+}
+
+
+inline int integerInputRange(int bitdepth) {
+    if (bitdepth == 8 || bitdepth == 16) {
+        return 1 << bitdepth;
+    }
+    return 1 << 16;
+}
+
+
+template <typename T>
+int getRange(int bitdepth, std::valarray<T>& buffer, size_t offset, int height, int width) {
     if (bitdepth > 0) {
         // integer data type
-        if (bitdepth == 8 || bitdepth == 16) {
-            return pow(2, bitdepth);
-        }
-        return pow(2, 16);
+        return integerInputRange(bitdepth);
     } else {
         // float or double, need to resample
         return calculateFloatInputRange(buffer, offset, height, width);
@@ -206,7 +525,7 @@ int getRange(int bitdepth, std::valarray<T>& buffer, int offset, int height, int
 template <typename T>
 void computeParamsAllChannels(std::valarray<T>& buffer, StretchParams *params, int inDepth,
                              const ImageDim& outDim) {
-	int nbPixPerPlane = outDim.nx * outDim.ny;
+	const size_t nbPixPerPlane = static_cast<size_t>(outDim.nx) * outDim.ny;
 	parallel_for(size_t(0), size_t(outDim.nc), [&](size_t ch) {
 		StretchParams1Channel *channelParam;
 		switch (ch) {
@@ -228,28 +547,250 @@ void computeParamsAllChannels(std::valarray<T>& buffer, StretchParams *params, i
 }
 
 
+inline const StretchParams1Channel& channelParams(const StretchParams& params, int ch) {
+	switch (ch) {
+	case 1:
+		return params.green;
+	case 2:
+		return params.blue;
+	default:
+		return params.grey_red;
+	}
+}
+
+
+inline StretchParams1Channel& channelParams(StretchParams& params, int ch) {
+	return const_cast<StretchParams1Channel&>(channelParams(static_cast<const StretchParams&>(params), ch));
+}
+
+
+// Same statistics as computeParamsAllChannels for 8 and 16 bit images that arrive strip
+// by strip (see gzipread.h): the channel histograms fill up as the strips are decoded
+// and no pass over the whole image is left once the last one is in.
 template <typename T>
-void stretchAllChannels(std::valarray<T>& buffer,
-	const StretchParams& params,
-	const ImageDim& size) {
-	int nbPixPerPlane = size.nx * size.ny;
+class StreamingHistograms
+{
+	static_assert(std::is_integral<T>::value && sizeof(T) <= 2, "histograms need 8 or 16 bit samples");
 
-	parallel_for(size_t(0), size_t(size.nc), [&](size_t ch) {
-		StretchParams1Channel channelParam;
-		switch (ch) {
-		case 1:
-			channelParam = params.green;
-			break;
-		case 2:
-			channelParam = params.blue;
-			break;
-		default:
-			channelParam = params.grey_red;
-			break;
+public:
+	explicit StreamingHistograms(int nbChannels)
+		: _histograms(nbChannels, std::vector<uint64_t>(size_t(1) << (8 * sizeof(T)), 0)), _counts(nbChannels, 0) {}
+
+	void add(int ch, const T *data, size_t n) {
+		accumulateHistogram(data, n, _histograms[ch]);
+		_counts[ch] += n;
+	}
+
+	void computeParams(StretchParams *params) const {
+		const int inputRange = 1 << (8 * sizeof(T));
+		for (size_t ch = 0; ch < _histograms.size(); ch++) {
+			if (_counts[ch] > 0)
+				setParamsFromHistogram(_histograms[ch], _counts[ch], &channelParams(*params, static_cast<int>(ch)), inputRange);
+		}
+	}
+
+private:
+	std::vector<std::vector<uint64_t>> _histograms;
+	std::vector<uint64_t> _counts;
+};
+
+
+// Counterpart of StreamingHistograms for the sampled types: every channel keeps the
+// same samples as computeParamsOneChannelSampled would pick in the whole plane, strips
+// having to arrive in row order. Channels may have planes of different sizes, like the
+// colours of a CFA mosaic.
+template <typename T>
+class StreamingSamples
+{
+public:
+	StreamingSamples(const std::vector<size_t>& planeSizes, int bitdepth)
+		: _positions(planeSizes.size(), 0), _bitdepth(bitdepth) {
+		for (size_t planeSize : planeSizes) {
+			_sampleBy.push_back(sampleSpacing(planeSize));
+			_samples.emplace_back(planeSize / _sampleBy.back());
+		}
+	}
+
+	void add(int ch, const T *data, size_t n) {
+		std::vector<T>& samples = _samples[ch];
+		const size_t sampleBy = _sampleBy[ch];
+		const size_t first = _positions[ch];
+		for (size_t i = (first + sampleBy - 1) / sampleBy; i < samples.size() && i * sampleBy < first + n; i++) {
+			samples[i] = data[i * sampleBy - first];
+		}
+		_positions[ch] += n;
+	}
+
+	// the samples are reordered, call it once
+	void computeParams(StretchParams *params) {
+		if (_samples.empty() || _samples[0].empty())
+			return;
+		// like getRange, the range of floating point data is taken from the first channel
+		const int inputRange = _bitdepth > 0 ? integerInputRange(_bitdepth) : floatInputRange(_samples[0].data(), _samples[0].size());
+		for (size_t ch = 0; ch < _samples.size(); ch++) {
+			std::vector<T>& samples = _samples[ch];
+			SampleRange<T> range;
+			for (T v : samples) {
+				range.add(v);
+			}
+			if (keepFiniteSamples(samples, range))
+				setParamsFromSamples(samples, range.lo, range.hi, &channelParams(*params, static_cast<int>(ch)), inputRange);
+		}
+	}
+
+private:
+	std::vector<size_t> _sampleBy;
+	std::vector<std::vector<T>> _samples;
+	std::vector<size_t> _positions;
+	int _bitdepth;
+};
+
+
+#ifdef STRETCH_SSE2
+// Packs 4 RGBX pixels into the low 12 bytes, the top 4 bytes are zero
+inline __m128i packRGBX4(__m128i x) {
+	// per 64 bit half: pixel 0 stays at bytes 0-2, pixel 1 moves down from bytes 4-6 to 3-5
+	const __m128i low = _mm_set_epi32(0, 0x00FFFFFF, 0, 0x00FFFFFF);
+	const __m128i high = _mm_set_epi32(0x0000FFFF, 0xFF000000, 0x0000FFFF, 0xFF000000);
+	const __m128i y = _mm_or_si128(_mm_and_si128(x, low), _mm_and_si128(_mm_srli_epi64(x, 8), high));
+	// then the upper half moves down from bytes 8-13 to 6-11
+	const __m128i first = _mm_set_epi32(0, 0, 0x0000FFFF, -1);
+	const __m128i second = _mm_set_epi32(0, -1, static_cast<int>(0xFFFF0000), 0);
+	return _mm_or_si128(_mm_and_si128(y, first), _mm_and_si128(_mm_srli_si128(y, 2), second));
+}
+#endif
+
+
+// Interleaves 16 pixels of 3 planes into 48 bytes of RGB24
+inline void interleaveRGB16(const unsigned char *r, const unsigned char *g, const unsigned char *b, unsigned char *out) {
+#ifdef STRETCH_SSSE3
+	// pshufb masks: output byte k of vector v takes pixel (16v + k) / 3 from plane (16v + k) % 3
+	struct Masks {
+		__m128i m[3][3];
+		Masks() {
+			for (int v = 0; v < 3; v++) {
+				alignas(16) char bytes[3][16];
+				for (int k = 0; k < 16; k++) {
+					const int pos = 16 * v + k;
+					for (int c = 0; c < 3; c++) {
+						bytes[c][k] = pos % 3 == c ? static_cast<char>(pos / 3) : static_cast<char>(0x80);
+					}
+				}
+				for (int c = 0; c < 3; c++) {
+					m[v][c] = _mm_load_si128(reinterpret_cast<const __m128i *>(bytes[c]));
+				}
+			}
+		}
+	};
+	static const Masks masks;
+
+	const __m128i vr = _mm_loadu_si128(reinterpret_cast<const __m128i *>(r));
+	const __m128i vg = _mm_loadu_si128(reinterpret_cast<const __m128i *>(g));
+	const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b));
+	for (int v = 0; v < 3; v++) {
+		__m128i o = _mm_or_si128(_mm_shuffle_epi8(vr, masks.m[v][0]),
+			_mm_or_si128(_mm_shuffle_epi8(vg, masks.m[v][1]), _mm_shuffle_epi8(vb, masks.m[v][2])));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out + 16 * v), o);
+	}
+#elif defined(STRETCH_SSE2)
+	// Without pshufb: unpack to 4 vectors of RGBX pixels, pack each to 12 bytes and
+	// stitch the four 12 byte runs into the three output vectors
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i vr = _mm_loadu_si128(reinterpret_cast<const __m128i *>(r));
+	const __m128i vg = _mm_loadu_si128(reinterpret_cast<const __m128i *>(g));
+	const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b));
+	const __m128i rgLo = _mm_unpacklo_epi8(vr, vg);
+	const __m128i rgHi = _mm_unpackhi_epi8(vr, vg);
+	const __m128i bLo = _mm_unpacklo_epi8(vb, zero);
+	const __m128i bHi = _mm_unpackhi_epi8(vb, zero);
+	const __m128i p0 = packRGBX4(_mm_unpacklo_epi16(rgLo, bLo));
+	const __m128i p1 = packRGBX4(_mm_unpackhi_epi16(rgLo, bLo));
+	const __m128i p2 = packRGBX4(_mm_unpacklo_epi16(rgHi, bHi));
+	const __m128i p3 = packRGBX4(_mm_unpackhi_epi16(rgHi, bHi));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_or_si128(p0, _mm_slli_si128(p1, 12)));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(out + 16), _mm_or_si128(_mm_srli_si128(p1, 4), _mm_slli_si128(p2, 8)));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(out + 32), _mm_or_si128(_mm_srli_si128(p2, 8), _mm_slli_si128(p3, 4)));
+#else
+	for (int j = 0; j < 16; j++) {
+		out[3 * j] = r[j];
+		out[3 * j + 1] = g[j];
+		out[3 * j + 2] = b[j];
+	}
+#endif
+}
+
+
+template <typename T>
+void stretchRow(const T *src, size_t planeSize, int width, const StretchLUT<T> *luts, unsigned char *out, std::integral_constant<int, 1>) {
+	const StretchLUT<T>& lut = luts[0];
+	for (int j = 0; j < width; j++) {
+		out[j] = lut(src[j]);
+	}
+}
+
+
+template <typename T>
+void stretchRow(const T *src, size_t planeSize, int width, const StretchLUT<T> *luts, unsigned char *out, std::integral_constant<int, 3>) {
+	const T *srcR = src;
+	const T *srcG = src + planeSize;
+	const T *srcB = src + 2 * planeSize;
+
+	int j = 0;
+	alignas(16) unsigned char r[16], g[16], b[16];
+	for (; j + 16 <= width; j += 16) {
+		for (int k = 0; k < 16; k++) {
+			r[k] = luts[0](srcR[j + k]);
+			g[k] = luts[1](srcG[j + k]);
+			b[k] = luts[2](srcB[j + k]);
+		}
+		interleaveRGB16(r, g, b, out + 3 * j);
+	}
+	for (; j < width; j++) {
+		out[3 * j] = luts[0](srcR[j]);
+		out[3 * j + 1] = luts[1](srcG[j]);
+		out[3 * j + 2] = luts[2](srcB[j]);
+	}
+}
+
+
+// One lookup table per output channel
+template <int NC, typename T>
+std::vector<StretchLUT<T>> buildStretchLUTs(const StretchParams& params) {
+	std::vector<StretchLUT<T>> luts;
+	for (int ch = 0; ch < NC; ch++) {
+		luts.emplace_back(channelParams(params, ch));
+	}
+	return luts;
+}
+
+
+// Stretch, planar to interleaved and vertical flip in one pass: rows [0, nbRows) of the
+// planar data, planes of planeSize samples, become rows [firstRow, firstRow + nbRows) of a
+// bitmap of height rows. Bands of rows are processed in parallel.
+template <int NC, typename T>
+void packRows(const T *data, size_t planeSize, int width, int nbRows, int firstRow, int height,
+	const std::vector<StretchLUT<T>>& luts, unsigned char *pixData, bool shouldFlipV) {
+	constexpr int tileRows = 16;
+	const int nbTiles = (nbRows + tileRows - 1) / tileRows;
+	parallel_for(0, nbTiles, [&](int tile) {
+		const int rowEnd = std::min(nbRows, (tile + 1) * tileRows);
+		for (int i = tile * tileRows; i < rowEnd; i++) {
+			const int outRow = shouldFlipV ? height - (firstRow + i) - 1 : firstRow + i;
+			stretchRow(data + static_cast<size_t>(i) * width, planeSize, width, luts.data(),
+				pixData + static_cast<size_t>(outRow) * width * NC, std::integral_constant<int, NC>());
 		}
-		stretchOneChannel(buffer, nbPixPerPlane*ch, channelParam,
-			size.ny, size.nx);
 	});
 }
 
+
+// The whole linear planar buffer into the final 8 bit bitmap
+template <int NC, typename T>
+void packBitmap(const std::valarray<T>& buffer, const std::vector<StretchLUT<T>>& luts, const ImageDim& size,
+	unsigned char *pixData, bool shouldFlipV) {
+	const size_t planeSize = static_cast<size_t>(size.nx) * size.ny;
+	if (planeSize == 0)
+		return;
+	packRows<NC>(&buffer[0], planeSize, size.nx, size.ny, 0, size.ny, luts, pixData, shouldFlipV);
+}
+
 #endif /* Stretch_h */
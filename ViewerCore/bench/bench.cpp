@@ -0,0 +1,994 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+
+// Pipeline benchmark over a synthetic star-field corpus, results as JSON.
+//
+//   viewer_bench [--corpus DIR] [--sizes 1,16,150] [--full] [--reps N]
+//                [--threads 1,2,4,...] [--json FILE] [--trace FILE]
+//
+// Every file of the corpus is timed stage by stage: header probe, header parse
+// (FitsImage construction), mapped pixel read, super pixel, bilinear and VNG
+// debayer, stretch statistics and stretched bitmap (stretch, interleave
+// and flip are one pass since the bitmap fusion). The full FitsImageCreate ->
+// FitsImageGetPixData path runs in a child process so that its peak memory and I/O
+// counters aren't polluted by the other measurements, once at full resolution and
+// once fitted to a 1920x1080 preview. The full resolution run is repeated with a
+// memory budget of 0, which sends it through the two-pass strip pipeline.
+// Tile-compressed (.fz) files only time the parallel compressed read and the full path.
+// Big-endian conversion kernels, the statistics algorithms, the speed and PSNR of
+// the debayer modes on a synthetic scene and the thread scaling of the full path,
+// for a plain and a tile-compressed file, are reported separately.
+
+#include "FitsImage.h"
+#include "FitsHeader.h"
+#include "Stretch.h"
+#include "debayer.h"
+#include "bilinear.h"
+#include "vng.h"
+#include "binning.h"
+#include "mosaicstats.h"
+#include "directread.h"
+#include "compressedread.h"
+#include "bigendian.h"
+#include "pixeltraits.h"
+#include "threadpool.h"
+#include "fitsgen.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <psapi.h>
+#define popen _popen
+#define pclose _pclose
+#else
+#include <sys/resource.h>
+#include <sys/stat.h>
+#endif
+
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options
+{
+	std::string self;
+	std::string corpus = "bench_corpus";
+	std::vector<double> sizes = { 1, 16 };
+	std::vector<int> threads;
+	std::string jsonPath;
+	std::string tracePath;
+	int reps = 3;
+	size_t kernelSamples = size_t(1) << 24;
+	bool full = false;
+};
+
+
+struct Timing
+{
+	double ms;
+	double minMs;
+};
+
+
+// Process wide counters, see childFullPath
+struct ProcessCounters
+{
+	double peakRssMb = -1;
+	long long pageFaults = -1;
+	long long ioChars = -1;      // bytes through read() and friends
+	long long ioStorage = -1;    // bytes actually fetched from storage
+};
+
+
+ProcessCounters processCounters() {
+	ProcessCounters counters;
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+		counters.peakRssMb = pmc.PeakWorkingSetSize / 1048576.0;
+		counters.pageFaults = pmc.PageFaultCount;
+	}
+	IO_COUNTERS io;
+	if (GetProcessIoCounters(GetCurrentProcess(), &io)) {
+		counters.ioChars = static_cast<long long>(io.ReadTransferCount);
+	}
+#else
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+		counters.peakRssMb = usage.ru_maxrss / 1048576.0;
+#else
+		counters.peakRssMb = usage.ru_maxrss / 1024.0;
+#endif
+		counters.pageFaults = usage.ru_minflt + usage.ru_majflt;
+	}
+	std::ifstream io("/proc/self/io");
+	std::string key;
+	long long value;
+	while (io >> key >> value) {
+		if (key == "rchar:") counters.ioChars = value;
+		else if (key == "read_bytes:") counters.ioStorage = value;
+	}
+#endif
+	return counters;
+}
+
+
+void makeDirectory(const std::string& path) {
+#ifdef _WIN32
+	_mkdir(path.c_str());
+#else
+	mkdir(path.c_str(), 0755);
+#endif
+}
+
+
+bool fileSize(const std::string& path, long long *size) {
+	std::ifstream in(path, std::ios::binary | std::ios::ate);
+	if (!in.is_open())
+		return false;
+	*size = static_cast<long long>(in.tellg());
+	return true;
+}
+
+
+template <typename Setup, typename Body>
+Timing timeStage(int reps, const Setup& setup, const Body& body) {
+	std::vector<double> ms;
+	for (int r = 0; r < reps; r++) {
+		setup();
+		const auto start = Clock::now();
+		body();
+		ms.push_back(std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+	}
+	std::sort(ms.begin(), ms.end());
+	return Timing{ ms[ms.size() / 2], ms[0] };
+}
+
+
+template <typename Body>
+Timing timeStage(int reps, const Body& body) {
+	return timeStage(reps, []() {}, body);
+}
+
+
+// Minimal streaming JSON writer, commas are handled by the nesting stack
+class JsonWriter
+{
+public:
+	void beginObject(const char *key = nullptr) { open(key, '{'); }
+	void endObject() { close('}'); }
+	void beginArray(const char *key = nullptr) { open(key, '['); }
+	void endArray() { close(']'); }
+
+	void field(const char *key, const std::string& value) {
+		prefix(key);
+		_out << '"';
+		for (char c : value) {
+			if (c == '"' || c == '\\') _out << '\\';
+			_out << c;
+		}
+		_out << '"';
+	}
+	void field(const char *key, const char *value) { field(key, std::string(value)); }
+	void field(const char *key, bool value) { prefix(key); _out << (value ? "true" : "false"); }
+	void field(const char *key, int value) { prefix(key); _out << value; }
+	void field(const char *key, long long value) { prefix(key); _out << value; }
+	void field(const char *key, double value) {
+		prefix(key);
+		if (std::isfinite(value)) _out << value;
+		else _out << "null";
+	}
+
+	void timing(const char *key, const Timing& t, double megapixels) {
+		beginObject(key);
+		field("ms", t.ms);
+		field("min_ms", t.minMs);
+		field("mp_per_s", t.ms > 0 ? megapixels / (t.ms / 1000.0) : 0.0);
+		endObject();
+	}
+
+	std::string str() const { return _out.str() + "\n"; }
+
+private:
+	void prefix(const char *key) {
+		if (!_first.empty()) {
+			if (!_first.back()) _out << ',';
+			_first.back() = false;
+			_out << '\n' << std::string(2 * _first.size(), ' ');
+		}
+		if (key) _out << '"' << key << "\": ";
+	}
+	void open(const char *key, char bracket) {
+		prefix(key);
+		_out << bracket;
+		_first.push_back(true);
+	}
+	void close(char bracket) {
+		const bool empty = _first.back();
+		_first.pop_back();
+		if (!empty) _out << '\n' << std::string(2 * _first.size(), ' ');
+		_out << bracket;
+	}
+
+	std::ostringstream _out;
+	std::vector<bool> _first;
+};
+
+
+std::string quoteArg(const std::string& arg) {
+	return "\"" + arg + "\"";
+}
+
+
+// --- full path, run in a child process ------------------------------------------------
+
+// Prints "median_ms min_ms peak_rss_mb page_faults io_chars io_storage" and, on a second
+// line, the FitsImageGetMetrics fields of the last run
+int childFullPath(const std::string& path, int reps, int threads, int maxWidth, int maxHeight, const std::string& tracePath, bool strips) {
+	if (threads > 0)
+		FitsImageSetThreadCount(threads);
+	if (strips)
+		FitsImageSetMemoryBudget(0);
+	if (!tracePath.empty())
+		FitsImageSetTracing(1);
+
+	std::vector<unsigned char> bitmap;
+	Metrics metrics{};
+	const Timing t = timeStage(reps, [&]() {
+		FitsImage *fits = maxWidth > 0 ? FitsImageCreateEx(path.c_str(), maxWidth, maxHeight) : FitsImageCreate(path.c_str());
+		const ImageDim dim = FitsImageGetOutputDim(fits);
+		bitmap.resize(static_cast<size_t>(dim.nx) * dim.ny * dim.nc);
+		FitsImageGetPixData(fits, bitmap.data());
+		FitsImageGetMetrics(fits, &metrics);
+		FitsImageDestroy(fits);
+	});
+	if (!tracePath.empty() && !FitsImageExportTrace(tracePath.c_str()))
+		return 1;
+
+	const ProcessCounters counters = processCounters();
+	std::printf("%f %f %f %lld %lld %lld\n", t.ms, t.minMs, counters.peakRssMb,
+		counters.pageFaults, counters.ioChars, counters.ioStorage);
+	const int64_t *fields = &metrics.openNs;
+	for (size_t i = 0; i < sizeof(Metrics) / sizeof(int64_t); i++) {
+		std::printf("%lld ", static_cast<long long>(fields[i]));
+	}
+	std::printf("\n");
+	return 0;
+}
+
+
+bool runFullPath(const Options& opt, const std::string& path, int threads, int maxWidth, int maxHeight,
+	Timing *t, ProcessCounters *counters, Metrics *metrics = nullptr, const std::string& tracePath = "", bool strips = false) {
+	std::string command = quoteArg(opt.self) + " --child-full " + quoteArg(path)
+		+ " --reps " + std::to_string(tracePath.empty() ? opt.reps : 1) + " --child-threads " + std::to_string(threads);
+	if (maxWidth > 0)
+		command += " --fit " + std::to_string(maxWidth) + "x" + std::to_string(maxHeight);
+	if (!tracePath.empty())
+		command += " --child-trace " + quoteArg(tracePath);
+	if (strips)
+		command += " --child-strips";
+
+	FILE *pipe = popen(command.c_str(), "r");
+	if (!pipe)
+		return false;
+	char line[512] = {};
+	const bool ok = std::fgets(line, sizeof(line), pipe) != nullptr
+		&& std::sscanf(line, "%lf %lf %lf %lld %lld %lld", &t->ms, &t->minMs, &counters->peakRssMb,
+			&counters->pageFaults, &counters->ioChars, &counters->ioStorage) == 6;
+
+	if (ok && metrics) {
+		*metrics = Metrics{};
+		int64_t *fields = &metrics->openNs;
+		for (size_t i = 0; i < sizeof(Metrics) / sizeof(int64_t); i++) {
+			long long value = 0;
+			if (std::fscanf(pipe, "%lld", &value) != 1)
+				break;
+			fields[i] = value;
+		}
+	}
+	return pclose(pipe) == 0 && ok;
+}
+
+
+void writeFullPath(JsonWriter& json, const char *key, const Options& opt, const std::string& path,
+	double megapixels, int maxWidth, int maxHeight, bool strips = false) {
+	Timing t;
+	ProcessCounters counters;
+	Metrics metrics;
+	if (!runFullPath(opt, path, 0, maxWidth, maxHeight, &t, &counters, &metrics, "", strips)) {
+		std::fprintf(stderr, "full path failed on %s\n", path.c_str());
+		return;
+	}
+	json.beginObject(key);
+	json.field("ms", t.ms);
+	json.field("min_ms", t.minMs);
+	json.field("mp_per_s", megapixels / (t.ms / 1000.0));
+	json.field("peak_rss_mb", counters.peakRssMb);
+	json.field("page_faults", counters.pageFaults);
+	json.field("io_read_chars", counters.ioChars);
+	json.field("io_storage_bytes", counters.ioStorage);
+
+	// what the pipeline itself recorded on the last run
+	json.beginObject("metrics");
+	json.field("open_ns", static_cast<long long>(metrics.openNs));
+	json.field("header_ns", static_cast<long long>(metrics.headerNs));
+	json.field("read_ns", static_cast<long long>(metrics.readNs));
+	json.field("debayer_ns", static_cast<long long>(metrics.debayerNs));
+	json.field("stats_ns", static_cast<long long>(metrics.statsNs));
+	json.field("stretch_ns", static_cast<long long>(metrics.stretchNs));
+	json.field("pack_ns", static_cast<long long>(metrics.packNs));
+	json.field("bytes_read", static_cast<long long>(metrics.bytesRead));
+	json.field("pixels_processed", static_cast<long long>(metrics.pixelsProcessed));
+	json.field("threads_used", static_cast<long long>(metrics.threadsUsed));
+	json.field("peak_buffer_bytes", static_cast<long long>(metrics.peakBufferBytes));
+	json.endObject();
+	json.endObject();
+}
+
+
+// --- per stage ------------------------------------------------------------------------
+
+// Lookup tables and bitmap pass of the pipeline, timed as one stage
+template <int NC, typename T>
+void stretchToBitmap(const std::valarray<T>& buffer, const StretchParams& params, const ImageDim& size,
+	unsigned char *pixData, bool shouldFlipV) {
+	packBitmap<NC>(buffer, buildStretchLUTs<NC, T>(params), size, pixData, shouldFlipV);
+}
+
+
+template <int BITPIX>
+void benchStages(JsonWriter& json, const Options& opt, const std::string& path, const FitsHeaderInfo& info) {
+	typedef typename BitpixTraits<BITPIX>::type T;
+	const int reps = opt.reps;
+
+	const ImageDim inDim{ static_cast<int>(info.naxes[0]), static_cast<int>(info.naxes[1]), info.naxis == 3 ? 3 : 1, BITPIX };
+	const double megapixels = static_cast<double>(inDim.nx) * inDim.ny * inDim.nc / 1e6;
+	const bool isTopDown = info.rowOrder != "BOTTOM-UP";
+	const bool isBayer = inDim.nc == 1 && !info.bayerPattern.empty();
+	const std::string shifted = shiftBayerPattern(info.bayerPattern, info.bayerOffset[0], info.bayerOffset[1]);
+	const std::string bayer = isBayer && !isTopDown ? flipBayerPatternVertically(shifted) : shifted;
+
+	json.beginObject("stages");
+
+	FitsHeaderInfo probed;
+	json.timing("header_probe", timeStage(reps, [&]() { probeFitsHeader(path, &probed); }), megapixels);
+	json.timing("header_parse", timeStage(reps, [&]() { FitsImage image(path); }), megapixels);
+
+	std::valarray<T> raw;
+	json.timing("pixel_read", timeStage(reps, [&]() { raw = std::valarray<T>(); },
+		[&]() { readImagePixMapped(path, info, inDim, isBayer, 1, raw); }), megapixels);
+
+	std::valarray<T> working;
+	ImageDim outDim = inDim;
+	if (isBayer) {
+		outDim = ImageDim{ inDim.nx / 2, inDim.ny / 2, 3, BITPIX };
+		working.resize(static_cast<size_t>(outDim.nx) * outDim.ny * 3);
+		json.timing("super_pixel", timeStage(reps, [&]() { super_pixel(raw, working, inDim.nx, inDim.ny, bayer, 1); }), megapixels);
+
+		// full resolution mode, its 3 full-size planes are released right away
+		std::valarray<T> fullRes(static_cast<size_t>(inDim.nx & ~1) * (inDim.ny & ~1) * 3);
+		json.timing("bilinear", timeStage(reps, [&]() { bilinear_debayer(raw, fullRes, inDim.nx, inDim.ny, bayer); }), megapixels);
+		json.timing("vng", timeStage(reps, [&]() { vng_debayer(raw, fullRes, inDim.nx, inDim.ny, bayer); }), megapixels);
+
+		// 4x downscaled previews from the file: decimated mosaic and super pixel, against the binned read
+		const ImageDim skipDim{ 2 * (inDim.nx / 8), 2 * (inDim.ny / 8), 1, BITPIX };
+		const ImageDim previewDim{ inDim.nx / 8, inDim.ny / 8, 3, BITPIX };
+		std::valarray<T> skipped, preview(static_cast<size_t>(previewDim.nx) * previewDim.ny * 3);
+		json.timing("preview_skip_4", timeStage(reps, [&]() {
+			readImagePixMapped(path, info, skipDim, true, 4, skipped);
+			super_pixel(skipped, preview, skipDim.nx, skipDim.ny, bayer, 1);
+		}), megapixels);
+		json.timing("preview_binned_4", timeStage(reps, [&]() { readImagePixBinned(path, info, previewDim, bayer, 4, preview); }), megapixels);
+	}
+	else {
+		working = raw;
+	}
+
+	StretchParams params;
+	json.timing("stretch_params", timeStage(reps, [&]() { computeParamsAllChannels(working, &params, BITPIX, outDim); }), megapixels);
+	if (isBayer) {
+		// what the pipeline runs alongside the debayer
+		json.timing("stretch_params_mosaic", timeStage(reps, [&]() { computeParamsMosaic(raw, inDim.nx, inDim.ny, bayer, BITPIX, &params); }), megapixels);
+	}
+
+	std::vector<unsigned char> bitmap(static_cast<size_t>(outDim.nx) * outDim.ny * outDim.nc);
+	json.timing("stretch_bitmap", timeStage(reps, [&]() {
+		if (outDim.nc == 3)
+			stretchToBitmap<3>(working, params, outDim, bitmap.data(), !isTopDown);
+		else
+			stretchToBitmap<1>(working, params, outDim, bitmap.data(), !isTopDown);
+	}), megapixels);
+
+	json.endObject();
+}
+
+
+template <int BITPIX>
+void benchCompressedRead(JsonWriter& json, const Options& opt, const std::string& path, const FitsHeaderInfo& info) {
+	typedef typename BitpixTraits<BITPIX>::type T;
+	const ImageDim inDim{ static_cast<int>(info.naxes[0]), static_cast<int>(info.naxes[1]), info.naxis == 3 ? 3 : 1, BITPIX };
+	const double megapixels = static_cast<double>(inDim.nx) * inDim.ny * inDim.nc / 1e6;
+	const bool isBayer = inDim.nc == 1 && !info.bayerPattern.empty();
+
+	std::valarray<T> raw;
+	int nbLanes = 0;
+	json.beginObject("stages");
+	json.timing("compressed_read", timeStage(opt.reps, [&]() { raw = std::valarray<T>(); },
+		[&]() { readCompressedImagePix(path, info, inDim, isBayer, 1, raw, &nbLanes); }), megapixels);
+	json.field("lanes", nbLanes);
+	json.endObject();
+}
+
+
+void benchFile(JsonWriter& json, const Options& opt, const std::string& path, const SyntheticFitsSpec& spec) {
+	FitsHeaderInfo info;
+	if (!probeFitsHeader(path, &info)) {
+		std::fprintf(stderr, "cannot parse %s\n", path.c_str());
+		return;
+	}
+	const double megapixels = static_cast<double>(spec.width) * spec.height * spec.channels / 1e6;
+	long long bytes = 0;
+	fileSize(path, &bytes);
+
+	json.beginObject();
+	json.field("file", syntheticFitsName(spec));
+	json.field("bitpix", spec.bitpix);
+	json.field("width", spec.width);
+	json.field("height", spec.height);
+	json.field("channels", spec.channels);
+	json.field("bayer", spec.bayerPattern);
+	json.field("roworder", spec.bottomUp ? "BOTTOM-UP" : "TOP-DOWN");
+	json.field("megapixels", megapixels);
+	json.field("file_bytes", bytes);
+
+	json.field("tile_compressed", spec.tileCompressed);
+
+	if (spec.tileCompressed) {
+		switch (spec.bitpix) {
+		case 8: benchCompressedRead<8>(json, opt, path, info); break;
+		case 16: benchCompressedRead<16>(json, opt, path, info); break;
+		case 32: benchCompressedRead<32>(json, opt, path, info); break;
+		case -32: benchCompressedRead<-32>(json, opt, path, info); break;
+		default: benchCompressedRead<-64>(json, opt, path, info); break;
+		}
+	}
+	else {
+		switch (spec.bitpix) {
+		case 8: benchStages<8>(json, opt, path, info); break;
+		case 16: benchStages<16>(json, opt, path, info); break;
+		case 32: benchStages<32>(json, opt, path, info); break;
+		case -32: benchStages<-32>(json, opt, path, info); break;
+		default: benchStages<-64>(json, opt, path, info); break;
+		}
+	}
+
+	writeFullPath(json, "full_path", opt, path, megapixels, 0, 0);
+	if (!spec.tileCompressed)
+		writeFullPath(json, "full_path_strips", opt, path, megapixels, 0, 0, true);
+	writeFullPath(json, "preview_1080p", opt, path, megapixels, 1920, 1080);
+	json.endObject();
+}
+
+
+// --- kernels, statistics, scaling ----------------------------------------------------
+
+template <int BITPIX, typename T>
+void benchKernel(JsonWriter& json, const Options& opt, const char *target, double bzero) {
+	const size_t n = opt.kernelSamples;
+	const size_t size = FitsSample<BITPIX>::size;
+	std::vector<unsigned char> src(n * size);
+	std::mt19937 random(7);
+	if (BITPIX < 0) {
+		// valid big-endian floating point values in the ADU range
+		for (size_t i = 0; i < n; i++) {
+			const double v = (random() % 65536) + 0.25;
+			unsigned char native[8];
+			if (BITPIX == -32) {
+				const float f = static_cast<float>(v);
+				std::memcpy(native, &f, 4);
+			}
+			else {
+				std::memcpy(native, &v, 8);
+			}
+			for (size_t b = 0; b < size; b++) src[i * size + b] = native[size - 1 - b];
+		}
+	}
+	else {
+		for (auto& byte : src) byte = static_cast<unsigned char>(random());
+	}
+	std::vector<T> dst(n);
+
+	const Timing simd = timeStage(opt.reps, [&]() { BigEndianConverter<BITPIX, T>::convert(src.data(), dst.data(), n, 1.0, bzero); });
+	const Timing scalar = timeStage(opt.reps, [&]() { convertBigEndianScalar<BITPIX>(src.data(), dst.data(), n, 1.0, bzero); });
+	const double gigabytes = static_cast<double>(n * size) / 1e9;
+
+	json.beginObject();
+	json.field("bitpix", BITPIX);
+	json.field("target", target);
+	json.field("samples", static_cast<long long>(n));
+	json.field("kernel_gb_per_s", gigabytes / (simd.ms / 1000.0));
+	json.field("scalar_gb_per_s", gigabytes / (scalar.ms / 1000.0));
+	json.endObject();
+}
+
+
+// Timing of a statistics method and the stretch it leads to, with its distance to the
+// full-frame reference
+void writeStatistics(JsonWriter& json, const char *key, const Timing& t, double megapixels,
+	const StretchParams1Channel& params, const StretchParams1Channel& reference) {
+	json.beginObject(key);
+	json.field("ms", t.ms);
+	json.field("min_ms", t.minMs);
+	json.field("mp_per_s", t.ms > 0 ? megapixels / (t.ms / 1000.0) : 0.0);
+	json.field("shadows", static_cast<double>(params.shadows));
+	json.field("highlights", static_cast<double>(params.highlights));
+	json.field("midtones", static_cast<double>(params.midtones));
+	json.field("shadows_error", static_cast<double>(params.shadows - reference.shadows));
+	json.field("midtones_error", static_cast<double>(params.midtones - reference.midtones));
+	json.endObject();
+}
+
+
+// The statistics algorithms on one 16 MP channel: the exact histogram the pipeline runs
+// on 8 and 16 bit data, the 500k-sample selection it runs on every other type (timed on
+// the same values both as 16 bit integers and as floats), and nth_element over every
+// pixel as the exact reference. Every method fills its own parameters.
+void benchStatistics(JsonWriter& json, const Options& opt) {
+	const int width = 4096, height = 4096;
+	const size_t n = static_cast<size_t>(width) * height;
+	std::mt19937 random(11);
+	std::normal_distribution<double> noise(3000, 120);
+	std::valarray<unsigned short> u16(n);
+	for (auto& v : u16) v = static_cast<unsigned short>(std::min(65535.0, std::max(0.0, noise(random))));
+	std::valarray<float> f32(n);
+	for (size_t i = 0; i < n; i++) f32[i] = u16[i] / 65536.0f;
+
+	// exact median and MAD with nth_element over every pixel
+	StretchParams1Channel reference;
+	std::vector<unsigned short> values;
+	unsigned short median = 0, medDev = 0;
+	const Timing nth = timeStage(opt.reps, [&]() { values.assign(std::begin(u16), std::end(u16)); }, [&]() {
+		const size_t middle = values.size() / 2;
+		std::nth_element(values.begin(), values.begin() + middle, values.end());
+		median = values[middle];
+		for (auto& v : values) v = static_cast<unsigned short>(v > median ? v - median : median - v);
+		std::nth_element(values.begin(), values.begin() + middle, values.end());
+		medDev = values[middle];
+		setParamsFromMedianAndMAD(&reference, median, medDev, 65536);
+	});
+
+	StretchParams1Channel histogram, sampled, sampledFloat;
+	const Timing histogramTime = timeStage(opt.reps, [&]() { computeParamsOneChannelHistogram(u16, 0, &histogram, 65536, height, width); });
+	const Timing sampledTime = timeStage(opt.reps, [&]() { computeParamsOneChannelSampled(u16, 0, &sampled, 65536, height, width); });
+	const Timing sampledFloatTime = timeStage(opt.reps, [&]() { computeParamsOneChannelSampled(f32, 0, &sampledFloat, 1, height, width); });
+
+	const double megapixels = n / 1e6;
+	json.beginObject("statistics");
+	json.field("megapixels", megapixels);
+	json.field("samples", static_cast<long long>(n / sampleSpacing(n)));
+	json.field("median", static_cast<int>(median));
+	json.field("mad", static_cast<int>(medDev));
+	writeStatistics(json, "nth_element_u16", nth, megapixels, reference, reference);
+	writeStatistics(json, "histogram_u16", histogramTime, megapixels, histogram, reference);
+	writeStatistics(json, "sampled_u16", sampledTime, megapixels, sampled, reference);
+	writeStatistics(json, "sampled_f32", sampledFloatTime, megapixels, sampledFloat, reference);
+	json.endObject();
+}
+
+
+// PSNR of image against reference in dB, 16 bit peak
+double psnr(const std::valarray<unsigned short>& image, const std::valarray<unsigned short>& reference) {
+	double squares = 0;
+	for (size_t i = 0; i < image.size(); i++) {
+		const double d = static_cast<double>(image[i]) - reference[i];
+		squares += d * d;
+	}
+	const double mse = squares / image.size();
+	return mse > 0 ? 10 * std::log10(65535.0 * 65535.0 / mse) : 0.0;
+}
+
+
+// Speed and quality of the debayer modes on a synthetic RGB scene sampled into an RGGB
+// mosaic: sky gradient, undersampled coloured stars and a hard-edged disc, where the
+// interpolation errors show. Super pixel is compared with the 2x2 binned ground truth,
+// the 4x previews with the 8x8 one.
+void benchDemosaic(JsonWriter& json, const Options& opt) {
+	const int width = 3000, height = 2000;
+	const size_t planeSize = static_cast<size_t>(width) * height;
+	std::vector<float> scene(3 * planeSize);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			const bool inDisc = (x - 2200) * (x - 2200) + (y - 700) * (y - 700) < 150 * 150;
+			for (int c = 0; c < 3; c++) {
+				const float sky = 2000.0f + 600.0f * c + 1500.0f * x / width + 800.0f * y / height;
+				scene[c * planeSize + static_cast<size_t>(y) * width + x] = inDisc ? 30000.0f - 5000.0f * c : sky;
+			}
+		}
+	}
+	std::mt19937 random(13);
+	std::uniform_real_distribution<float> unit(0, 1);
+	for (int s = 0; s < 3000; s++) {
+		const float cx = 8 + unit(random) * (width - 16), cy = 8 + unit(random) * (height - 16);
+		const float peak = 1000.0f + 40000.0f * std::pow(unit(random), 4.0f);
+		const float color[3] = { 0.6f + 0.4f * unit(random), 0.8f + 0.2f * unit(random), 0.6f + 0.4f * unit(random) };
+		for (int y = static_cast<int>(cy) - 4; y <= static_cast<int>(cy) + 4; y++) {
+			for (int x = static_cast<int>(cx) - 4; x <= static_cast<int>(cx) + 4; x++) {
+				const float r2 = (x - cx) * (x - cx) + (y - cy) * (y - cy);
+				const float v = peak * std::exp(-r2 / (2 * 1.2f * 1.2f));
+				for (int c = 0; c < 3; c++) {
+					scene[c * planeSize + static_cast<size_t>(y) * width + x] += color[c] * v;
+				}
+			}
+		}
+	}
+
+	std::valarray<unsigned short> truth(3 * planeSize);
+	for (size_t i = 0; i < truth.size(); i++) {
+		truth[i] = static_cast<unsigned short>(std::min(65535.0f, scene[i]));
+	}
+	const int rggb[2][2] = { { 0, 1 }, { 1, 2 } };
+	std::valarray<unsigned short> mosaic(planeSize);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			const size_t i = static_cast<size_t>(y) * width + x;
+			mosaic[i] = truth[rggb[y & 1][x & 1] * planeSize + i];
+		}
+	}
+	const size_t halfPlane = planeSize / 4;
+	std::valarray<unsigned short> binned(3 * halfPlane);
+	for (int c = 0; c < 3; c++) {
+		for (int y = 0; y < height / 2; y++) {
+			for (int x = 0; x < width / 2; x++) {
+				const unsigned short *p = &truth[c * planeSize + static_cast<size_t>(2 * y) * width + 2 * x];
+				binned[c * halfPlane + static_cast<size_t>(y) * (width / 2) + x] = static_cast<unsigned short>((p[0] + p[1] + p[width] + p[width + 1]) / 4);
+			}
+		}
+	}
+
+	std::valarray<unsigned short> half(3 * halfPlane), bilinear(3 * planeSize), vng(3 * planeSize);
+	const double megapixels = planeSize / 1e6;
+	json.beginObject("demosaic");
+	json.field("megapixels", megapixels);
+	json.timing("super_pixel", timeStage(opt.reps, [&]() { super_pixel(mosaic, half, width, height, "RGGB", 1); }), megapixels);
+	json.timing("bilinear", timeStage(opt.reps, [&]() { bilinear_debayer(mosaic, bilinear, width, height, "RGGB"); }), megapixels);
+	json.timing("vng", timeStage(opt.reps, [&]() { vng_debayer(mosaic, vng, width, height, "RGGB"); }), megapixels);
+	json.beginObject("psnr_db");
+	json.field("super_pixel_vs_binned", psnr(half, binned));
+	json.field("bilinear", psnr(bilinear, truth));
+	json.field("vng", psnr(vng, truth));
+	json.endObject();
+
+	// 4x previews: one CFA cell out of 16 kept, or all of them binned, against the 8x8 mean of the scene
+	const int previewWidth = width / 8, previewHeight = height / 8;
+	const size_t previewPlane = static_cast<size_t>(previewWidth) * previewHeight;
+	std::valarray<unsigned short> previewTruth(3 * previewPlane);
+	for (int c = 0; c < 3; c++) {
+		for (int y = 0; y < previewHeight; y++) {
+			for (int x = 0; x < previewWidth; x++) {
+				double sum = 0;
+				for (int j = 0; j < 8; j++) {
+					for (int i = 0; i < 8; i++) sum += truth[c * planeSize + static_cast<size_t>(8 * y + j) * width + 8 * x + i];
+				}
+				previewTruth[c * previewPlane + static_cast<size_t>(y) * previewWidth + x] = static_cast<unsigned short>(sum / 64);
+			}
+		}
+	}
+	// the binning kernel reads file samples: signed big-endian with BZERO 32768
+	std::vector<unsigned char> fileSamples(2 * planeSize);
+	for (size_t i = 0; i < planeSize; i++) {
+		const unsigned short v = mosaic[i] ^ 0x8000;
+		fileSamples[2 * i] = static_cast<unsigned char>(v >> 8);
+		fileSamples[2 * i + 1] = static_cast<unsigned char>(v);
+	}
+	FitsHeaderInfo info;
+	info.bitpix = 16;
+	info.naxis = 2;
+	info.naxes[0] = width;
+	info.naxes[1] = height;
+	info.bzero = 32768;
+	const BinPattern pattern("RGGB");
+	std::valarray<unsigned short> skipped(3 * previewPlane), binnedPreview(3 * previewPlane);
+	json.timing("preview_skip_4", timeStage(opt.reps, [&]() { super_pixel(mosaic, skipped, width, height, "RGGB", 4); }), megapixels);
+	// unfused binning as the NOTE of debayer.h pictures it: super pixel image, then 4x4 means
+	std::valarray<unsigned short> unfused(3 * previewPlane);
+	json.timing("preview_super_pixel_then_bin_4", timeStage(opt.reps, [&]() {
+		super_pixel(mosaic, half, width, height, "RGGB", 1);
+		for (int c = 0; c < 3; c++) {
+			parallel_for(0, previewHeight, [&](int y) {
+				for (int x = 0; x < previewWidth; x++) {
+					unsigned int sum = 0;
+					for (int j = 0; j < 4; j++) {
+						for (int i = 0; i < 4; i++) sum += half[c * halfPlane + static_cast<size_t>(4 * y + j) * (width / 2) + 4 * x + i];
+					}
+					unfused[c * previewPlane + static_cast<size_t>(y) * previewWidth + x] = static_cast<unsigned short>(sum / 16);
+				}
+			});
+		}
+	}), megapixels);
+	json.timing("preview_binned_4", timeStage(opt.reps, [&]() {
+		binMappedRows<16>(fileSamples.data(), info, pattern, 4, previewWidth, 0, previewHeight, &binnedPreview[0], previewPlane);
+	}), megapixels);
+	json.beginObject("preview_psnr_db");
+	json.field("skip_4", psnr(skipped, previewTruth));
+	json.field("super_pixel_then_bin_4", psnr(unfused, previewTruth));
+	json.field("binned_4", psnr(binnedPreview, previewTruth));
+	json.endObject();
+	json.endObject();
+}
+
+
+// threads_used is what the pipeline reports, for a tile-compressed file the number of
+// cfitsio handles of the read, 1 when cfitsio isn't reentrant
+void benchThreadScaling(JsonWriter& json, const char *key, const Options& opt, const std::string& path, double megapixels) {
+	json.beginObject(key);
+	json.field("file", path.substr(path.find_last_of("/\\") + 1));
+	json.beginArray("runs");
+	double baseMs = 0;
+	for (int threads : opt.threads) {
+		Timing t;
+		ProcessCounters counters;
+		Metrics metrics;
+		if (!runFullPath(opt, path, threads, 0, 0, &t, &counters, &metrics))
+			continue;
+		if (baseMs == 0)
+			baseMs = t.ms;
+		json.beginObject();
+		json.field("threads", threads);
+		json.field("threads_used", static_cast<long long>(metrics.threadsUsed));
+		json.field("ms", t.ms);
+		json.field("mp_per_s", megapixels / (t.ms / 1000.0));
+		json.field("speedup", baseMs / t.ms);
+		json.endObject();
+	}
+	json.endArray();
+	json.endObject();
+}
+
+
+// --- corpus --------------------------------------------------------------------------
+
+std::vector<SyntheticFitsSpec> corpusSpecs(const Options& opt) {
+	static const int bitpixes[] = { 8, 16, -32, -64 };
+	static const char *patterns[] = { "", "RGGB", "BGGR", "GRBG", "GBRG" };
+	const double smallest = *std::min_element(opt.sizes.begin(), opt.sizes.end());
+
+	std::vector<SyntheticFitsSpec> specs;
+	for (double mp : opt.sizes) {
+		const int side = static_cast<int>(std::sqrt(mp * 1e6)) & ~1;
+		// every layout and row order on the smallest size (or all sizes with --full),
+		// mono and one Bayer pattern otherwise
+		const bool matrix = opt.full || mp == smallest;
+		for (int bitpix : bitpixes) {
+			for (int p = 0; p < (matrix ? 5 : 2); p++) {
+				for (int bottomUp = 0; bottomUp < (matrix ? 2 : 1); bottomUp++) {
+					SyntheticFitsSpec spec;
+					spec.bitpix = bitpix;
+					spec.width = spec.height = side;
+					spec.bayerPattern = patterns[p];
+					spec.bottomUp = bottomUp != 0;
+					specs.push_back(spec);
+				}
+			}
+		}
+		SyntheticFitsSpec cube;
+		cube.width = cube.height = side;
+		cube.channels = 3;
+		specs.push_back(cube);
+		SyntheticFitsSpec int32;
+		int32.bitpix = 32;
+		int32.width = int32.height = side;
+		specs.push_back(int32);
+		SyntheticFitsSpec fpacked;
+		fpacked.width = fpacked.height = side;
+		fpacked.bayerPattern = "RGGB";
+		fpacked.tileCompressed = true;
+		specs.push_back(fpacked);
+	}
+	return specs;
+}
+
+
+std::string ensureCorpusFile(const Options& opt, const SyntheticFitsSpec& spec) {
+	const std::string path = opt.corpus + "/" + syntheticFitsName(spec);
+	// compressed files are smaller than their samples, any file past the primary header will do
+	const long long dataBytes = spec.tileCompressed ? 2880
+		: static_cast<long long>(spec.width) * spec.height * spec.channels * (std::abs(spec.bitpix) / 8);
+	long long size = 0;
+	if (fileSize(path, &size) && size > dataBytes)
+		return path;
+
+	std::fprintf(stderr, "generating %s\n", path.c_str());
+	if (!writeSyntheticFits(path, spec))
+		return "";
+	return path;
+}
+
+
+std::vector<double> parseSizes(const std::string& list) {
+	std::vector<double> values;
+	std::stringstream ss(list);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		if (!item.empty()) values.push_back(std::atof(item.c_str()));
+	}
+	return values;
+}
+
+
+void usage() {
+	std::fprintf(stderr, "usage: viewer_bench [--corpus DIR] [--sizes MP,MP,...] [--full] [--reps N]\n"
+		"                    [--threads N,N,...] [--json FILE] [--trace FILE]\n"
+		"  --sizes  image sizes in megapixels, default 1,16, e.g. 1,16,50,150 for the full range\n"
+		"  --full   every BITPIX x layout x row order at every size, not only the smallest\n"
+		"  --trace  Chrome trace of a 1080p preview of the thread scaling file\n");
+}
+
+} // namespace
+
+
+int main(int argc, char **argv) {
+	Options opt;
+	opt.self = argv[0];
+	std::string childPath, childTrace;
+	int childThreads = 0, fitWidth = 0, fitHeight = 0;
+	bool childStrips = false;
+
+	for (int i = 1; i < argc; i++) {
+		const std::string arg = argv[i];
+		const bool hasValue = i + 1 < argc;
+		if (arg == "--corpus" && hasValue) opt.corpus = argv[++i];
+		else if (arg == "--sizes" && hasValue) opt.sizes = parseSizes(argv[++i]);
+		else if (arg == "--threads" && hasValue) {
+			for (double t : parseSizes(argv[++i])) opt.threads.push_back(static_cast<int>(t));
+		}
+		else if (arg == "--json" && hasValue) opt.jsonPath = argv[++i];
+		else if (arg == "--trace" && hasValue) opt.tracePath = argv[++i];
+		else if (arg == "--reps" && hasValue) opt.reps = std::max(1, std::atoi(argv[++i]));
+		else if (arg == "--full") opt.full = true;
+		else if (arg == "--child-full" && hasValue) childPath = argv[++i];
+		else if (arg == "--child-threads" && hasValue) childThreads = std::atoi(argv[++i]);
+		else if (arg == "--child-trace" && hasValue) childTrace = argv[++i];
+		else if (arg == "--child-strips") childStrips = true;
+		else if (arg == "--fit" && hasValue) std::sscanf(argv[++i], "%dx%d", &fitWidth, &fitHeight);
+		else {
+			usage();
+			return 1;
+		}
+	}
+
+	if (!childPath.empty())
+		return childFullPath(childPath, opt.reps, childThreads, fitWidth, fitHeight, childTrace, childStrips);
+
+	if (opt.sizes.empty()) {
+		usage();
+		return 1;
+	}
+	const int hardwareThreads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+	if (opt.threads.empty()) {
+		for (int t = 1; t < hardwareThreads; t *= 2) opt.threads.push_back(t);
+		opt.threads.push_back(hardwareThreads);
+	}
+
+	makeDirectory(opt.corpus);
+	JsonWriter json;
+	json.beginObject();
+
+	json.beginObject("build");
+#if defined(_MSC_VER)
+	json.field("compiler", "msvc " + std::to_string(_MSC_VER));
+#elif defined(__clang__)
+	json.field("compiler", "clang " __clang_version__);
+#elif defined(__GNUC__)
+	json.field("compiler", "gcc " __VERSION__);
+#endif
+#ifdef BIGENDIAN_SSE2
+	json.field("sse2", true);
+#else
+	json.field("sse2", false);
+#endif
+#ifdef STRETCH_SSSE3
+	json.field("ssse3", true);
+#else
+	json.field("ssse3", false);
+#endif
+	json.field("cfitsio_reentrant", fits_is_reentrant() != 0);
+	json.field("hardware_threads", hardwareThreads);
+	json.field("pool_threads", static_cast<int>(ThreadPool::instance().size()));
+	json.field("reps", opt.reps);
+	json.endObject();
+
+	std::string scalingFile, compressedFile;
+	double scalingMegapixels = 0, compressedMegapixels = 0;
+	json.beginArray("cases");
+	for (const SyntheticFitsSpec& spec : corpusSpecs(opt)) {
+		const std::string path = ensureCorpusFile(opt, spec);
+		if (path.empty()) {
+			std::fprintf(stderr, "cannot write the corpus to %s\n", opt.corpus.c_str());
+			return 1;
+		}
+		std::fprintf(stderr, "bench %s\n", path.c_str());
+		benchFile(json, opt, path, spec);
+
+		// thread scaling on the biggest 16 bit RGGB frame, the typical OSC camera file,
+		// and lane scaling on the biggest fpack'ed one
+		const double megapixels = static_cast<double>(spec.width) * spec.height / 1e6;
+		if (spec.tileCompressed && megapixels > compressedMegapixels) {
+			compressedFile = path;
+			compressedMegapixels = megapixels;
+		}
+		else if (!spec.tileCompressed && spec.bitpix == 16 && spec.bayerPattern == "RGGB" && !spec.bottomUp && megapixels > scalingMegapixels) {
+			scalingFile = path;
+			scalingMegapixels = megapixels;
+		}
+	}
+	json.endArray();
+
+	json.beginArray("kernels");
+	benchKernel<8, unsigned char>(json, opt, "uint8", 0);
+	benchKernel<16, unsigned short>(json, opt, "uint16", 32768);
+	benchKernel<32, unsigned int>(json, opt, "uint32", 2147483648.0);
+	benchKernel<-32, float>(json, opt, "float", 0);
+	benchKernel<-64, double>(json, opt, "double", 0);
+	json.endArray();
+
+	benchStatistics(json, opt);
+	benchDemosaic(json, opt);
+	if (!scalingFile.empty())
+		benchThreadScaling(json, "thread_scaling", opt, scalingFile, scalingMegapixels);
+	if (!compressedFile.empty())
+		benchThreadScaling(json, "compressed_lane_scaling", opt, compressedFile, compressedMegapixels);
+
+	if (!opt.tracePath.empty() && !scalingFile.empty()) {
+		Timing t;
+		ProcessCounters counters;
+		if (runFullPath(opt, scalingFile, 0, 1920, 1080, &t, &counters, nullptr, opt.tracePath))
+			json.field("trace", opt.tracePath);
+		else
+			std::fprintf(stderr, "cannot write the trace to %s\n", opt.tracePath.c_str());
+	}
+
+	json.endObject();
+
+	if (opt.jsonPath.empty()) {
+		std::fputs(json.str().c_str(), stdout);
+	}
+	else {
+		std::ofstream out(opt.jsonPath);
+		out << json.str();
+	}
+	return 0;
+}
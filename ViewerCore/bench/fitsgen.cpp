@@ -0,0 +1,291 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+
+#include "fitsgen.h"
+#include <fitsio.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+
+namespace {
+
+constexpr size_t BlockSize = 2880;
+constexpr int CardSize = 80;
+
+// Subtracted from the ADU of biasSubtracted files, a bit above the blue background
+constexpr int Bias = 2048;
+
+
+// xorshift64*, plenty for noise and star positions
+struct Random
+{
+	uint64_t state;
+
+	explicit Random(uint64_t seed) : state(seed * 0x9E3779B97F4A7C15ull + 1) {}
+
+	uint64_t next() {
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return state * 0x2545F4914F6CDD1Dull;
+	}
+
+	double uniform() {
+		return (next() >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+	// Sum of 4 uniforms, scaled to unit variance
+	float gaussian() {
+		return static_cast<float>((uniform() + uniform() + uniform() + uniform() - 2.0) * 1.7320508);
+	}
+};
+
+
+struct Star
+{
+	float x;
+	float y;
+	float sigma;
+	float peak;
+};
+
+
+std::string card(const std::string& key, const std::string& value, bool isString) {
+	char buf[CardSize + 1];
+	if (isString) {
+		std::snprintf(buf, sizeof(buf), "%-8s= '%-8s'", key.c_str(), value.c_str());
+	}
+	else {
+		std::snprintf(buf, sizeof(buf), "%-8s= %20s", key.c_str(), value.c_str());
+	}
+	std::string c(buf);
+	c.resize(CardSize, ' ');
+	return c;
+}
+
+
+std::string buildHeader(const SyntheticFitsSpec& spec) {
+	std::string header;
+	header += card("SIMPLE", "T", false);
+	header += card("BITPIX", std::to_string(spec.bitpix), false);
+	header += card("NAXIS", spec.channels == 3 ? "3" : "2", false);
+	header += card("NAXIS1", std::to_string(spec.width), false);
+	header += card("NAXIS2", std::to_string(spec.height), false);
+	if (spec.channels == 3)
+		header += card("NAXIS3", "3", false);
+
+	// unsigned integers are stored signed with the usual offsets
+	if (spec.bitpix == 16) {
+		header += card("BZERO", "32768", false);
+		header += card("BSCALE", "1", false);
+	}
+	else if (spec.bitpix == 32 && !spec.biasSubtracted) {
+		header += card("BZERO", "2147483648", false);
+		header += card("BSCALE", "1", false);
+	}
+	if (!spec.bayerPattern.empty())
+		header += card("BAYERPAT", spec.bayerPattern, true);
+	header += card("ROWORDER", spec.bottomUp ? "BOTTOM-UP" : "TOP-DOWN", true);
+	header += card("OBJECT", "Synthetic star field", true);
+
+	std::string end = "END";
+	end.resize(CardSize, ' ');
+	header += end;
+	header.resize((header.size() + BlockSize - 1) / BlockSize * BlockSize, ' ');
+	return header;
+}
+
+
+// Relative response of the CFA site at (row, col), or of the cube plane
+float colorGain(char color) {
+	switch (color) {
+	case 'R': return 0.75f;
+	case 'B': return 0.55f;
+	default: return 1.0f;
+	}
+}
+
+
+// Normalized [0, 1] sample to its big-endian storage
+void storeSample(float v, int bitpix, bool biasSubtracted, unsigned char *out) {
+	v = std::min(1.0f, std::max(0.0f, v));
+	if (biasSubtracted && (bitpix == 32 || bitpix == -64)) {
+		// the same integers in both types
+		const long adu = std::lround(v * 65535.0f) - Bias;
+		if (bitpix == 32) {
+			const uint32_t u = static_cast<uint32_t>(static_cast<int32_t>(adu));
+			for (int b = 0; b < 4; b++) out[b] = static_cast<unsigned char>(u >> (24 - 8 * b));
+		}
+		else {
+			const double d = static_cast<double>(adu);
+			uint64_t u;
+			std::memcpy(&u, &d, sizeof(u));
+			for (int b = 0; b < 8; b++) out[b] = static_cast<unsigned char>(u >> (56 - 8 * b));
+		}
+		return;
+	}
+	switch (bitpix) {
+	case 8:
+		out[0] = static_cast<unsigned char>(std::lround(v * 255.0f));
+		break;
+	case 16: {
+		const uint16_t u = static_cast<uint16_t>(std::lround(v * 65535.0f)) ^ 0x8000;
+		out[0] = static_cast<unsigned char>(u >> 8);
+		out[1] = static_cast<unsigned char>(u);
+		break;
+	}
+	case 32: {
+		const uint32_t u = static_cast<uint32_t>(std::llround(static_cast<double>(v) * 4294967295.0)) ^ 0x80000000u;
+		for (int b = 0; b < 4; b++) out[b] = static_cast<unsigned char>(u >> (24 - 8 * b));
+		break;
+	}
+	case -32: {
+		const float adu = v * 65535.0f;
+		uint32_t u;
+		std::memcpy(&u, &adu, sizeof(u));
+		for (int b = 0; b < 4; b++) out[b] = static_cast<unsigned char>(u >> (24 - 8 * b));
+		break;
+	}
+	default: {
+		const double adu = v * 65535.0;
+		uint64_t u;
+		std::memcpy(&u, &adu, sizeof(u));
+		for (int b = 0; b < 8; b++) out[b] = static_cast<unsigned char>(u >> (56 - 8 * b));
+		break;
+	}
+	}
+}
+
+// Tile compression of a plain file, the primary HDU becomes an empty header followed by
+// the compressed image extension
+bool compressFits(const std::string& plainPath, const std::string& path) {
+	fitsfile *in = nullptr;
+	fitsfile *out = nullptr;
+	int status = 0;
+	fits_open_file(&in, plainPath.c_str(), READONLY, &status);
+	fits_create_file(&out, ("!" + path).c_str(), &status);
+	fits_set_compression_type(out, RICE_1, &status);
+	fits_img_compress(in, out, &status);
+
+	int closeStatus = 0;
+	if (out)
+		fits_close_file(out, &closeStatus);
+	if (in)
+		fits_close_file(in, &closeStatus);
+	return status == 0 && closeStatus == 0;
+}
+
+} // namespace
+
+
+std::string syntheticFitsName(const SyntheticFitsSpec& spec) {
+	std::string name = "stars_" + std::to_string(spec.width) + "x" + std::to_string(spec.height);
+	if (spec.channels == 3)
+		name += "x3";
+	name += spec.bitpix < 0 ? "_bm" + std::to_string(-spec.bitpix) : "_b" + std::to_string(spec.bitpix);
+	name += spec.bayerPattern.empty() ? "_mono" : "_" + spec.bayerPattern;
+	name += spec.bottomUp ? "_bu" : "_td";
+	if (spec.biasSubtracted && (spec.bitpix == 32 || spec.bitpix == -64))
+		name += "_bias";
+	return name + (spec.tileCompressed ? ".fits.fz" : ".fits");
+}
+
+
+bool writeSyntheticFits(const std::string& path, const SyntheticFitsSpec& spec) {
+	if (spec.tileCompressed) {
+		SyntheticFitsSpec plain = spec;
+		plain.tileCompressed = false;
+		const std::string plainPath = path + ".tmp";
+		const bool ok = writeSyntheticFits(plainPath, plain) && compressFits(plainPath, path);
+		std::remove(plainPath.c_str());
+		return ok;
+	}
+
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if (!out.is_open())
+		return false;
+
+	const std::string header = buildHeader(spec);
+	out.write(header.data(), header.size());
+
+	// ~400 stars per megapixel, brightness following a power law, sorted by row
+	Random random(spec.seed);
+	const size_t nbStars = static_cast<size_t>(spec.width) * spec.height / 2500 + 1;
+	std::vector<Star> stars(nbStars);
+	for (auto& star : stars) {
+		star.x = static_cast<float>(random.uniform() * spec.width);
+		star.y = static_cast<float>(random.uniform() * spec.height);
+		star.sigma = static_cast<float>(0.8 + 1.7 * random.uniform());
+		star.peak = static_cast<float>(std::min(1.0, 0.01 * std::pow(random.uniform() + 1e-4, -1.2)));
+	}
+	std::sort(stars.begin(), stars.end(), [](const Star& a, const Star& b) { return a.y < b.y; });
+	constexpr float reach = 4 * 2.5f;
+
+	const int sampleSize = std::abs(spec.bitpix) / 8;
+	std::vector<float> row(spec.width);
+	std::vector<unsigned char> bytes(static_cast<size_t>(spec.width) * sampleSize);
+	const std::string planeColors = "RGB";
+
+	for (int c = 0; c < spec.channels; c++) {
+		size_t firstStar = 0;
+		for (int y = 0; y < spec.height; y++) {
+			for (int x = 0; x < spec.width; x++) {
+				row[x] = 0.05f + 0.02f * x / spec.width + 0.004f * random.gaussian();
+			}
+
+			while (firstStar < stars.size() && stars[firstStar].y + reach < y) firstStar++;
+			for (size_t s = firstStar; s < stars.size() && stars[s].y - reach <= y; s++) {
+				const Star& star = stars[s];
+				const float dy = y - star.y;
+				const float k = -0.5f / (star.sigma * star.sigma);
+				const int x0 = std::max(0, static_cast<int>(star.x - reach));
+				const int x1 = std::min(spec.width - 1, static_cast<int>(star.x + reach));
+				for (int x = x0; x <= x1; x++) {
+					const float dx = x - star.x;
+					row[x] += star.peak * std::exp(k * (dx * dx + dy * dy));
+				}
+			}
+
+			// BAYERPAT describes the top-down image, bottom-up files start on the other row
+			for (int x = 0; x < spec.width; x++) {
+				char color = 'G';
+				if (spec.channels == 3)
+					color = planeColors[c];
+				else if (!spec.bayerPattern.empty())
+					color = spec.bayerPattern[((y + spec.bottomUp) % 2) * 2 + x % 2];
+				storeSample(row[x] * colorGain(color), spec.bitpix, spec.biasSubtracted, &bytes[static_cast<size_t>(x) * sampleSize]);
+			}
+			out.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+		}
+	}
+
+	const size_t dataSize = static_cast<size_t>(spec.width) * spec.height * spec.channels * sampleSize;
+	const size_t padding = (BlockSize - dataSize % BlockSize) % BlockSize;
+	const std::vector<char> zeros(padding, 0);
+	out.write(zeros.data(), zeros.size());
+	return out.good();
+}
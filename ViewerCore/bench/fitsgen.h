@@ -0,0 +1,49 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+
+// Synthetic star-field FITS files for the benchmarks. Files are written directly
+// (header cards and big-endian data), only the tile-compressed copies go through cfitsio.
+
+#pragma once
+#include <string>
+
+
+struct SyntheticFitsSpec
+{
+	int bitpix = 16;              // 8, 16, 32, -32 or -64
+	int width = 1024;
+	int height = 1024;
+	int channels = 1;             // 1, or 3 for an RGB cube
+	std::string bayerPattern;     // BAYERPAT, empty for none
+	bool bottomUp = false;        // ROWORDER = 'BOTTOM-UP'
+	bool tileCompressed = false;  // Rice compressed tiles of one row, like fpack writes
+	bool biasSubtracted = false;  // 32 and -64: integer ADU less a bias, negative in the background, BZERO 0
+	unsigned seed = 1;
+};
+
+
+// File name describing the spec, e.g. "stars_4096x4096_b16_RGGB_td.fits", ".fits.fz" when tile-compressed
+std::string syntheticFitsName(const SyntheticFitsSpec& spec);
+
+// Background with a gradient, read noise and a power-law population of gaussian stars.
+// Mosaics get a per-site color response. Returns false on I/O error.
+bool writeSyntheticFits(const std::string& path, const SyntheticFitsSpec& spec);
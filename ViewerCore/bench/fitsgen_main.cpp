@@ -0,0 +1,107 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+
+// Writes one synthetic star-field FITS file, see fitsgen.h
+//
+//   fitsgen [--bitpix 8|16|32|-32|-64] [--size WxH | --mp N] [--bayer RGGB|BGGR|GRBG|GBRG]
+//           [--rgb] [--bottom-up] [--bias] [--fz] [--seed N] [--dir DIR | -o FILE]
+
+#include "fitsgen.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+
+static void usage() {
+	std::fprintf(stderr, "usage: fitsgen [--bitpix 8|16|32|-32|-64] [--size WxH | --mp N] [--bayer PATTERN]\n"
+		"               [--rgb] [--bottom-up] [--bias] [--fz] [--seed N] [--dir DIR | -o FILE]\n");
+}
+
+
+int main(int argc, char **argv) {
+	SyntheticFitsSpec spec;
+	std::string dir = ".";
+	std::string output;
+
+	for (int i = 1; i < argc; i++) {
+		const std::string arg = argv[i];
+		const bool hasValue = i + 1 < argc;
+		if (arg == "--bitpix" && hasValue) {
+			spec.bitpix = std::atoi(argv[++i]);
+		}
+		else if (arg == "--size" && hasValue) {
+			if (std::sscanf(argv[++i], "%dx%d", &spec.width, &spec.height) != 2) {
+				usage();
+				return 1;
+			}
+		}
+		else if (arg == "--mp" && hasValue) {
+			const double side = std::sqrt(std::atof(argv[++i]) * 1e6);
+			spec.width = spec.height = static_cast<int>(side) & ~1;
+		}
+		else if (arg == "--bayer" && hasValue) {
+			spec.bayerPattern = argv[++i];
+		}
+		else if (arg == "--rgb") {
+			spec.channels = 3;
+		}
+		else if (arg == "--bottom-up") {
+			spec.bottomUp = true;
+		}
+		else if (arg == "--bias") {
+			spec.biasSubtracted = true;
+		}
+		else if (arg == "--fz") {
+			spec.tileCompressed = true;
+		}
+		else if (arg == "--seed" && hasValue) {
+			spec.seed = static_cast<unsigned>(std::atoi(argv[++i]));
+		}
+		else if (arg == "--dir" && hasValue) {
+			dir = argv[++i];
+		}
+		else if (arg == "-o" && hasValue) {
+			output = argv[++i];
+		}
+		else {
+			usage();
+			return 1;
+		}
+	}
+
+	const int bitpix = spec.bitpix;
+	if (!(bitpix == 8 || bitpix == 16 || bitpix == 32 || bitpix == -32 || bitpix == -64) || spec.width <= 0 || spec.height <= 0) {
+		usage();
+		return 1;
+	}
+
+	if (output.empty())
+		output = dir + "/" + syntheticFitsName(spec);
+	if (!writeSyntheticFits(output, spec)) {
+		std::fprintf(stderr, "fitsgen: cannot write %s\n", output.c_str());
+		return 1;
+	}
+	std::printf("%s\n", output.c_str());
+	return 0;
+}
@@ -0,0 +1,284 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+// Big-endian FITS samples to native pipeline values, byte swap and BZERO/BSCALE fused in one pass.
+// The kernels use SSE2, the baseline on x86/x64. Other architectures and the loop tails use the scalar code.
+
+#ifndef bigendian_h
+#define bigendian_h
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BIGENDIAN_SSE2
+#include <emmintrin.h>
+#endif
+
+
+template <int BITPIX> struct FitsSample;
+
+template <> struct FitsSample<8> {
+	static constexpr int size = 1;
+	static double load(const unsigned char *p) { return p[0]; }
+};
+
+template <> struct FitsSample<16> {
+	static constexpr int size = 2;
+	static double load(const unsigned char *p) {
+		return static_cast<int16_t>(static_cast<uint16_t>(p[0] << 8 | p[1]));
+	}
+};
+
+template <> struct FitsSample<32> {
+	static constexpr int size = 4;
+	static double load(const unsigned char *p) {
+		return static_cast<int32_t>(static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16
+			| static_cast<uint32_t>(p[2]) << 8 | p[3]);
+	}
+};
+
+template <> struct FitsSample<-32> {
+	static constexpr int size = 4;
+	static double load(const unsigned char *p) {
+		uint32_t u = static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16
+			| static_cast<uint32_t>(p[2]) << 8 | p[3];
+		float f;
+		memcpy(&f, &u, sizeof(f));
+		return f;
+	}
+};
+
+template <> struct FitsSample<-64> {
+	static constexpr int size = 8;
+	static double load(const unsigned char *p) {
+		uint64_t u = 0;
+		for (int i = 0; i < 8; i++) u = u << 8 | p[i];
+		double d;
+		memcpy(&d, &u, sizeof(d));
+		return d;
+	}
+};
+
+
+// Same conversion rules as cfitsio: scaled values are rounded and clipped to the integer range
+template <typename T>
+T toPipelineValue(double v) {
+	if (std::is_integral<T>::value) {
+		constexpr double maxValue = static_cast<double>(std::numeric_limits<T>::max());
+		if (v <= 0) return 0;
+		if (v >= maxValue) return static_cast<T>(maxValue);
+		return static_cast<T>(v + 0.5);
+	}
+	return static_cast<T>(v);
+}
+
+
+template <int BITPIX, typename T>
+void convertBigEndianScalar(const unsigned char *src, T *dst, size_t n, double bscale, double bzero) {
+	constexpr int size = FitsSample<BITPIX>::size;
+	for (size_t i = 0; i < n; i++) {
+		dst[i] = toPipelineValue<T>(FitsSample<BITPIX>::load(src + i * size) * bscale + bzero);
+	}
+}
+
+
+#ifdef BIGENDIAN_SSE2
+inline __m128i bswap16_sse2(__m128i v) {
+	return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+inline __m128i bswap32_sse2(__m128i v) {
+	v = bswap16_sse2(v);
+	v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+	return _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+inline __m128i bswap64_sse2(__m128i v) {
+	v = bswap16_sse2(v);
+	v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+	return _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+}
+
+// clamp to [0, 65535], round half up like toPipelineValue, pack 2x4 floats to 8 unsigned shorts
+inline __m128i packFloatToU16_sse2(__m128 lo, __m128 hi) {
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 maxValue = _mm_set1_ps(65535.0f);
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128i bias = _mm_set1_epi32(32768);
+	lo = _mm_min_ps(_mm_max_ps(lo, zero), maxValue);
+	hi = _mm_min_ps(_mm_max_ps(hi, zero), maxValue);
+	__m128i ilo = _mm_sub_epi32(_mm_cvttps_epi32(_mm_add_ps(lo, half)), bias);
+	__m128i ihi = _mm_sub_epi32(_mm_cvttps_epi32(_mm_add_ps(hi, half)), bias);
+	// SSE2 only has a signed pack, shift to the signed range and back
+	return _mm_xor_si128(_mm_packs_epi32(ilo, ihi), _mm_set1_epi16(static_cast<short>(0x8000)));
+}
+#endif
+
+
+// BITPIX 16 -> unsigned short
+inline void convertBE16ToU16(const unsigned char *src, unsigned short *dst, size_t n, double bscale, double bzero) {
+	size_t i = 0;
+
+	if (bscale == 1 && bzero == 32768) {
+		// unsigned data stored as signed, flipping the sign bit is the whole conversion
+#ifdef BIGENDIAN_SSE2
+		const __m128i sign = _mm_set1_epi16(static_cast<short>(0x8000));
+		for (; i + 8 <= n; i += 8) {
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2 * i));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_xor_si128(bswap16_sse2(v), sign));
+		}
+#endif
+		for (; i < n; i++) {
+			dst[i] = static_cast<unsigned short>((src[2 * i] << 8 | src[2 * i + 1]) ^ 0x8000);
+		}
+		return;
+	}
+
+#ifdef BIGENDIAN_SSE2
+	const __m128 scale = _mm_set1_ps(static_cast<float>(bscale));
+	const __m128 zero = _mm_set1_ps(static_cast<float>(bzero));
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = bswap16_sse2(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2 * i)));
+		// sign extend to 32 bits
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+		__m128 flo = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(lo), scale), zero);
+		__m128 fhi = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(hi), scale), zero);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), packFloatToU16_sse2(flo, fhi));
+	}
+#endif
+	convertBigEndianScalar<16>(src + 2 * i, dst + i, n - i, bscale, bzero);
+}
+
+
+// BITPIX -32 -> float
+inline void convertBEFloatToFloat(const unsigned char *src, float *dst, size_t n, double bscale, double bzero) {
+	size_t i = 0;
+	const bool identity = bscale == 1 && bzero == 0;
+#ifdef BIGENDIAN_SSE2
+	const __m128 scale = _mm_set1_ps(static_cast<float>(bscale));
+	const __m128 zero = _mm_set1_ps(static_cast<float>(bzero));
+	for (; i + 4 <= n; i += 4) {
+		__m128 v = _mm_castsi128_ps(bswap32_sse2(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 4 * i))));
+		if (!identity)
+			v = _mm_add_ps(_mm_mul_ps(v, scale), zero);
+		_mm_storeu_ps(dst + i, v);
+	}
+#endif
+	convertBigEndianScalar<-32>(src + 4 * i, dst + i, n - i, bscale, bzero);
+}
+
+
+// BITPIX 8 -> unsigned char, a plain copy unless the data is scaled
+inline void convertU8ToU8(const unsigned char *src, unsigned char *dst, size_t n, double bscale, double bzero) {
+	if (bscale == 1 && bzero == 0) {
+		memcpy(dst, src, n);
+		return;
+	}
+	convertBigEndianScalar<8>(src, dst, n, bscale, bzero);
+}
+
+
+// BITPIX 32 -> unsigned int
+inline void convertBE32ToU32(const unsigned char *src, unsigned int *dst, size_t n, double bscale, double bzero) {
+	size_t i = 0;
+
+	if (bscale == 1 && bzero == 2147483648.0) {
+		// unsigned data stored as signed, same trick as 16-bit
+#ifdef BIGENDIAN_SSE2
+		const __m128i sign = _mm_set1_epi32(static_cast<int>(0x80000000u));
+		for (; i + 4 <= n; i += 4) {
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 4 * i));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_xor_si128(bswap32_sse2(v), sign));
+		}
+#endif
+		for (; i < n; i++) {
+			const unsigned char *p = src + 4 * i;
+			dst[i] = (static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16
+				| static_cast<uint32_t>(p[2]) << 8 | p[3]) ^ 0x80000000u;
+		}
+		return;
+	}
+	convertBigEndianScalar<32>(src, dst, n, bscale, bzero);
+}
+
+
+// BITPIX -64 -> double
+inline void convertBEDoubleToDouble(const unsigned char *src, double *dst, size_t n, double bscale, double bzero) {
+	size_t i = 0;
+	const bool identity = bscale == 1 && bzero == 0;
+#ifdef BIGENDIAN_SSE2
+	const __m128d scale = _mm_set1_pd(bscale);
+	const __m128d zero = _mm_set1_pd(bzero);
+	for (; i + 2 <= n; i += 2) {
+		__m128d v = _mm_castsi128_pd(bswap64_sse2(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 8 * i))));
+		if (!identity)
+			v = _mm_add_pd(_mm_mul_pd(v, scale), zero);
+		_mm_storeu_pd(dst + i, v);
+	}
+#endif
+	convertBigEndianScalar<-64>(src + 8 * i, dst + i, n - i, bscale, bzero);
+}
+
+
+// Contiguous conversion entry point, picks the vectorized kernel for the BITPIX/T pair when there is one
+template <int BITPIX, typename T>
+struct BigEndianConverter {
+	static void convert(const unsigned char *src, T *dst, size_t n, double bscale, double bzero) {
+		convertBigEndianScalar<BITPIX>(src, dst, n, bscale, bzero);
+	}
+};
+
+template <> struct BigEndianConverter<16, unsigned short> {
+	static void convert(const unsigned char *src, unsigned short *dst, size_t n, double bscale, double bzero) {
+		convertBE16ToU16(src, dst, n, bscale, bzero);
+	}
+};
+
+template <> struct BigEndianConverter<-32, float> {
+	static void convert(const unsigned char *src, float *dst, size_t n, double bscale, double bzero) {
+		convertBEFloatToFloat(src, dst, n, bscale, bzero);
+	}
+};
+
+template <> struct BigEndianConverter<8, unsigned char> {
+	static void convert(const unsigned char *src, unsigned char *dst, size_t n, double bscale, double bzero) {
+		convertU8ToU8(src, dst, n, bscale, bzero);
+	}
+};
+
+template <> struct BigEndianConverter<32, unsigned int> {
+	static void convert(const unsigned char *src, unsigned int *dst, size_t n, double bscale, double bzero) {
+		convertBE32ToU32(src, dst, n, bscale, bzero);
+	}
+};
+
+template <> struct BigEndianConverter<-64, double> {
+	static void convert(const unsigned char *src, double *dst, size_t n, double bscale, double bzero) {
+		convertBEDoubleToDouble(src, dst, n, bscale, bzero);
+	}
+};
+
+#endif /* bigendian_h */
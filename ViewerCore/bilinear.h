@@ -0,0 +1,244 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+
+// Full resolution bilinear demosaic. Every output channel of a pixel is a weighted sum of
+// the pixel, its horizontal pair, its vertical pair and its four diagonal neighbours, the
+// weights depending only on the CFA site. Rows are processed four pixels at a time with
+// SSE2, the first and last columns and rows mirror their missing neighbours.
+
+#ifndef bilinear_h
+#define bilinear_h
+
+#include <valarray>
+#include <algorithm>
+#include <string>
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include "threadpool.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BILINEAR_SSE2
+#include <emmintrin.h>
+#endif
+
+
+// Weights of one output channel at one CFA site
+struct BilinearTerms
+{
+	float center;
+	float horizontal;   // left + right
+	float vertical;     // up + down
+	float diagonal;     // the four corners
+};
+
+
+// terms[row parity][column parity][channel] of a top-down pattern such as "RGGB"
+struct BilinearWeights
+{
+	BilinearTerms terms[2][2][3];
+
+	explicit BilinearWeights(const std::string& pattern) {
+		auto colorAt = [&](int py, int px) {
+			const char c = pattern.size() == 4 ? pattern[2 * py + px] : 'G';
+			return c == 'R' ? 0 : c == 'B' ? 2 : 1;
+		};
+		for (int py = 0; py < 2; py++) {
+			for (int px = 0; px < 2; px++) {
+				const int site = colorAt(py, px);
+				for (int ch = 0; ch < 3; ch++) {
+					BilinearTerms t = { 0, 0, 0, 0 };
+					if (ch == site) {
+						t.center = 1;
+					}
+					else if (ch == 1) {
+						// green at a red or blue site: the four direct neighbours
+						t.horizontal = 0.25f;
+						t.vertical = 0.25f;
+					}
+					else if (site == 1) {
+						// red or blue at a green site: the pair on the row or the column holding it
+						if (colorAt(py, 1 - px) == ch)
+							t.horizontal = 0.5f;
+						else
+							t.vertical = 0.5f;
+					}
+					else {
+						// red at a blue site and the other way round
+						t.diagonal = 0.25f;
+					}
+					terms[py][px][ch] = t;
+				}
+			}
+		}
+	}
+};
+
+
+// One pixel, jl and jr being the columns of its left and right neighbours
+template <typename T>
+inline void bilinearPixel(const T *up, const T *cur, const T *down, int j, int jl, int jr,
+	const BilinearTerms *terms, T *const *out) {
+	const float c = static_cast<float>(cur[j]);
+	const float h = static_cast<float>(cur[jl]) + static_cast<float>(cur[jr]);
+	const float v = static_cast<float>(up[j]) + static_cast<float>(down[j]);
+	const float x = (static_cast<float>(up[jl]) + static_cast<float>(up[jr])) + (static_cast<float>(down[jl]) + static_cast<float>(down[jr]));
+	for (int ch = 0; ch < 3; ch++) {
+		const BilinearTerms& t = terms[ch];
+		out[ch][j] = static_cast<T>(t.center * c + t.horizontal * h + t.vertical * v + t.diagonal * x);
+	}
+}
+
+
+#ifdef BILINEAR_SSE2
+// 4 samples to 4 floats and back, truncating like static_cast
+inline __m128 loadBilinear4(const float *p) {
+	return _mm_loadu_ps(p);
+}
+
+inline __m128 loadBilinear4(const unsigned short *p) {
+	const __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p));
+	return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, _mm_setzero_si128()));
+}
+
+inline __m128 loadBilinear4(const unsigned char *p) {
+	int32_t bytes;
+	std::memcpy(&bytes, p, 4);
+	const __m128i z = _mm_setzero_si128();
+	const __m128i v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), z), z);
+	return _mm_cvtepi32_ps(v);
+}
+
+// 32-bit unsigned and double samples have no direct SSE2 conversion
+template <typename T>
+inline __m128 loadBilinear4(const T *p) {
+	return _mm_setr_ps(static_cast<float>(p[0]), static_cast<float>(p[1]), static_cast<float>(p[2]), static_cast<float>(p[3]));
+}
+
+inline void storeBilinear4(float *p, __m128 v) {
+	_mm_storeu_ps(p, v);
+}
+
+inline void storeBilinear4(unsigned short *p, __m128 v) {
+	// SSE2 only has a signed pack, shift to the signed range and back
+	const __m128i i = _mm_sub_epi32(_mm_cvttps_epi32(v), _mm_set1_epi32(32768));
+	const __m128i packed = _mm_xor_si128(_mm_packs_epi32(i, i), _mm_set1_epi16(static_cast<short>(0x8000)));
+	_mm_storel_epi64(reinterpret_cast<__m128i *>(p), packed);
+}
+
+inline void storeBilinear4(unsigned char *p, __m128 v) {
+	__m128i i = _mm_cvttps_epi32(v);
+	i = _mm_packus_epi16(_mm_packs_epi32(i, i), i);
+	const int32_t bytes = _mm_cvtsi128_si32(i);
+	std::memcpy(p, &bytes, 4);
+}
+
+template <typename T>
+inline void storeBilinear4(T *p, __m128 v) {
+	alignas(16) float f[4];
+	_mm_store_ps(f, v);
+	for (int k = 0; k < 4; k++) {
+		p[k] = static_cast<T>(f[k]);
+	}
+}
+#endif
+
+
+// Interior columns [1, width - 1) of one row, siteTerms[column parity][channel]
+template <typename T>
+int bilinearRowInterior(const T *up, const T *cur, const T *down, int width, const BilinearTerms (*siteTerms)[3], T *const *out) {
+	int j = 1;
+#ifdef BILINEAR_SSE2
+	// blocks start on odd columns: lanes alternate odd, even, odd, even
+	__m128 wc[3], wh[3], wv[3], wx[3];
+	for (int ch = 0; ch < 3; ch++) {
+		const BilinearTerms& odd = siteTerms[1][ch];
+		const BilinearTerms& even = siteTerms[0][ch];
+		wc[ch] = _mm_setr_ps(odd.center, even.center, odd.center, even.center);
+		wh[ch] = _mm_setr_ps(odd.horizontal, even.horizontal, odd.horizontal, even.horizontal);
+		wv[ch] = _mm_setr_ps(odd.vertical, even.vertical, odd.vertical, even.vertical);
+		wx[ch] = _mm_setr_ps(odd.diagonal, even.diagonal, odd.diagonal, even.diagonal);
+	}
+	for (; j + 4 <= width - 1; j += 4) {
+		const __m128 c = loadBilinear4(cur + j);
+		const __m128 h = _mm_add_ps(loadBilinear4(cur + j - 1), loadBilinear4(cur + j + 1));
+		const __m128 v = _mm_add_ps(loadBilinear4(up + j), loadBilinear4(down + j));
+		const __m128 x = _mm_add_ps(_mm_add_ps(loadBilinear4(up + j - 1), loadBilinear4(up + j + 1)),
+			_mm_add_ps(loadBilinear4(down + j - 1), loadBilinear4(down + j + 1)));
+		for (int ch = 0; ch < 3; ch++) {
+			__m128 sum = _mm_add_ps(_mm_mul_ps(wc[ch], c), _mm_mul_ps(wh[ch], h));
+			sum = _mm_add_ps(_mm_add_ps(sum, _mm_mul_ps(wv[ch], v)), _mm_mul_ps(wx[ch], x));
+			storeBilinear4(out[ch] + j, sum);
+		}
+	}
+#endif
+	for (; j < width - 1; j++) {
+		bilinearPixel(up, cur, down, j, j - 1, j + 1, siteTerms[j & 1], out);
+	}
+	return j;
+}
+
+
+// Rows [row0, row1) of a width x height mosaic. rows holds mosaic rows rowStride samples
+// apart starting with row firstRow, including the neighbours row0 - 1 and row1 where they
+// exist. The three output planes, planeSize samples apart, receive (row1 - row0) rows each.
+template <typename T>
+void bilinearRows(const T *rows, size_t rowStride, int firstRow, int width, int height, int row0, int row1,
+	const BilinearWeights& weights, T *out, size_t planeSize) {
+	if (width <= 0 || height <= 0)
+		return;
+
+	// mirrored borders keep the parity, row -1 becomes row 1 and column -1 column 1
+	const int mirrorFirst = std::min(1, width - 1);
+	const int mirrorLast = std::max(0, width - 2);
+
+	parallel_for(row0, row1, [&](int y) {
+		const int yUp = y > 0 ? y - 1 : std::min(1, height - 1);
+		const int yDown = y < height - 1 ? y + 1 : std::max(0, height - 2);
+		const T *up = rows + static_cast<size_t>(yUp - firstRow) * rowStride;
+		const T *cur = rows + static_cast<size_t>(y - firstRow) * rowStride;
+		const T *down = rows + static_cast<size_t>(yDown - firstRow) * rowStride;
+
+		const size_t rowOffset = static_cast<size_t>(y - row0) * width;
+		T *const dst[3] = { out + rowOffset, out + planeSize + rowOffset, out + 2 * planeSize + rowOffset };
+		const BilinearTerms (*siteTerms)[3] = weights.terms[y & 1];
+
+		bilinearPixel(up, cur, down, 0, mirrorFirst, mirrorFirst, siteTerms[0], dst);
+		if (width > 1) {
+			bilinearRowInterior(up, cur, down, width, siteTerms, dst);
+			bilinearPixel(up, cur, down, width - 1, mirrorLast, mirrorLast, siteTerms[(width - 1) & 1], dst);
+		}
+	});
+}
+
+
+// Whole width x height mosaic. Like super_pixel only whole CFA cells are kept, newbuf holds
+// 3 planes of (width & ~1) x (height & ~1).
+template <typename T>
+void bilinear_debayer(const std::valarray<T>& buf, std::valarray<T>& newbuf, int width, int height, const std::string& pattern) {
+	const int outWidth = width & ~1;
+	const int outHeight = height & ~1;
+	bilinearRows(&buf[0], static_cast<size_t>(width), 0, outWidth, outHeight, 0, outHeight, BilinearWeights(pattern),
+		&newbuf[0], static_cast<size_t>(outWidth) * outHeight);
+}
+
+#endif /* bilinear_h */
@@ -0,0 +1,217 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+
+// Fused super pixel debayer and NxN binning for downscaled previews of Bayer images. Every
+// output pixel averages the bin x bin CFA cells it covers instead of keeping one of them, so
+// hot pixels and noise aren't aliased into the preview. Source rows are converted from the
+// mapped file into a per row scratch buffer and summed right away: the full resolution
+// mosaic never exists and the raw data is read once.
+
+#ifndef binning_h
+#define binning_h
+
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+#include "directread.h"
+#include "threadpool.h"
+
+#ifdef BIGENDIAN_SSE2
+#define BINNING_SSE2
+#endif
+
+
+// Exact integer sums for 8 and 16 bit samples, double otherwise
+template <typename T>
+struct BinSum
+{
+	typedef typename std::conditional<std::is_integral<T>::value && sizeof(T) <= 2, uint32_t, double>::type type;
+};
+
+
+// acc[i] += row[i] for n samples
+template <typename T, typename Acc>
+inline void binAccumulate(const T *row, Acc *acc, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		acc[i] += row[i];
+	}
+}
+
+#ifdef BINNING_SSE2
+inline void binAccumulate(const unsigned short *row, uint32_t *acc, size_t n) {
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + i));
+		__m128i *a = reinterpret_cast<__m128i *>(acc + i);
+		_mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a), _mm_unpacklo_epi16(v, zero)));
+		_mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), _mm_unpackhi_epi16(v, zero)));
+	}
+	for (; i < n; i++) {
+		acc[i] += row[i];
+	}
+}
+
+inline void binAccumulate(const unsigned char *row, uint32_t *acc, size_t n) {
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + i));
+		const __m128i lo = _mm_unpacklo_epi8(v, zero);
+		const __m128i hi = _mm_unpackhi_epi8(v, zero);
+		__m128i *a = reinterpret_cast<__m128i *>(acc + i);
+		_mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a), _mm_unpacklo_epi16(lo, zero)));
+		_mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), _mm_unpackhi_epi16(lo, zero)));
+		_mm_storeu_si128(a + 2, _mm_add_epi32(_mm_loadu_si128(a + 2), _mm_unpacklo_epi16(hi, zero)));
+		_mm_storeu_si128(a + 3, _mm_add_epi32(_mm_loadu_si128(a + 3), _mm_unpackhi_epi16(hi, zero)));
+	}
+	for (; i < n; i++) {
+		acc[i] += row[i];
+	}
+}
+#endif
+
+
+// Colour of every CFA site of a pattern in file row order, see super_pixel
+struct BinPattern
+{
+	int color[2][2];    // 0 red, 1 green, 2 blue
+
+	explicit BinPattern(const std::string& pattern) {
+		for (int py = 0; py < 2; py++) {
+			for (int px = 0; px < 2; px++) {
+				const char c = pattern.size() == 4 ? pattern[2 * py + px] : 'G';
+				color[py][px] = c == 'R' ? 0 : c == 'B' ? 2 : 1;
+			}
+		}
+	}
+};
+
+
+// Output rows [row0, row1) of the binned super pixel image, outWidth pixels wide, into the
+// 3 planes of out, planeSize samples apart. src is the first byte of source row 2 * bin * row0.
+template <int BITPIX, typename T>
+void binMappedRows(const unsigned char *src, const FitsHeaderInfo& info, const BinPattern& pattern, int bin,
+	int outWidth, int row0, int row1, T *out, size_t planeSize) {
+	typedef typename BinSum<T>::type Acc;
+	constexpr int size = FitsSample<BITPIX>::size;
+	const size_t rowBytes = static_cast<size_t>(info.naxes[0]) * size;
+	const size_t usedSamples = 2 * static_cast<size_t>(bin) * outWidth;
+
+	// 2 G sites per cell
+	double scale[3];
+	for (int ch = 0; ch < 3; ch++) {
+		scale[ch] = 1.0 / (static_cast<double>(bin) * bin * (ch == 1 ? 2 : 1));
+	}
+
+	// one tile of output rows per pool chunk, so that the scratch buffers are allocated
+	// once per tile and not once per row
+	const size_t nbRows = row1 > row0 ? static_cast<size_t>(row1 - row0) : 0;
+	const size_t nbTiles = std::min<size_t>(nbRows, 4 * static_cast<size_t>(ThreadPool::instance().size()));
+	if (nbTiles == 0)
+		return;
+	parallel_for_tiles(nbRows, (nbRows + nbTiles - 1) / nbTiles, [&](size_t tileBegin, size_t tileEnd) {
+		// one converted source row and the column sums of the even and odd source rows
+		std::vector<T> row(usedSamples);
+		std::vector<Acc> sums(2 * usedSamples);
+		for (size_t o = tileBegin; o < tileEnd; o++) {
+			std::fill(sums.begin(), sums.end(), Acc(0));
+			const unsigned char *first = src + o * 2 * bin * rowBytes;
+			for (int r = 0; r < 2 * bin; r++) {
+				convertSamples<BITPIX>(first + r * rowBytes, 1, &row[0], 1, usedSamples, info.bscale, info.bzero);
+				binAccumulate(&row[0], &sums[(r & 1) * usedSamples], usedSamples);
+			}
+
+			T *dst = out + o * outWidth;
+			for (int q = 0; q < outWidth; q++) {
+				double rgb[3] = { 0, 0, 0 };
+				for (int py = 0; py < 2; py++) {
+					const Acc *s = &sums[py * usedSamples + 2 * static_cast<size_t>(q) * bin];
+					Acc site[2] = { 0, 0 };
+					for (int i = 0; i < bin; i++) {
+						site[0] += s[2 * i];
+						site[1] += s[2 * i + 1];
+					}
+					rgb[pattern.color[py][0]] += static_cast<double>(site[0]);
+					rgb[pattern.color[py][1]] += static_cast<double>(site[1]);
+				}
+				// the mean rounded like the sample conversion
+				for (int ch = 0; ch < 3; ch++) {
+					dst[ch * planeSize + q] = toPipelineValue<T>(rgb[ch] * scale[ch]);
+				}
+			}
+		}
+	});
+}
+
+
+// Same with the BITPIX of the file, which isMappable has checked
+template <typename T>
+void binMappedRows(const unsigned char *src, const FitsHeaderInfo& info, const BinPattern& pattern, int bin,
+	int outWidth, int row0, int row1, T *out, size_t planeSize) {
+	switch (info.bitpix) {
+	case 8:
+		binMappedRows<8>(src, info, pattern, bin, outWidth, row0, row1, out, planeSize);
+		break;
+	case 16:
+		binMappedRows<16>(src, info, pattern, bin, outWidth, row0, row1, out, planeSize);
+		break;
+	case 32:
+		binMappedRows<32>(src, info, pattern, bin, outWidth, row0, row1, out, planeSize);
+		break;
+	case -32:
+		binMappedRows<-32>(src, info, pattern, bin, outWidth, row0, row1, out, planeSize);
+		break;
+	case -64:
+		binMappedRows<-64>(src, info, pattern, bin, outWidth, row0, row1, out, planeSize);
+		break;
+	}
+}
+
+
+// Binned super pixel image of a mapped Bayer file, outDim being the super pixel output for
+// a downscale factor of bin. Returns false if the file can't be mapped, the caller then
+// reads a decimated mosaic instead.
+template <typename T>
+bool readImagePixBinned(const string& path, const FitsHeaderInfo& info, const ImageDim& outDim,
+	const string& pattern, int bin, std::valarray<T>& buffer) {
+	if (!isMappable(info) || info.naxis != 2 || bin < 2)
+		return false;
+	const size_t planeSize = static_cast<size_t>(outDim.nx) * outDim.ny;
+	if (planeSize == 0)
+		return false;
+
+	MappedFile file;
+	if (!file.open(path) || !hasImageData(file.size(), info))
+		return false;
+
+	writeToLogFile("Binned read start");
+	buffer.resize(3 * planeSize);
+	binMappedRows(file.data() + info.dataOffset, info, BinPattern(pattern), bin, outDim.nx, 0, outDim.ny, &buffer[0], planeSize);
+	writeToLogFile("Binned read finish");
+	return true;
+}
+
+#endif /* binning_h */
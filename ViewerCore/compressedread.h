@@ -0,0 +1,162 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+
+// Parallel reader for tile-compressed images (fpack'ed .fz files, Rice, GZIP, HCOMPRESS
+// or PLIO tiles). A single cfitsio handle decompresses tile after tile on one thread,
+// so every pool lane opens its own handle and decodes bands of whole tile rows straight
+// into the pipeline buffer. Requires a reentrant cfitsio build, otherwise a single lane
+// does the same work serially.
+
+#ifndef compressedread_h
+#define compressedread_h
+
+#include <valarray>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <fitsio.h>
+#include "FitsImage.h"
+#include "FitsHeader.h"
+#include "pixeltraits.h"
+#include "threadpool.h"
+
+
+// Reads the output rows of cells [k0, k1) of the decimated image, a cell row being one
+// row, or one row of 2x2 CFA cells for Bayer images. See readImagePix for the decimation rules.
+template <typename T>
+bool readCompressedBand(fitsfile *fptr, const ImageDim& readDim, bool isBayer, int factor,
+	long k0, long k1, std::valarray<T>& buffer, std::vector<T>& scratch, int *status) {
+	const size_t planeSize = static_cast<size_t>(readDim.nx) * readDim.ny;
+	T nulval = 0;
+	int anynul = 0;
+
+	if (!isBayer) {
+		for (int c = 0; c < readDim.nc; c++) {
+			long fpixel[3] = { 1, k0 * factor + 1, c + 1 };
+			long lpixel[3] = { (readDim.nx - 1) * factor + 1, (k1 - 1) * factor + 1, c + 1 };
+			long inc[3] = { factor, factor, 1 };
+			fits_read_subset(fptr, FitsDataType<T>::value, fpixel, lpixel, inc, &nulval,
+				&buffer[c * planeSize + static_cast<size_t>(k0) * readDim.nx], &anynul, status);
+			if (*status)
+				return false;
+		}
+		return true;
+	}
+
+	// one strided read per CFA site of the band, interleaved back into the mosaic
+	const long cellsX = readDim.nx / 2;
+	const long step = 2 * factor;
+	scratch.resize(static_cast<size_t>(k1 - k0) * cellsX);
+	for (int dy = 0; dy < 2; dy++) {
+		for (int dx = 0; dx < 2; dx++) {
+			long fpixel[2] = { 1 + dx, k0 * step + dy + 1 };
+			long lpixel[2] = { 1 + dx + (cellsX - 1) * step, (k1 - 1) * step + dy + 1 };
+			long inc[2] = { step, step };
+			fits_read_subset(fptr, FitsDataType<T>::value, fpixel, lpixel, inc, &nulval, scratch.data(), &anynul, status);
+			if (*status)
+				return false;
+
+			for (long k = k0; k < k1; k++) {
+				T *dst = &buffer[static_cast<size_t>(2 * k + dy) * readDim.nx + dx];
+				const T *src = &scratch[static_cast<size_t>(k - k0) * cellsX];
+				for (long j = 0; j < cellsX; j++) {
+					dst[2 * j] = src[j];
+				}
+			}
+		}
+	}
+	return true;
+}
+
+
+// Returns false if the image isn't tile-compressed or a tile can't be decoded,
+// the caller then goes through the serial cfitsio read. On success nbLanesUsed receives
+// the number of handles that decoded the image.
+template <typename T>
+bool readCompressedImagePix(const string& path, const FitsHeaderInfo& info, const ImageDim& readDim,
+	bool isBayer, int factor, std::valarray<T>& buffer, int *nbLanesUsed = nullptr) {
+	if (!info.compressed || info.gzipped || info.naxis < 2 || info.naxis > 3)
+		return false;
+	if (static_cast<size_t>(readDim.nx) * readDim.ny * readDim.nc == 0)
+		return false;
+
+	// Undecimated mosaics are read as plain rows
+	isBayer = isBayer && factor > 1;
+
+	// Bands of whole tile rows, so that no tile is decompressed by two lanes
+	const long cellHeight = isBayer ? 2 : 1;
+	const long srcStride = cellHeight * std::max(1, factor);
+	const long nbCells = readDim.ny / cellHeight;
+	const long tileHeight = static_cast<long>(std::max(1LL, info.tileSize[1]));
+	const long nbTileRows = static_cast<long>((info.naxes[1] + tileHeight - 1) / tileHeight);
+
+	ThreadPool& pool = ThreadPool::instance();
+	const long targetBands = 4 * static_cast<long>(pool.size());
+	const long bandHeight = tileHeight * std::max(1L, (nbTileRows + targetBands - 1) / targetBands);
+	const long nbBands = static_cast<long>((info.naxes[1] + bandHeight - 1) / bandHeight);
+	const bool reentrant = fits_is_reentrant() != 0;
+	const int nbLanes = reentrant ? static_cast<int>(std::min<long>(pool.size(), nbBands)) : 1;
+
+	if (!reentrant)
+		writeToLogFile("cfitsio is not reentrant, compressed tiles are decoded on a single lane");
+	writeToLogFile(string_format("Compressed read start %s, %d lanes", info.compression.c_str(), nbLanes));
+	buffer.resize(static_cast<size_t>(readDim.nx) * readDim.ny * readDim.nc);
+
+	std::atomic<long> nextBand(0);
+	std::atomic<bool> failed(false);
+	parallel_for(0, nbLanes, [&](int) {
+		fitsfile *fptr = nullptr;
+		int status = 0;
+		int hduType = 0;
+		fits_open_diskfile(&fptr, path.c_str(), READONLY, &status);
+		fits_movabs_hdu(fptr, info.hdu, &hduType, &status);
+
+		std::vector<T> scratch;
+		for (long band = nextBand++; !status && !failed && band < nbBands; band = nextBand++) {
+			// cells whose first source row falls in the band
+			const long k0 = (band * bandHeight + srcStride - 1) / srcStride;
+			const long k1 = std::min(nbCells, ((band + 1) * bandHeight + srcStride - 1) / srcStride);
+			if (k0 < k1)
+				readCompressedBand(fptr, readDim, isBayer, factor, k0, k1, buffer, scratch, &status);
+		}
+
+		if (status) {
+			char errText[FLEN_STATUS];
+			fits_get_errstatus(status, errText);
+			writeToLogFile(string_format("Compressed read failed: %s", errText));
+			failed = true;
+		}
+		if (fptr) {
+			int closeStatus = 0;
+			fits_close_file(fptr, &closeStatus);
+		}
+	});
+
+	writeToLogFile("Compressed read finish");
+	if (failed)
+		return false;
+	if (nbLanesUsed)
+		*nbLanesUsed = nbLanes;
+	return true;
+}
+
+#endif /* compressedread_h */
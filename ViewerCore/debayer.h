@@ -24,130 +24,98 @@
 
 #include <CCfits/CCfits>
 #include <valarray>
+#include "threadpool.h"
 
 
 using std::string;
 using namespace CCfits;
 
-template <typename T>
-void super_pixel_RGGB(const std::valarray<T>& buf, std::valarray<T>& newbuf, int width, int height, int factor);
-
-template <typename T>
-void super_pixel_BGGR(const std::valarray<T>& buf, std::valarray<T>& newbuf, int width, int height, int factor);
+// CFA layout known at compile time: row and column of the red photosite in the 2x2 cell,
+// blue sits on the opposite corner and the two greens on the other diagonal.
+// A new layout is one more typedef and one more case in with_cfa_layout.
+template <int RedRow, int RedCol>
+struct CfaLayout {
+    static constexpr int red_row = RedRow;
+    static constexpr int red_col = RedCol;
+    static constexpr int blue_row = 1 - RedRow;
+    static constexpr int blue_col = 1 - RedCol;
+
+    // colour of photosite (row, col) of the cell, 0 red, 1 green, 2 blue
+    static constexpr int color(int row, int col) {
+        return row == RedRow && col == RedCol ? 0 : row != RedRow && col != RedCol ? 2 : 1;
+    }
 
-template <typename T>
-void super_pixel_GBRG(const std::valarray<T>& buf, std::valarray<T>& newbuf, int width, int height, int factor);
+    // column of the green photosite in a row of the cell
+    static constexpr int green_col(int row) {
+        return row == RedRow ? 1 - RedCol : RedCol;
+    }
+};
 
-template <typename T>
-void super_pixel_GRBG(const std::valarray<T>& buf, std::valarray<T>& newbuf, int width, int height, int factor);
+typedef CfaLayout<0, 0> CfaRGGB;
+typedef CfaLayout<0, 1> CfaGRBG;
+typedef CfaLayout<1, 0> CfaGBRG;
+typedef CfaLayout<1, 1> CfaBGGR;
 
 
-template <typename T>
-void super_pixel(const std::valarray<T>& buf, std::valarray<T>& newbuf, int width, int height, string pattern, int factor) {
+// Calls f with the layout of pattern, e.g. f(CfaRGGB()), so the kernel is picked once
+// per image instead of branching inside the loops
+template <typename F>
+void with_cfa_layout(const string& pattern, F&& f) {
     if (pattern == "RGGB") {
-        super_pixel_RGGB(buf, newbuf, width, height, factor);
+        f(CfaRGGB());
     }
-    else if (pattern == "BGGR") {
-        super_pixel_BGGR(buf, newbuf, width, height, factor);
+    else if (pattern == "GRBG") {
+        f(CfaGRBG());
     }
     else if (pattern == "GBRG") {
-        super_pixel_GRBG(buf, newbuf, width, height, factor);
+        f(CfaGBRG());
     }
-    else if (pattern == "GRBG") {
-        super_pixel_GRBG(buf, newbuf, width, height, factor);
+    else if (pattern == "BGGR") {
+        f(CfaBGGR());
     }
     else {
         throw 0;
     }
 }
 
-// NOTE: Using line/column skipping for downscaling
-// pixing binning is too slow to have any performance gain
-template <typename T>
-void super_pixel_RGGB(const std::valarray<T>& buf, std::valarray<T>& newbuf, int width, int height, int factor) {
-    int outRowLength = width / (2 * factor);
-    int outPlaneSize = outRowLength * (height / (2 * factor));
-    for (int row = 0, iout = 0; row + 1 < height; row += 2 * factor, iout++) {
-        for (int col = 0, jout = 0; col + 1 < width; col += 2 * factor, jout++) {
-            int idx = iout * outRowLength + jout;
-            int cur = row * width + col;
-            int right = cur + 1;
-            int down = cur + width;
-            int down_right = down + 1;
-
-            newbuf[idx] = buf[cur];
-            float tmp = buf[right] / 2 + buf[down] / 2;
-            newbuf[idx + outPlaneSize] = (T)tmp;
-            newbuf[idx + outPlaneSize * 2] = buf[down_right];
-        }
-    }
-}
-
 
-template <typename T>
-void super_pixel_BGGR(const std::valarray<T>& buf, std::valarray<T>& newbuf, int width, int height, int factor) {
-    int outRowLength = width / (2 * factor);
-    int outPlaneSize = outRowLength * (height / (2 * factor));
-    for (int row = 0, iout = 0; row + 1 < height; row += 2 * factor, iout++) {
-        for (int col = 0, jout = 0; col + 1 < width; col += 2 * factor, jout++) {
-            int idx = iout * outRowLength + jout;
-            int cur = row * width + col;
-            int right = cur + 1;
-            int down = cur + width;
-            int down_right = down + 1;
-
-            newbuf[idx] = buf[down_right];
-            float tmp = buf[right] / 2 + buf[down] / 2;
-            newbuf[idx + outPlaneSize] = (T)tmp;
-            newbuf[idx + outPlaneSize * 2] = buf[cur];
-        }
-    }
-}
-
-
-template <typename T>
-void super_pixel_GBRG(const std::valarray<T>& buf, std::valarray<T>& newbuf, int width, int height, int factor) {
-    int outRowLength = width / (2 * factor);
-    int outPlaneSize = outRowLength * (height / (2 * factor));
-    for (int row = 0, iout = 0; row + 1 < height; row += 2 * factor, iout++) {
-        for (int col = 0, jout = 0; col + 1 < width; col += 2 * factor, jout++) {
-            int idx = iout * outRowLength + jout;
-            int cur = row * width + col;
-            int right = cur + 1;
-            int down = cur + width;
-            int down_right = down + 1;
-
-            newbuf[idx] = buf[down];
-            float tmp = buf[cur] / 2 + buf[down_right] / 2;
+// NOTE: Using line/column skipping for downscaling, the mapped reader bins the
+// CFA cells while reading instead, see binning.h
+// Output rows are independent and spread over the thread pool, indices are 64-bit since
+// a plane of a survey mosaic can hold more than 2^31 samples
+template <typename Cfa, typename T>
+void super_pixel(const std::valarray<T>& buf, std::valarray<T>& newbuf, int width, int height, int factor) {
+    const size_t outRowLength = width / (2 * factor);
+    const size_t outPlaneSize = outRowLength * (height / (2 * factor));
+    // photosites of the cell relative to its top-left one
+    const size_t red = Cfa::red_row * static_cast<size_t>(width) + Cfa::red_col;
+    const size_t blue = Cfa::blue_row * static_cast<size_t>(width) + Cfa::blue_col;
+    const size_t green1 = Cfa::red_row * static_cast<size_t>(width) + Cfa::blue_col;
+    const size_t green2 = Cfa::blue_row * static_cast<size_t>(width) + Cfa::red_col;
+    parallel_for(0, height / (2 * factor), [&](int iout) {
+        const size_t row = static_cast<size_t>(iout) * 2 * factor;
+        for (size_t jout = 0, col = 0; jout < outRowLength; jout++, col += 2 * factor) {
+            size_t idx = iout * outRowLength + jout;
+            size_t cur = row * width + col;
+
+            newbuf[idx] = buf[cur + red];
+            float tmp = buf[cur + green1] / 2 + buf[cur + green2] / 2;
             newbuf[idx + outPlaneSize] = (T)tmp;
-            newbuf[idx + outPlaneSize * 2] = buf[right];
+            newbuf[idx + outPlaneSize * 2] = buf[cur + blue];
         }
-    }
+    });
 }
 
 
 template <typename T>
-void super_pixel_GRBG(const std::valarray<T>& buf, std::valarray<T>& newbuf, int width, int height, int factor) {
-    int outRowLength = width / (2 * factor);
-    int outPlaneSize = outRowLength * (height / (2 * factor));
-    for (int row = 0, iout = 0; row + 1 < height; row += 2 * factor, iout++) {
-        for (int col = 0, jout = 0; col + 1 < width; col += 2 * factor, jout++) {
-            int idx = iout * outRowLength + jout;
-            int cur = row * width + col;
-            int right = cur + 1;
-            int down = cur + width;
-            int down_right = down + 1;
-
-            newbuf[idx] = buf[right];
-            float tmp = buf[cur] / 2 + buf[down_right] / 2;
-            newbuf[idx + outPlaneSize] = (T)tmp;
-            newbuf[idx + outPlaneSize * 2] = buf[down];
-        }
-    }
+void super_pixel(const std::valarray<T>& buf, std::valarray<T>& newbuf, int width, int height, string pattern, int factor) {
+    with_cfa_layout(pattern, [&](auto cfa) {
+        super_pixel<decltype(cfa)>(buf, newbuf, width, height, factor);
+    });
 }
 
 
-std::string flipBayerPatternVertically(const std::string& pattern) {
+inline std::string flipBayerPatternVertically(const std::string& pattern) {
     if (pattern.length() != 4) {
         std::cerr << "Invalid Bayer pattern length. Pattern must be 4 characters long." << std::endl;
         return "";
@@ -160,4 +128,23 @@ std::string flipBayerPatternVertically(const std::string& pattern) {
     return flippedPattern;
 }
 
+
+// Pattern seen from photosite (xOffset, yOffset) of the mosaic, for subframes whose first
+// pixel isn't the first pixel of the cell BAYERPAT describes (XBAYROFF/YBAYROFF, BAYOFFX/BAYOFFY)
+inline std::string shiftBayerPattern(const std::string& pattern, int xOffset, int yOffset) {
+    std::string shifted = pattern;
+    if (shifted.length() != 4) {
+        return shifted;
+    }
+    if (xOffset & 1) {
+        std::swap(shifted[0], shifted[1]);
+        std::swap(shifted[2], shifted[3]);
+    }
+    if (yOffset & 1) {
+        std::swap(shifted[0], shifted[2]);
+        std::swap(shifted[1], shifted[3]);
+    }
+    return shifted;
+}
+
 #endif /* debayer_h */
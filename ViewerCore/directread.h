@@ -0,0 +1,176 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+// Direct reader for uncompressed primary images: the file is memory mapped and the
+// big-endian samples are converted into the pipeline buffer in a single pass,
+// bypassing the cfitsio buffer copies.
+
+#ifndef directread_h
+#define directread_h
+
+#include <valarray>
+#include <cstdint>
+#include <cstdlib>
+#include "FitsImage.h"
+#include "FitsHeader.h"
+#include "MappedFile.h"
+#include "bigendian.h"
+#include "threadpool.h"
+
+
+// Converts n samples, srcStep/dstStep being the distance in samples between two consecutive reads/writes
+template <int BITPIX, typename T>
+void convertSamples(const unsigned char *src, size_t srcStep, T *dst, size_t dstStep, size_t n, double bscale, double bzero) {
+	constexpr int size = FitsSample<BITPIX>::size;
+
+	if (srcStep == 1 && dstStep == 1) {
+		BigEndianConverter<BITPIX, T>::convert(src, dst, n, bscale, bzero);
+		return;
+	}
+
+	// 16-bit unsigned camera data stored as signed + BZERO=32768: flipping the sign bit is enough
+	if (BITPIX == 16 && std::is_same<T, unsigned short>::value && bscale == 1 && bzero == 32768) {
+		for (size_t i = 0; i < n; i++) {
+			const unsigned char *p = src + i * srcStep * size;
+			dst[i * dstStep] = static_cast<T>((p[0] << 8 | p[1]) ^ 0x8000);
+		}
+		return;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		double v = FitsSample<BITPIX>::load(src + i * srcStep * size);
+		dst[i * dstStep] = toPipelineValue<T>(v * bscale + bzero);
+	}
+}
+
+
+// One decimated row from one source row, readDim.nx samples
+template <int BITPIX, typename T>
+void convertRow(const unsigned char *src, T *dst, const ImageDim& readDim, bool isBayer, int factor, double bscale, double bzero) {
+	constexpr int size = FitsSample<BITPIX>::size;
+	if (factor <= 1) {
+		convertSamples<BITPIX>(src, 1, dst, 1, readDim.nx, bscale, bzero);
+	}
+	else if (!isBayer) {
+		convertSamples<BITPIX>(src, factor, dst, 1, readDim.nx, bscale, bzero);
+	}
+	else {
+		// keep both columns of each CFA cell
+		convertSamples<BITPIX>(src, 2 * factor, dst, 2, (readDim.nx + 1) / 2, bscale, bzero);
+		convertSamples<BITPIX>(src + size, 2 * factor, dst + 1, 2, readDim.nx / 2, bscale, bzero);
+	}
+}
+
+
+// Source row behind row `row` of the decimated image, see readImagePix for the decimation rules
+inline uint64_t sourceRow(int row, bool isBayer, int factor) {
+	return isBayer ? static_cast<uint64_t>(row / 2) * 2 * factor + row % 2 : static_cast<uint64_t>(row) * factor;
+}
+
+
+// Rows [row0, row1) of one channel of the decimated image into dst, src being the first
+// byte of source row sourceRow(row0) of that channel
+template <int BITPIX, typename T>
+void readMappedRows(const unsigned char *src, const FitsHeaderInfo& info, const ImageDim& readDim,
+	bool isBayer, int factor, int row0, int row1, T *dst) {
+	constexpr int size = FitsSample<BITPIX>::size;
+	const size_t rowBytes = static_cast<size_t>(info.naxes[0]) * size;
+	const uint64_t firstRow = sourceRow(row0, isBayer, factor);
+
+	// rows are independent, spreading them over the pool also overlaps the page faults
+	parallel_for(0, row1 - row0, [&](int r) {
+		const size_t srcRow = static_cast<size_t>(sourceRow(row0 + r, isBayer, factor) - firstRow);
+		convertRow<BITPIX>(src + srcRow * rowBytes, dst + static_cast<size_t>(r) * readDim.nx, readDim, isBayer, factor,
+			info.bscale, info.bzero);
+	});
+}
+
+
+// Same with the BITPIX of the file, which isMappable has checked
+template <typename T>
+void readMappedRows(const unsigned char *src, const FitsHeaderInfo& info, const ImageDim& readDim,
+	bool isBayer, int factor, int row0, int row1, T *dst) {
+	switch (info.bitpix) {
+	case 8:
+		readMappedRows<8>(src, info, readDim, isBayer, factor, row0, row1, dst);
+		break;
+	case 16:
+		readMappedRows<16>(src, info, readDim, isBayer, factor, row0, row1, dst);
+		break;
+	case 32:
+		readMappedRows<32>(src, info, readDim, isBayer, factor, row0, row1, dst);
+		break;
+	case -32:
+		readMappedRows<-32>(src, info, readDim, isBayer, factor, row0, row1, dst);
+		break;
+	case -64:
+		readMappedRows<-64>(src, info, readDim, isBayer, factor, row0, row1, dst);
+		break;
+	}
+}
+
+
+// Plain uncompressed image with a BITPIX the mapped reader converts
+inline bool isMappable(const FitsHeaderInfo& info) {
+	if (info.compressed || info.gzipped || info.naxis < 2 || info.naxis > 3)
+		return false;
+	return info.bitpix == 8 || info.bitpix == 16 || info.bitpix == 32 || info.bitpix == -32 || info.bitpix == -64;
+}
+
+
+inline uint64_t imagePlaneBytes(const FitsHeaderInfo& info) {
+	return static_cast<uint64_t>(info.naxes[0]) * info.naxes[1] * (std::abs(info.bitpix) / 8);
+}
+
+
+// Whether the file holds all the samples its header announces
+inline bool hasImageData(uint64_t fileSize, const FitsHeaderInfo& info) {
+	const uint64_t nbBytes = imagePlaneBytes(info) * (info.naxis == 3 ? info.naxes[2] : 1);
+	return static_cast<uint64_t>(info.dataOffset) + nbBytes <= fileSize;
+}
+
+
+// Returns false if the file isn't a plain uncompressed image with a supported BITPIX,
+// the caller then goes through cfitsio.
+template <typename T>
+bool readImagePixMapped(const string& path, const FitsHeaderInfo& info, const ImageDim& readDim,
+	bool isBayer, int factor, std::valarray<T>& buffer) {
+	if (!isMappable(info))
+		return false;
+	if (static_cast<size_t>(readDim.nx) * readDim.ny * readDim.nc == 0)
+		return false;
+
+	MappedFile file;
+	if (!file.open(path) || !hasImageData(file.size(), info))
+		return false;
+
+	writeToLogFile("Mapped read start");
+	const size_t outPlaneSize = static_cast<size_t>(readDim.nx) * readDim.ny;
+	buffer.resize(outPlaneSize * readDim.nc);
+	for (int c = 0; c < readDim.nc; c++) {
+		const unsigned char *plane = file.data() + info.dataOffset + c * static_cast<size_t>(imagePlaneBytes(info));
+		readMappedRows(plane, info, readDim, isBayer, factor, 0, readDim.ny, &buffer[c * outPlaneSize]);
+	}
+	writeToLogFile("Mapped read finish");
+	return true;
+}
+
+#endif /* directread_h */
@@ -0,0 +1,219 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+
+// Streaming reader for gzip-wrapped images (.fits.gz). cfitsio inflates such a file
+// whole in memory before the first pixel can be used. Here a dedicated thread inflates
+// strips of rows while the pool converts the previous strip and hands it to the
+// downstream stages, so inflating overlaps with compute and only a few strips are
+// alive at once besides the destination of the sink.
+
+#ifndef gzipread_h
+#define gzipread_h
+
+#include <valarray>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <algorithm>
+#include "FitsImage.h"
+#include "FitsHeader.h"
+#include "GzipFile.h"
+#include "directread.h"
+#include "threadpool.h"
+
+
+// Inflated bytes per strip, large enough to amortize the hand-over
+constexpr size_t GzipStripBytes = size_t(4) << 20;
+
+
+struct RawStrip
+{
+	std::vector<unsigned char> bytes;
+	int channel;
+	long rowBegin;   // source rows [rowBegin, rowEnd) of the channel
+	long rowEnd;
+};
+
+
+// Two strips going back and forth between the inflating thread and the consumer
+class RawStripQueue
+{
+public:
+	RawStripQueue() : _strips(2), _finished(false), _aborted(false), _ok(true) {
+		for (RawStrip& strip : _strips) _free.push_back(&strip);
+	}
+
+	// producer side, nullptr once the consumer gave up
+	RawStrip *acquire() {
+		std::unique_lock<std::mutex> lock(_mutex);
+		_changed.wait(lock, [this]() { return _aborted || !_free.empty(); });
+		if (_aborted)
+			return nullptr;
+		RawStrip *strip = _free.front();
+		_free.pop_front();
+		return strip;
+	}
+	void push(RawStrip *strip) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		_ready.push_back(strip);
+		_changed.notify_all();
+	}
+	void finish(bool ok) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		_finished = true;
+		_ok = ok;
+		_changed.notify_all();
+	}
+
+	// consumer side, nullptr once everything was inflated or the stream failed
+	RawStrip *pop() {
+		std::unique_lock<std::mutex> lock(_mutex);
+		_changed.wait(lock, [this]() { return _finished || !_ready.empty(); });
+		if (_ready.empty())
+			return nullptr;
+		RawStrip *strip = _ready.front();
+		_ready.pop_front();
+		return strip;
+	}
+	void release(RawStrip *strip) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		_free.push_back(strip);
+		_changed.notify_all();
+	}
+	void abort() {
+		std::lock_guard<std::mutex> lock(_mutex);
+		_aborted = true;
+		_changed.notify_all();
+	}
+	bool ok() {
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _ok;
+	}
+	size_t capacityBytes() const {
+		return _strips[0].bytes.capacity() + _strips[1].bytes.capacity();
+	}
+
+private:
+	std::vector<RawStrip> _strips;
+	std::deque<RawStrip *> _free;
+	std::deque<RawStrip *> _ready;
+	std::mutex _mutex;
+	std::condition_variable _changed;
+	bool _finished;
+	bool _aborted;
+	bool _ok;
+};
+
+
+// Decimated strips of the image, see readImagePix for the decimation rules. A cell row
+// is one row, or one row of 2x2 CFA cells for decimated Bayer images. For each strip,
+// sink(channel, k0, k1, strip) gets the cell rows [k0, k1) of channel converted to T,
+// readDim.nx samples per row, cells being complete within a strip.
+// Returns the peak bytes of the strip buffers, 0 if the stream is truncated or corrupt.
+template <int BITPIX, typename T, typename Sink>
+size_t readGzipStrips(GzipFile& file, const FitsHeaderInfo& info, const ImageDim& readDim,
+	bool isBayer, int factor, const Sink& sink) {
+	constexpr int size = FitsSample<BITPIX>::size;
+	const long nx = static_cast<long>(info.naxes[0]);
+	const long ny = static_cast<long>(info.naxes[1]);
+	const size_t rowBytes = static_cast<size_t>(nx) * size;
+
+	const long cellHeight = isBayer ? 2 : 1;
+	const long srcStride = cellHeight * std::max(1, factor);
+	const long nbCells = readDim.ny / cellHeight;
+	// whole cells per strip
+	const long stripRows = srcStride * std::max(1L, static_cast<long>(GzipStripBytes / (rowBytes * srcStride)));
+
+	RawStripQueue queue;
+	std::thread inflater([&]() {
+		bool ok = file.skip(static_cast<size_t>(info.dataOffset));
+		for (int c = 0; ok && c < readDim.nc; c++) {
+			for (long s0 = 0; ok && s0 < ny; s0 += stripRows) {
+				RawStrip *strip = queue.acquire();
+				if (!strip)
+					return;
+				strip->channel = c;
+				strip->rowBegin = s0;
+				strip->rowEnd = std::min(ny, s0 + stripRows);
+				strip->bytes.resize((strip->rowEnd - s0) * rowBytes);
+				ok = file.read(strip->bytes.data(), strip->bytes.size());
+				if (ok)
+					queue.push(strip);
+				else
+					queue.release(strip);
+			}
+		}
+		queue.finish(ok);
+	});
+
+	std::valarray<T> converted(static_cast<size_t>(stripRows / srcStride) * cellHeight * readDim.nx);
+	try {
+		while (RawStrip *strip = queue.pop()) {
+			// cells whose first source row is in the strip
+			const long k0 = (strip->rowBegin + srcStride - 1) / srcStride;
+			const long k1 = std::min(nbCells, (strip->rowEnd + srcStride - 1) / srcStride);
+			if (k0 < k1) {
+				parallel_for(0L, (k1 - k0) * cellHeight, [&](long r) {
+					const long srcRow = (k0 + r / cellHeight) * srcStride + r % cellHeight;
+					convertRow<BITPIX>(strip->bytes.data() + (srcRow - strip->rowBegin) * rowBytes,
+						&converted[static_cast<size_t>(r) * readDim.nx], readDim, isBayer, factor, info.bscale, info.bzero);
+				});
+				sink(strip->channel, k0, k1, converted);
+			}
+			queue.release(strip);
+		}
+	}
+	catch (...) {
+		queue.abort();
+		inflater.join();
+		throw;
+	}
+	inflater.join();
+
+	if (!queue.ok())
+		return 0;
+	return queue.capacityBytes() + converted.size() * sizeof(T);
+}
+
+
+template <typename T, typename Sink>
+size_t readGzipStrips(GzipFile& file, const FitsHeaderInfo& info, const ImageDim& readDim,
+	bool isBayer, int factor, const Sink& sink) {
+	switch (info.bitpix) {
+	case 8:
+		return readGzipStrips<8, T>(file, info, readDim, isBayer, factor, sink);
+	case 16:
+		return readGzipStrips<16, T>(file, info, readDim, isBayer, factor, sink);
+	case 32:
+		return readGzipStrips<32, T>(file, info, readDim, isBayer, factor, sink);
+	case -32:
+		return readGzipStrips<-32, T>(file, info, readDim, isBayer, factor, sink);
+	case -64:
+		return readGzipStrips<-64, T>(file, info, readDim, isBayer, factor, sink);
+	default:
+		return 0;
+	}
+}
+
+#endif /* gzipread_h */
@@ -1,15 +1,14 @@
 ﻿#pragma once
-#include <fstream>
 #include <string>
 #include <locale>
 #include <codecvt>
-#include <ShlObj.h>  // Include for SHGetFolderPath
-#include <chrono>
-
-const string LogFileName = "QuickFITS.log";
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include "trace.h"
 
 template<typename ... Args>
-std::string string_format(const std::string& format, Args ... args)
+inline std::string string_format(const std::string& format, Args ... args)
 {
     int size_s = std::snprintf(nullptr, 0, format.c_str(), args ...) + 1; // Extra space for '\0'
     if (size_s <= 0) { throw std::runtime_error("Error during formatting."); }
@@ -19,64 +18,21 @@ std::string string_format(const std::string& format, Args ... args)
     return std::string(buf.get(), buf.get() + size - 1); // We don't want the '\0' inside
 }
 
-std::string stringDateTime() {
-    auto now = std::chrono::system_clock::now();
-    auto nowAsTimeT = std::chrono::system_clock::to_time_t(now);
-    auto nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()) % 1000;
-
-    // Convert to tm struct
-    std::tm localTime;
-    localtime_s(&localTime, &nowAsTimeT);
-
-    // Format the time string with milliseconds
-    std::stringstream dateTimeString;
-    dateTimeString << std::put_time(&localTime, "%Y-%m-%d %H:%M:%S");
-    dateTimeString << '.' << std::setfill('0') << std::setw(3) << nowMs.count();
-
-    return dateTimeString.str();
-}
-
-void writeToLogFile(const std::string& message) {
-#ifndef ENABLE_LOGGING
-    return;
+// Messages become instant events of the tracer, its flusher thread appends them to the
+// log file so the calling thread never touches the disk
+inline void writeToLogFile(const std::string& message) {
+#ifdef ENABLE_LOGGING
+    Tracer::instance().instant(message.c_str());
 #endif
-    char documentsPath[MAX_PATH];
-    if (SHGetFolderPathA(NULL, CSIDL_MYDOCUMENTS, NULL, SHGFP_TYPE_CURRENT, documentsPath) != S_OK) {
-        std::cerr << "Unable to get Documents folder path";
-        return;
-    }
-    std::string logFilePath = std::string(documentsPath) + string_format("\\%s", LogFileName);
-    std::ofstream logFile(logFilePath, std::ios::app);
-    if (!logFile.is_open()) {
-        std::cerr << "Unable to open file";
-        return;
-    }
-    logFile << "[" << stringDateTime() << "] " << message << std::endl;
-    logFile.close();
 }
 
-void writeToLogFile(const std::wstring& message) {
+inline void writeToLogFile(const std::wstring& message) {
 #ifndef ENABLE_LOGGING
     return;
 #endif
-    wchar_t documentsPath[MAX_PATH];
-    if (SHGetFolderPathW(NULL, CSIDL_MYDOCUMENTS, NULL, SHGFP_TYPE_CURRENT, documentsPath) != S_OK) {
-        std::cerr << "Unable to get Documents folder path";
-        return;
-    }
-    writeToLogFile(documentsPath);
-    std::wstring logFilePath = std::wstring(documentsPath) + L"QuickFITS.log";
-
-    std::locale locale(std::locale(), new std::codecvt_utf8<wchar_t>);
-    std::wofstream logFile(logFilePath, std::ios::app);
-    logFile.imbue(locale);
-
-    if (!logFile.is_open()) {
-        std::cerr << "Unable to open file";
-        return;
-    }
-    logFile << L"wstring: " << message << std::endl;
-    logFile.close();
+    // wide paths aren't portable, the message goes to the same file as UTF-8
+    std::wstring_convert<std::codecvt_utf8<wchar_t>> converter;
+    writeToLogFile("wstring: " + converter.to_bytes(message));
 }
 
 
@@ -0,0 +1,67 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+
+#pragma once
+#include <cstdint>
+#include "trace.h"
+
+
+// Stage timings in nanoseconds and counters of one FitsImage, see FitsImageGetMetrics.
+// Plain C layout, mirrored by the Metrics struct of the plugin.
+// Timings of the pixel stages are reset by every FitsImageGetPixData call.
+typedef struct {
+	int64_t openNs;           // CCfits open of the file
+	int64_t headerNs;         // header block scan and keyword parsing
+	int64_t readNs;           // pixel read and conversion to the pipeline type
+	int64_t debayerNs;
+	int64_t statsNs;          // median and MAD of every channel
+	int64_t stretchNs;        // stretch lookup tables
+	int64_t packNs;           // lookup, interleave and flip into the bitmap
+	int64_t bytesRead;        // header blocks plus the pixel bytes read
+	int64_t pixelsProcessed;  // samples decoded, all channels
+	int64_t threadsUsed;      // pool threads, or cfitsio handles of a compressed read
+	int64_t peakBufferBytes;  // largest total size of the sample buffers alive at once
+} Metrics;
+
+
+// Adds the time spent in its scope to one of the Metrics timings, and records it as a
+// pipeline span when tracing is on
+class StageTimer
+{
+public:
+	StageTimer(int64_t& total, const char *name) : _total(total), _name(name), _start(Tracer::instance().now()) {}
+	~StageTimer() {
+		Tracer& tracer = Tracer::instance();
+		const uint64_t duration = tracer.now() - _start;
+		_total += static_cast<int64_t>(duration);
+		if (tracer.enabled()) {
+			tracer.span(_name, TraceCategory::Pipeline, _start, duration);
+		}
+	}
+	StageTimer(const StageTimer&) = delete;
+	StageTimer& operator=(const StageTimer&) = delete;
+
+private:
+	int64_t& _total;
+	const char *_name;
+	uint64_t _start;
+};
@@ -0,0 +1,174 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+
+// Stretch statistics of Bayer images taken on the raw CFA mosaic, so they don't wait for
+// the debayer. Every colour is a virtual plane of its photosites in raster order, cells
+// wide: red and blue get one row per cell row, green one row per mosaic row. Histograms
+// are exact, the sampled types take every sampleSpacing-th site of each plane, whether
+// the mosaic is whole (computeParamsMosaic) or arrives in strips (addMosaicRows).
+
+#ifndef mosaicstats_h
+#define mosaicstats_h
+
+#include <valarray>
+#include <vector>
+#include <cstdint>
+#include <type_traits>
+#include "Stretch.h"
+#include "debayer.h"
+#include "threadpool.h"
+
+
+// Sites of the red, green and blue planes of a mosaic of cellsX x cellsY whole cells
+inline std::vector<size_t> mosaicPlaneSizes(int cellsX, int cellsY) {
+	const size_t cells = static_cast<size_t>(cellsX) * cellsY;
+	return { cells, 2 * cells, cells };
+}
+
+
+// Exact per colour histograms of the 8 and 16 bit mosaic, one pass over the rows. The
+// 32-bit partial counts of a slice of rows stay below overflow, see accumulateHistogram.
+template <typename Cfa, typename T>
+void computeParamsMosaic(const T *mosaic, int width, int cellsX, int cellsY, StretchParams *params, int inDepth, std::true_type) {
+	const size_t nbBins = size_t(1) << (8 * sizeof(T));
+	const int rows = 2 * cellsY;
+	const int tileRows = static_cast<int>(std::max<size_t>(1, StatsTileSize / width));
+	const int sliceRows = static_cast<int>(std::max<size_t>(2, HistogramSliceSize / width));
+	std::vector<std::vector<uint64_t>> histograms(3, std::vector<uint64_t>(nbBins, 0));
+
+	for (int first = 0; first < rows; first += sliceRows) {
+		const int sliceEnd = std::min(rows, first + sliceRows);
+		const std::vector<uint32_t> partial = parallel_reduce(static_cast<size_t>(sliceEnd - first), static_cast<size_t>(tileRows),
+			std::vector<uint32_t>(3 * nbBins, 0),
+			[&](size_t begin, size_t end, std::vector<uint32_t>& h) {
+				for (size_t r = begin; r < end; r++) {
+					const int y = first + static_cast<int>(r);
+					const T *row = mosaic + static_cast<size_t>(y) * width;
+					const int greenCol = Cfa::green_col(y & 1);
+					uint32_t *green = &h[nbBins];
+					uint32_t *other = &h[Cfa::color(y & 1, 1 - greenCol) * nbBins];
+					for (int x = 0; x < cellsX; x++) {
+						green[row[2 * x + greenCol]]++;
+						other[row[2 * x + 1 - greenCol]]++;
+					}
+				}
+			}, addHistogram<uint32_t>);
+		for (int ch = 0; ch < 3; ch++) {
+			for (size_t b = 0; b < nbBins; b++) {
+				histograms[ch][b] += partial[ch * nbBins + b];
+			}
+		}
+	}
+
+	const std::vector<size_t> counts = mosaicPlaneSizes(cellsX, cellsY);
+	for (int ch = 0; ch < 3; ch++) {
+		setParamsFromHistogram(histograms[ch], counts[ch], &channelParams(*params, ch), integerInputRange(inDepth));
+	}
+}
+
+
+// Sampled statistics of the other types, the same samples as StreamingSamples keeps
+template <typename Cfa, typename T>
+void computeParamsMosaic(const T *mosaic, int width, int cellsX, int cellsY, StretchParams *params, int inDepth, std::false_type) {
+	const std::vector<size_t> planeSizes = mosaicPlaneSizes(cellsX, cellsY);
+	int inputRange = 1;
+	for (int ch = 0; ch < 3; ch++) {
+		const size_t sampleBy = sampleSpacing(planeSizes[ch]);
+		std::vector<T> samples(planeSizes[ch] / sampleBy);
+		if (samples.empty())
+			return;
+
+		// site k of the plane, in its row k / cellsX
+		auto site = [&](size_t k) {
+			const size_t planeRow = k / cellsX;
+			const int y = ch == 1 ? static_cast<int>(planeRow) : static_cast<int>(2 * planeRow) + (ch == 0 ? Cfa::red_row : Cfa::blue_row);
+			const int x = 2 * static_cast<int>(k % cellsX) + (ch == 1 ? Cfa::green_col(y & 1) : ch == 0 ? Cfa::red_col : Cfa::blue_col);
+			return mosaic[static_cast<size_t>(y) * width + x];
+		};
+		const SampleRange<T> range = parallel_reduce(samples.size(), StatsTileSize, SampleRange<T>(),
+			[&](size_t begin, size_t end, SampleRange<T>& local) {
+				for (size_t i = begin; i < end; i++) {
+					const T v = site(i * sampleBy);
+					samples[i] = v;
+					local.add(v);
+				}
+			},
+			[](SampleRange<T>& into, const SampleRange<T>& from) {
+				into.merge(from);
+			});
+		const bool anyFinite = keepFiniteSamples(samples, range);
+
+		// like getRange, the range of floating point data is taken from the finite red samples
+		if (ch == 0)
+			inputRange = inDepth > 0 ? integerInputRange(inDepth) : floatInputRange(samples.data(), samples.size());
+		if (anyFinite)
+			setParamsFromSamples(samples, range.lo, range.hi, &channelParams(*params, ch), inputRange);
+	}
+}
+
+
+// Median and MAD of every colour of a width x height mosaic, whole cells only
+template <typename T>
+void computeParamsMosaic(const std::valarray<T>& mosaic, int width, int height, const string& pattern, int inDepth, StretchParams *params) {
+	typedef std::integral_constant<bool, std::is_integral<T>::value && sizeof(T) <= 2> useHistogram;
+	const int cellsX = width / 2, cellsY = height / 2;
+	if (cellsX == 0 || cellsY == 0)
+		return;
+	with_cfa_layout(pattern, [&](auto cfa) {
+		computeParamsMosaic<decltype(cfa)>(&mosaic[0], width, cellsX, cellsY, params, inDepth, useHistogram());
+	});
+}
+
+
+// Adds mosaic rows [row0, row1) to the statistics of a mosaic arriving in row order:
+// stats.add(ch, data, n) gets each colour plane of the rows in turn. rows points to row0,
+// rows being rowStride samples apart; scratch holds the sites of one colour.
+template <typename T, typename Stats>
+void addMosaicRows(const T *rows, size_t rowStride, int row0, int row1, int cellsX, const string& pattern, Stats& stats, std::vector<T>& scratch) {
+	if (row1 <= row0 || cellsX == 0)
+		return;
+	with_cfa_layout(pattern, [&](auto cfa) {
+		typedef decltype(cfa) Cfa;
+		// green has a row in every mosaic row, red and blue in every other one
+		for (int ch = 0; ch < 3; ch++) {
+			const int parity = ch == 0 ? Cfa::red_row : Cfa::blue_row;
+			const int first = ch == 1 || (row0 & 1) == parity ? row0 : row0 + 1;
+			const int step = ch == 1 ? 1 : 2;
+			const int nbRows = first < row1 ? (row1 - first + step - 1) / step : 0;
+			if (nbRows == 0)
+				continue;
+			scratch.resize(static_cast<size_t>(nbRows) * cellsX);
+			parallel_for(0, nbRows, [&](int r) {
+				const int y = first + r * step;
+				const T *row = rows + static_cast<size_t>(y - row0) * rowStride;
+				const int col = ch == 1 ? Cfa::green_col(y & 1) : ch == 0 ? Cfa::red_col : Cfa::blue_col;
+				T *dst = &scratch[static_cast<size_t>(r) * cellsX];
+				for (int x = 0; x < cellsX; x++) {
+					dst[x] = row[2 * x + col];
+				}
+			});
+			stats.add(ch, scratch.data(), scratch.size());
+		}
+	});
+}
+
+#endif /* mosaicstats_h */
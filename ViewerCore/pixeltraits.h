@@ -0,0 +1,70 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+// Compile-time description of a decode pipeline: the working type for a BITPIX and
+// the channel layout. getImagePix picks one instantiation per image, so the kernels
+// never branch on the pixel type or the channel count.
+
+#ifndef pixeltraits_h
+#define pixeltraits_h
+
+#include <type_traits>
+#include <fitsio.h>
+
+
+enum class PixelLayout { Mono, Bayer, Color };
+
+template <PixelLayout L>
+using LayoutTag = std::integral_constant<PixelLayout, L>;
+
+
+// Working type per BITPIX, the narrowest type that holds the data without loss.
+// 16 and 32 bit integers are read as unsigned, the usual BZERO convention of cameras.
+// getImagePix only keeps unsigned int for 32 bit data with BZERO 2^31, signed or scaled
+// 32 bit data goes through double instead.
+template <int BITPIX> struct BitpixTraits;
+template <> struct BitpixTraits<8> { typedef unsigned char type; };
+template <> struct BitpixTraits<16> { typedef unsigned short type; };
+template <> struct BitpixTraits<32> { typedef unsigned int type; };
+template <> struct BitpixTraits<-32> { typedef float type; };
+template <> struct BitpixTraits<-64> { typedef double type; };
+
+
+// cfitsio datatype code of a working type
+template <typename T> struct FitsDataType;
+template <> struct FitsDataType<unsigned char> { static constexpr int value = TBYTE; };
+template <> struct FitsDataType<unsigned short> { static constexpr int value = TUSHORT; };
+template <> struct FitsDataType<unsigned int> { static constexpr int value = TUINT; };
+template <> struct FitsDataType<float> { static constexpr int value = TFLOAT; };
+template <> struct FitsDataType<double> { static constexpr int value = TDOUBLE; };
+
+
+template <int BITPIX, PixelLayout LAYOUT, typename T = typename BitpixTraits<BITPIX>::type>
+struct PipelineTraits
+{
+	typedef T type;
+	static constexpr int bitpix = BITPIX;
+	static constexpr PixelLayout layout = LAYOUT;
+	static constexpr int inChannels = LAYOUT == PixelLayout::Color ? 3 : 1;
+	static constexpr int outChannels = LAYOUT == PixelLayout::Mono ? 1 : 3;
+};
+
+#endif /* pixeltraits_h */
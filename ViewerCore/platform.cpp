@@ -0,0 +1,60 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+
+#include "pch.h"
+#include "platform.h"
+#include <cstdlib>
+
+#ifdef _WIN32
+#include <ShlObj.h>
+#endif
+
+
+#ifdef _WIN32
+std::string getDocumentsFolder()
+{
+	char documentsPath[MAX_PATH];
+	if (SHGetFolderPathA(NULL, CSIDL_MYDOCUMENTS, NULL, SHGFP_TYPE_CURRENT, documentsPath) != S_OK)
+		return "";
+	return documentsPath;
+}
+
+
+bool toLocalTime(std::time_t time, std::tm *out)
+{
+	return localtime_s(out, &time) == 0;
+}
+
+#else
+
+std::string getDocumentsFolder()
+{
+	const char *home = std::getenv("HOME");
+	return home ? home : "";
+}
+
+
+bool toLocalTime(std::time_t time, std::tm *out)
+{
+	return localtime_r(&time, out) != nullptr;
+}
+#endif
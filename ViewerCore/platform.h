@@ -0,0 +1,47 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+
+// Everything that differs between the Windows DLL and the POSIX shared library builds
+
+#pragma once
+#include <ctime>
+#include <string>
+
+#ifdef _WIN32
+#define VIEWER_EXPORT __declspec(dllexport)
+#else
+#define VIEWER_EXPORT __attribute__((visibility("default")))
+#endif
+
+#ifdef _WIN32
+constexpr char PathSeparator = '\\';
+#else
+constexpr char PathSeparator = '/';
+#endif
+
+
+// Folder the log file is written to: Documents on Windows, $HOME elsewhere.
+// Empty if it can't be found.
+std::string getDocumentsFolder();
+
+// Thread-safe localtime, false on failure
+bool toLocalTime(std::time_t time, std::tm *out);
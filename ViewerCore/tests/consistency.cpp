@@ -0,0 +1,500 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+// Consistency checks of the decode paths on files written by the benchmark generator,
+// registered with ctest, one case per run:
+//
+//   viewer_consistency converters|statistics|super_pixel|paths CORPUS_DIR
+//
+// converters   every BigEndianConverter against convertBigEndianScalar
+// statistics   histogram median and MAD of 8 and 16 bit channels against nth_element, and
+//              the sampled ones of a float frame and mosaic with NaN and infinite pixels
+// super_pixel  the compile-time CFA layouts against a kernel reading the pattern string
+// paths        in-memory, strip and gzip decodes of the same file give the same bitmap
+//
+// Mismatches are printed, the exit code is 1 if any check failed.
+
+#include "FitsImage.h"
+#include "FitsHeader.h"
+#include "Stretch.h"
+#include "debayer.h"
+#include "mosaicstats.h"
+#include "directread.h"
+#include "bigendian.h"
+#include "pixeltraits.h"
+#include "fitsgen.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const std::string& what) {
+	if (!ok) {
+		std::printf("FAIL %s\n", what.c_str());
+		failures++;
+	}
+}
+
+
+std::string writeCorpusFile(const std::string& dir, const SyntheticFitsSpec& spec) {
+	const std::string path = dir + "/" + syntheticFitsName(spec);
+	if (!writeSyntheticFits(path, spec)) {
+		check(false, "cannot write " + path);
+		return "";
+	}
+	return path;
+}
+
+
+SyntheticFitsSpec makeSpec(int bitpix, int width, int height, const std::string& bayerPattern = "", bool bottomUp = false) {
+	SyntheticFitsSpec spec;
+	spec.bitpix = bitpix;
+	spec.width = width;
+	spec.height = height;
+	spec.bayerPattern = bayerPattern;
+	spec.bottomUp = bottomUp;
+	return spec;
+}
+
+
+bool readSamples(const std::string& path, FitsHeaderInfo *info, std::vector<unsigned char> *bytes) {
+	if (!probeFitsHeader(path, info))
+		return false;
+	const size_t size = static_cast<size_t>(info->naxes[0] * info->naxes[1] * std::max(1LL, info->naxes[2])) * (std::abs(info->bitpix) / 8);
+	std::ifstream in(path, std::ios::binary);
+	in.seekg(info->dataOffset);
+	bytes->resize(size);
+	in.read(reinterpret_cast<char *>(bytes->data()), size);
+	return in.good();
+}
+
+
+// Mapped read of a whole image at full resolution
+template <typename T>
+bool readImage(const std::string& path, FitsHeaderInfo *info, std::valarray<T> *values) {
+	if (!probeFitsHeader(path, info))
+		return false;
+	const ImageDim dim{ static_cast<int>(info->naxes[0]), static_cast<int>(info->naxes[1]), info->naxis == 3 ? 3 : 1, info->bitpix };
+	return readImagePixMapped(path, *info, dim, false, 1, *values);
+}
+
+
+// --- converters ----------------------------------------------------------------------
+
+template <typename T>
+bool sameValue(T a, T b, std::true_type) {
+	return a == b;
+}
+
+// the vector kernels scale in float, the scalar code in double before narrowing
+template <typename T>
+bool sameValue(T a, T b, std::false_type) {
+	return std::abs(a - b) <= 1e-6 * std::max<T>(1, std::abs(b));
+}
+
+
+template <int BITPIX, typename T>
+void checkConverter(const std::string& name, const std::vector<unsigned char>& bytes, double bscale, double bzero) {
+	const size_t n = bytes.size() / FitsSample<BITPIX>::size;
+	// the whole image, then a length that leaves a tail for the scalar loop
+	for (size_t count : { n, n - 7 }) {
+		std::vector<T> simd(count), scalar(count);
+		BigEndianConverter<BITPIX, T>::convert(bytes.data(), simd.data(), count, bscale, bzero);
+		convertBigEndianScalar<BITPIX>(bytes.data(), scalar.data(), count, bscale, bzero);
+		size_t mismatches = 0;
+		for (size_t i = 0; i < count; i++) {
+			mismatches += !sameValue(simd[i], scalar[i], std::is_integral<T>());
+		}
+		check(mismatches == 0, name + " BITPIX " + std::to_string(BITPIX) + " to " + std::to_string(sizeof(T)) + " bytes, bscale "
+			+ std::to_string(bscale) + " bzero " + std::to_string(bzero) + ": " + std::to_string(mismatches) + " mismatches");
+	}
+}
+
+
+template <int BITPIX, typename T>
+void checkConverterScalings(const std::string& name, const std::vector<unsigned char>& bytes, const FitsHeaderInfo& info) {
+	checkConverter<BITPIX, T>(name, bytes, info.bscale, info.bzero);
+	checkConverter<BITPIX, T>(name, bytes, 1, 0);
+	checkConverter<BITPIX, T>(name, bytes, 0.5, 100);
+}
+
+
+void checkConverters(const std::string& dir) {
+	for (int bitpix : { 8, 16, 32, -32, -64 }) {
+		const std::string path = writeCorpusFile(dir, makeSpec(bitpix, 1031, 769));
+		FitsHeaderInfo info;
+		std::vector<unsigned char> bytes;
+		if (path.empty() || !readSamples(path, &info, &bytes)) {
+			check(false, "cannot read " + path);
+			continue;
+		}
+		const std::string name = syntheticFitsName(makeSpec(bitpix, 1031, 769));
+		switch (bitpix) {
+		case 8:
+			checkConverterScalings<8, unsigned char>(name, bytes, info);
+			break;
+		case 16:
+			checkConverterScalings<16, unsigned short>(name, bytes, info);
+			break;
+		case 32:
+			checkConverterScalings<32, unsigned int>(name, bytes, info);
+			break;
+		case -32:
+			checkConverterScalings<-32, float>(name, bytes, info);
+			break;
+		default:
+			checkConverterScalings<-64, double>(name, bytes, info);
+			break;
+		}
+	}
+}
+
+
+// --- statistics ----------------------------------------------------------------------
+
+template <typename T>
+void checkHistogramStatistics(const std::string& path, int inputRange) {
+	FitsHeaderInfo info;
+	std::valarray<T> values;
+	if (!readImage(path, &info, &values)) {
+		check(false, "cannot read " + path);
+		return;
+	}
+	const int width = static_cast<int>(info.naxes[0]), height = static_cast<int>(info.naxes[1]);
+
+	StretchParams1Channel histogram;
+	computeParamsOneChannelHistogram(values, 0, &histogram, inputRange, height, width);
+
+	std::vector<T> sorted(std::begin(values), std::end(values));
+	const size_t middle = sorted.size() / 2;
+	std::nth_element(sorted.begin(), sorted.begin() + middle, sorted.end());
+	const T median = sorted[middle];
+	for (auto& v : sorted) v = v > median ? v - median : median - v;
+	std::nth_element(sorted.begin(), sorted.begin() + middle, sorted.end());
+	StretchParams1Channel reference;
+	setParamsFromMedianAndMAD(&reference, median, sorted[middle], inputRange);
+
+	check(histogram.shadows == reference.shadows && histogram.highlights == reference.highlights
+		&& histogram.midtones == reference.midtones, path + ": histogram statistics differ from nth_element");
+}
+
+
+// Sampled statistics of a float sky frame whose first pixel, first row and a sprinkle of
+// others are NaN or infinite: the whole-frame and the streamed samples must both match
+// nth_element over the finite samples only
+void checkNonFiniteStatistics() {
+	const int width = 1000, height = 1000;
+	const size_t nbPix = static_cast<size_t>(width) * height;
+	std::valarray<float> values(nbPix);
+	uint32_t state = 12345;
+	for (size_t i = 0; i < nbPix; i++) {
+		state = state * 1664525u + 1013904223u;
+		values[i] = 1000.0f + static_cast<float>(state >> 24) * 0.5f;
+	}
+	for (int x = 0; x < width; x++) {
+		values[x] = std::numeric_limits<float>::quiet_NaN();
+	}
+	for (size_t i = 7; i < nbPix; i += 1013) {
+		values[i] = i % 2 ? std::numeric_limits<float>::infinity() : -std::numeric_limits<float>::infinity();
+	}
+
+	const size_t sampleBy = sampleSpacing(nbPix);
+	std::vector<float> finite;
+	for (size_t i = 0; i < nbPix / sampleBy; i++) {
+		if (std::isfinite(values[i * sampleBy])) finite.push_back(values[i * sampleBy]);
+	}
+	const int inputRange = floatInputRange(finite.data(), finite.size());
+	const size_t middle = finite.size() / 2;
+	std::nth_element(finite.begin(), finite.begin() + middle, finite.end());
+	const float median = finite[middle];
+	for (auto& v : finite) v = std::fabs(v - median);
+	std::nth_element(finite.begin(), finite.begin() + middle, finite.end());
+	StretchParams1Channel reference;
+	setParamsFromMedianAndMAD(&reference, median, finite[middle], inputRange);
+
+	StretchParams1Channel sampled;
+	computeParamsOneChannelSampled(values, 0, &sampled, floatInputRange(&values[0], nbPix), height, width);
+	StretchParams streamed;
+	StreamingSamples<float> samples(std::vector<size_t>(1, nbPix), 0);
+	for (int y = 0; y < height; y += 97) {
+		samples.add(0, &values[static_cast<size_t>(y) * width], static_cast<size_t>(std::min(97, height - y)) * width);
+	}
+	samples.computeParams(&streamed);
+
+	const StretchParams1Channel *results[] = { &sampled, &streamed.grey_red };
+	const char *names[] = { "whole frame", "streamed" };
+	for (int k = 0; k < 2; k++) {
+		const StretchParams1Channel& p = *results[k];
+		check(std::isfinite(p.midtones) && p.max_input == reference.max_input && p.shadows == reference.shadows
+			&& p.highlights == reference.highlights && p.midtones == reference.midtones,
+			std::string("non finite float frame, ") + names[k] + ": sampled statistics differ from nth_element");
+	}
+
+	// the same frame as an RGGB mosaic, whole and streamed in strips of mosaic rows
+	StretchParams mosaic, mosaicStreamed;
+	computeParamsMosaic(values, width, height, "RGGB", 0, &mosaic);
+	StreamingSamples<float> sites(mosaicPlaneSizes(width / 2, height / 2), 0);
+	std::vector<float> scratch;
+	for (int y = 0; y < height; y += 98) {
+		addMosaicRows(&values[static_cast<size_t>(y) * width], static_cast<size_t>(width), y, std::min(y + 98, height), width / 2, "RGGB", sites, scratch);
+	}
+	sites.computeParams(&mosaicStreamed);
+	for (int ch = 0; ch < 3; ch++) {
+		const StretchParams1Channel& a = channelParams(mosaic, ch);
+		const StretchParams1Channel& b = channelParams(mosaicStreamed, ch);
+		check(std::isfinite(a.midtones) && a.max_input == b.max_input && a.shadows == b.shadows
+			&& a.highlights == b.highlights && a.midtones == b.midtones,
+			"non finite float mosaic, channel " + std::to_string(ch) + ": whole and streamed statistics differ");
+	}
+}
+
+
+void checkStatistics(const std::string& dir) {
+	checkHistogramStatistics<unsigned char>(writeCorpusFile(dir, makeSpec(8, 1031, 769)), 256);
+	checkHistogramStatistics<unsigned short>(writeCorpusFile(dir, makeSpec(16, 1031, 769)), 65536);
+	checkHistogramStatistics<unsigned short>(writeCorpusFile(dir, makeSpec(16, 1030, 770, "RGGB")), 65536);
+	checkNonFiniteStatistics();
+}
+
+
+// --- super pixel ---------------------------------------------------------------------
+
+// One output pixel per factor x factor CFA cells, colours looked up in the pattern string,
+// greens averaged like the kernel does
+template <typename T>
+std::valarray<T> referenceSuperPixel(const std::valarray<T>& mosaic, int width, int height, const std::string& pattern, int factor) {
+	const int outWidth = width / (2 * factor), outHeight = height / (2 * factor);
+	const size_t planeSize = static_cast<size_t>(outWidth) * outHeight;
+	std::valarray<T> out(3 * planeSize);
+	for (int y = 0; y < outHeight; y++) {
+		for (int x = 0; x < outWidth; x++) {
+			T red = 0, blue = 0, greens[2] = { 0, 0 };
+			int nbGreens = 0;
+			for (int dy = 0; dy < 2; dy++) {
+				for (int dx = 0; dx < 2; dx++) {
+					const T v = mosaic[static_cast<size_t>(2 * factor * y + dy) * width + 2 * factor * x + dx];
+					switch (pattern[2 * dy + dx]) {
+					case 'R': red = v; break;
+					case 'B': blue = v; break;
+					default: greens[nbGreens++] = v; break;
+					}
+				}
+			}
+			const size_t i = static_cast<size_t>(y) * outWidth + x;
+			out[i] = red;
+			out[planeSize + i] = static_cast<T>(static_cast<float>(greens[0] / 2 + greens[1] / 2));
+			out[2 * planeSize + i] = blue;
+		}
+	}
+	return out;
+}
+
+
+template <typename T>
+void checkSuperPixel(const std::string& path) {
+	FitsHeaderInfo info;
+	std::valarray<T> mosaic;
+	if (!readImage(path, &info, &mosaic)) {
+		check(false, "cannot read " + path);
+		return;
+	}
+	const int width = static_cast<int>(info.naxes[0]), height = static_cast<int>(info.naxes[1]);
+	for (int factor : { 1, 2, 3 }) {
+		const std::valarray<T> reference = referenceSuperPixel(mosaic, width, height, info.bayerPattern, factor);
+		std::valarray<T> out(reference.size());
+		super_pixel(mosaic, out, width, height, info.bayerPattern, factor);
+		size_t mismatches = 0;
+		for (size_t i = 0; i < out.size(); i++) {
+			mismatches += out[i] != reference[i];
+		}
+		check(mismatches == 0, path + " factor " + std::to_string(factor) + ": " + std::to_string(mismatches) + " super pixel mismatches");
+	}
+}
+
+
+void checkSuperPixels(const std::string& dir) {
+	for (const char *pattern : { "RGGB", "GRBG", "GBRG", "BGGR" }) {
+		checkSuperPixel<unsigned short>(writeCorpusFile(dir, makeSpec(16, 1030, 770, pattern)));
+	}
+	checkSuperPixel<unsigned char>(writeCorpusFile(dir, makeSpec(8, 1030, 770, "GBRG")));
+	checkSuperPixel<unsigned int>(writeCorpusFile(dir, makeSpec(32, 1030, 770, "GRBG")));
+	checkSuperPixel<float>(writeCorpusFile(dir, makeSpec(-32, 1030, 770, "BGGR")));
+}
+
+
+// --- decode paths --------------------------------------------------------------------
+
+// Memory budget large enough for every file of the checks to stay on the in-memory path
+constexpr long long InMemoryBudget = 1LL << 40;
+
+
+std::vector<unsigned char> decodeBitmap(const std::string& path, int factor, int debayerMode, long long memoryBudget) {
+	FitsImageSetMemoryBudget(memoryBudget);
+	FitsImage *fits = FitsImageCreate(path.c_str());
+	FitsImageSetDebayerMode(fits, debayerMode);
+	FitsImageSetDownscaleFactor(fits, factor);
+	const ImageDim dim = FitsImageGetOutputDim(fits);
+	std::vector<unsigned char> bitmap(static_cast<size_t>(dim.nx) * dim.ny * dim.nc, 0);
+	FitsImageGetPixData(fits, bitmap.data());
+	FitsImageDestroy(fits);
+	return bitmap;
+}
+
+
+void compareBitmaps(const std::vector<unsigned char>& bitmap, const std::vector<unsigned char>& reference, const std::string& what) {
+	size_t mismatches = 0;
+	for (size_t i = 0; i < std::min(bitmap.size(), reference.size()); i++) {
+		mismatches += bitmap[i] != reference[i];
+	}
+	check(!reference.empty() && bitmap.size() == reference.size() && mismatches == 0,
+		what + ": " + std::to_string(bitmap.size()) + " bytes against " + std::to_string(reference.size()) + ", "
+		+ std::to_string(mismatches) + " differ");
+}
+
+
+#ifdef HAVE_ZLIB
+std::string gzipCopy(const std::string& path) {
+	std::ifstream in(path, std::ios::binary);
+	const std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	const std::string gzPath = path + ".gz";
+	gzFile out = gzopen(gzPath.c_str(), "wb");
+	if (!out)
+		return "";
+	const bool ok = gzwrite(out, bytes.data(), static_cast<unsigned>(bytes.size())) == static_cast<int>(bytes.size());
+	return gzclose(out) == Z_OK && ok ? gzPath : "";
+}
+#endif
+
+
+// The strip path needs several strips per image, see StripBytes in FitsImage.cpp
+void checkPaths(const std::string& dir) {
+	std::vector<SyntheticFitsSpec> specs = {
+		makeSpec(16, 2560, 2048, "RGGB"),
+		makeSpec(16, 2560, 2048, "GBRG", true),
+		makeSpec(-32, 2560, 2048, "BGGR"),
+		makeSpec(8, 2051, 3001, "", true),
+		makeSpec(16, 2051, 3001),
+		makeSpec(32, 2051, 1501),
+		makeSpec(-64, 1031, 1501),
+	};
+	SyntheticFitsSpec cube = makeSpec(16, 1536, 1024);
+	cube.channels = 3;
+	specs.push_back(cube);
+	SyntheticFitsSpec signed32 = makeSpec(32, 2051, 1501);
+	signed32.biasSubtracted = true;
+	specs.push_back(signed32);
+
+	for (const SyntheticFitsSpec& spec : specs) {
+		const std::string path = writeCorpusFile(dir, spec);
+		if (path.empty())
+			continue;
+		const bool isBayer = !spec.bayerPattern.empty();
+
+		// super pixel previews, at full size also from the gzipped file
+		for (int factor : { 1, 2, 3 }) {
+			const std::string what = syntheticFitsName(spec) + " factor " + std::to_string(factor);
+			const std::vector<unsigned char> inMemory = decodeBitmap(path, factor, 0, InMemoryBudget);
+			compareBitmaps(decodeBitmap(path, factor, 0, 0), inMemory, what + " strips");
+#ifdef HAVE_ZLIB
+			if (factor == 1) {
+				const std::string gzPath = gzipCopy(path);
+				check(!gzPath.empty(), "cannot write " + path + ".gz");
+				if (!gzPath.empty())
+					compareBitmaps(decodeBitmap(gzPath, factor, 0, InMemoryBudget), inMemory, what + " gzip");
+			}
+#endif
+		}
+
+		// full resolution debayers, whose strips and gzip windows carry a halo of mosaic rows
+		if (isBayer) {
+			for (int mode : { 1, 2 }) {
+				const std::string what = syntheticFitsName(spec) + (mode == 1 ? " bilinear" : " VNG");
+				const std::vector<unsigned char> inMemory = decodeBitmap(path, 1, mode, InMemoryBudget);
+				compareBitmaps(decodeBitmap(path, 1, mode, 0), inMemory, what + " strips");
+#ifdef HAVE_ZLIB
+				compareBitmaps(decodeBitmap(path + ".gz", 1, mode, InMemoryBudget), inMemory, what + " gzip");
+#endif
+			}
+		}
+	}
+
+	// signed 32 bit integers, negative in the background, preview like the same values as doubles
+	SyntheticFitsSpec doubles = signed32;
+	doubles.bitpix = -64;
+	const std::string signedPath = dir + "/" + syntheticFitsName(signed32);
+	const std::string doublesPath = writeCorpusFile(dir, doubles);
+	if (!doublesPath.empty())
+		compareBitmaps(decodeBitmap(signedPath, 1, 0, InMemoryBudget), decodeBitmap(doublesPath, 1, 0, InMemoryBudget),
+			syntheticFitsName(signed32) + " against " + syntheticFitsName(doubles));
+}
+
+
+void makeDirectory(const std::string& path) {
+#ifdef _WIN32
+	_mkdir(path.c_str());
+#else
+	mkdir(path.c_str(), 0755);
+#endif
+}
+
+} // namespace
+
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		std::fprintf(stderr, "usage: viewer_consistency converters|statistics|super_pixel|paths CORPUS_DIR\n");
+		return 1;
+	}
+	const std::string name = argv[1];
+	const std::string dir = argv[2];
+	makeDirectory(dir);
+
+	if (name == "converters") checkConverters(dir);
+	else if (name == "statistics") checkStatistics(dir);
+	else if (name == "super_pixel") checkSuperPixels(dir);
+	else if (name == "paths") checkPaths(dir);
+	else {
+		std::fprintf(stderr, "unknown check %s\n", name.c_str());
+		return 1;
+	}
+	std::printf("%s: %d failed\n", name.c_str(), failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,213 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+#include "pch.h"
+#include "threadpool.h"
+#include "trace.h"
+#include <string>
+
+
+// Index of the current thread's queue, -1 for threads that don't belong to the pool
+static thread_local const ThreadPool *tlsPool = nullptr;
+static thread_local int tlsIndex = -1;
+
+
+ThreadPool& ThreadPool::instance()
+{
+	// Never destroyed: joining threads from a DLL's static destructors can deadlock on unload
+	static ThreadPool *pool = new ThreadPool();
+	return *pool;
+}
+
+
+ThreadPool::ThreadPool(unsigned nbThreads) : _queued(0), _nextQueue(0), _stopping(false)
+{
+	start(nbThreads);
+}
+
+
+ThreadPool::~ThreadPool()
+{
+	stop();
+}
+
+
+void ThreadPool::resize(unsigned nbThreads)
+{
+	stop();
+	start(nbThreads);
+}
+
+
+void ThreadPool::start(unsigned nbThreads)
+{
+	if (nbThreads == 0)
+		nbThreads = std::max(1u, std::thread::hardware_concurrency());
+
+	_stopping = false;
+	const unsigned nbWorkers = nbThreads - 1;
+	// one queue per worker plus one shared by the threads outside the pool
+	for (unsigned i = 0; i <= nbWorkers; i++) {
+		_queues.emplace_back(new WorkerQueue());
+	}
+	for (unsigned i = 0; i < nbWorkers; i++) {
+		_workers.emplace_back(&ThreadPool::workerLoop, this, i);
+	}
+}
+
+
+void ThreadPool::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(_sleepMutex);
+		_stopping = true;
+	}
+	_wake.notify_all();
+	for (auto& worker : _workers) {
+		worker.join();
+	}
+	_workers.clear();
+	_queues.clear();
+}
+
+
+void ThreadPool::run(std::vector<Job>& jobs)
+{
+	if (jobs.empty())
+		return;
+	if (_workers.empty() || jobs.size() == 1) {
+		for (auto& job : jobs) job();
+		return;
+	}
+
+	Group group;
+	group.pending = jobs.size();
+
+	// Counted before they are published: a task is taken, and _queued decremented, as
+	// soon as it is in a deque
+	{
+		std::lock_guard<std::mutex> lock(_sleepMutex);
+		_queued += jobs.size();
+	}
+
+	// Workers push to their own deque, outside threads spread the jobs round-robin
+	const int self = tlsPool == this ? tlsIndex : -1;
+	const size_t nbQueues = _queues.size();
+	for (auto& job : jobs) {
+		const size_t q = self >= 0 ? static_cast<size_t>(self) : _nextQueue++ % nbQueues;
+		std::lock_guard<std::mutex> lock(_queues[q]->mutex);
+		_queues[q]->tasks.push_back(Task{ std::move(job), &group });
+	}
+	_wake.notify_all();
+
+	// Help instead of blocking, this is what makes nested parallel_for safe. Once nothing is
+	// left to take, an outside thread sleeps until the last task of its group is done. Workers
+	// keep looking, the tasks still running may publish nested work for them to steal.
+	while (group.pending.load() > 0) {
+		if (tryRunOne(self))
+			continue;
+		if (self >= 0) {
+			std::this_thread::yield();
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(group.doneMutex);
+		group.done.wait(lock, [&group]() { return group.pending.load() == 0; });
+	}
+	// the task that brought pending to 0 may still be notifying, the group must outlive it
+	std::lock_guard<std::mutex> lock(group.doneMutex);
+
+	if (group.error) {
+		std::rethrow_exception(group.error);
+	}
+}
+
+
+bool ThreadPool::tryRunOne(int self)
+{
+	Task task;
+	bool found = false;
+
+	if (self >= 0) {
+		WorkerQueue& own = *_queues[self];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.tasks.empty()) {
+			task = std::move(own.tasks.back());
+			own.tasks.pop_back();
+			found = true;
+		}
+	}
+
+	const size_t nbQueues = _queues.size();
+	const size_t first = self >= 0 ? static_cast<size_t>(self) + 1 : 0;
+	for (size_t k = 0; !found && k < nbQueues; k++) {
+		WorkerQueue& victim = *_queues[(first + k) % nbQueues];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.tasks.empty()) {
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			found = true;
+		}
+	}
+
+	if (!found)
+		return false;
+
+	_queued--;
+	execute(task);
+	return true;
+}
+
+
+void ThreadPool::execute(Task& task)
+{
+	TraceScope trace("task", TraceCategory::Pool);
+	try {
+		task.job();
+	}
+	catch (...) {
+		std::lock_guard<std::mutex> lock(task.group->errorMutex);
+		if (!task.group->error)
+			task.group->error = std::current_exception();
+	}
+	// under the lock, see the end of run
+	Group& group = *task.group;
+	std::lock_guard<std::mutex> lock(group.doneMutex);
+	if (--group.pending == 0)
+		group.done.notify_all();
+}
+
+
+void ThreadPool::workerLoop(unsigned index)
+{
+	tlsPool = this;
+	tlsIndex = static_cast<int>(index);
+	Tracer::instance().setThreadName("worker " + std::to_string(index));
+
+	for (;;) {
+		if (tryRunOne(tlsIndex))
+			continue;
+
+		std::unique_lock<std::mutex> lock(_sleepMutex);
+		_wake.wait(lock, [this]() { return _stopping || _queued.load() > 0; });
+		if (_stopping && _queued.load() == 0)
+			return;
+	}
+}
@@ -0,0 +1,165 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+// Small work-stealing thread pool shared by all the pipeline stages. Each worker owns a
+// deque: it pops its own tasks LIFO and steals from the other deques FIFO when it runs out.
+// A thread waiting on parallel work runs tasks too, so nested parallel_for calls don't deadlock.
+// Workers are started once and reused across images.
+
+#ifndef threadpool_h
+#define threadpool_h
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+
+class ThreadPool
+{
+public:
+	typedef std::function<void()> Job;
+
+	// Process wide pool, sized to the hardware concurrency until resize is called
+	static ThreadPool& instance();
+
+	explicit ThreadPool(unsigned nbThreads = 0);
+	~ThreadPool();
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// Total number of threads running tasks, the calling thread included.
+	// 0 means hardware concurrency. Must not be called while work is in flight.
+	void resize(unsigned nbThreads);
+	unsigned size() const { return static_cast<unsigned>(_workers.size()) + 1; }
+
+	// Runs all jobs and returns once they are done, rethrowing the first exception
+	void run(std::vector<Job>& jobs);
+
+private:
+	struct Group
+	{
+		std::atomic<size_t> pending;
+		std::mutex errorMutex;
+		std::exception_ptr error;
+		std::mutex doneMutex;            // held while pending is decremented
+		std::condition_variable done;    // notified when pending reaches 0
+	};
+
+	struct Task
+	{
+		Job job;
+		Group *group;
+	};
+
+	struct WorkerQueue
+	{
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	bool tryRunOne(int self);
+	void execute(Task& task);
+	void workerLoop(unsigned index);
+	void start(unsigned nbThreads);
+	void stop();
+
+	std::vector<std::unique_ptr<WorkerQueue>> _queues;
+	std::vector<std::thread> _workers;
+	std::mutex _sleepMutex;
+	std::condition_variable _wake;
+	std::atomic<size_t> _queued;
+	std::atomic<unsigned> _nextQueue;
+	bool _stopping;
+};
+
+
+// f(i) for every i in [begin, end), indices being grouped in a few contiguous chunks per thread
+template <typename I, typename F>
+void parallel_for(I begin, I end, const F& f) {
+	if (!(begin < end))
+		return;
+	ThreadPool& pool = ThreadPool::instance();
+	const size_t n = static_cast<size_t>(end - begin);
+	const size_t nbChunks = std::min<size_t>(n, 4 * static_cast<size_t>(pool.size()));
+	if (nbChunks <= 1) {
+		for (I i = begin; i < end; ++i) f(i);
+		return;
+	}
+
+	std::vector<ThreadPool::Job> jobs;
+	jobs.reserve(nbChunks);
+	for (size_t c = 0; c < nbChunks; c++) {
+		const I chunkBegin = begin + static_cast<I>(n * c / nbChunks);
+		const I chunkEnd = begin + static_cast<I>(n * (c + 1) / nbChunks);
+		jobs.emplace_back([chunkBegin, chunkEnd, &f]() {
+			for (I i = chunkBegin; i < chunkEnd; ++i) f(i);
+		});
+	}
+	pool.run(jobs);
+}
+
+
+// f(tileBegin, tileEnd) over [0, n) in tiles of tileSize
+template <typename F>
+void parallel_for_tiles(size_t n, size_t tileSize, const F& f) {
+	const size_t nbTiles = (n + tileSize - 1) / tileSize;
+	parallel_for(size_t(0), nbTiles, [&](size_t tile) {
+		f(tile * tileSize, std::min(n, (tile + 1) * tileSize));
+	});
+}
+
+
+// Reduction over [0, n) in tiles of tileSize. Each chunk of tiles accumulates into its own
+// copy of identity with body(tileBegin, tileEnd, acc), the partial results are then
+// merged with join(into, from).
+template <typename T, typename Body, typename Join>
+T parallel_reduce(size_t n, size_t tileSize, const T& identity, const Body& body, const Join& join) {
+	const size_t nbTiles = (n + tileSize - 1) / tileSize;
+	if (nbTiles == 0)
+		return identity;
+
+	ThreadPool& pool = ThreadPool::instance();
+	const size_t nbChunks = std::min<size_t>(nbTiles, 4 * static_cast<size_t>(pool.size()));
+	std::vector<T> partials(nbChunks, identity);
+
+	parallel_for(size_t(0), nbChunks, [&](size_t c) {
+		const size_t tileEnd = nbTiles * (c + 1) / nbChunks;
+		for (size_t tile = nbTiles * c / nbChunks; tile < tileEnd; tile++) {
+			body(tile * tileSize, std::min(n, (tile + 1) * tileSize), partials[c]);
+		}
+	});
+
+	T result = std::move(partials[0]);
+	for (size_t c = 1; c < nbChunks; c++) {
+		join(result, partials[c]);
+	}
+	return result;
+}
+
+#endif /* threadpool_h */
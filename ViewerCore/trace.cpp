@@ -0,0 +1,291 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+
+#include "pch.h"
+#include "trace.h"
+#include "platform.h"
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+
+
+static const char *const TraceLogFileName = "QuickFITS.log";
+static const std::chrono::milliseconds FlushInterval(100);
+
+static std::atomic<uint32_t> nextThreadId(0);
+static thread_local const uint32_t tlsThreadId = ++nextThreadId;
+
+
+Tracer& Tracer::instance()
+{
+	// Never destroyed, like the thread pool: the flusher can't be joined safely from a DLL unload
+	static Tracer *tracer = new Tracer();
+	return *tracer;
+}
+
+
+Tracer::Tracer() : _enqueuePos(0), _enabled(false), _dropped(0), _epoch(std::chrono::steady_clock::now()),
+	_wallEpoch(std::chrono::system_clock::now()), _dequeuePos(0)
+{
+	for (size_t i = 0; i < Capacity; i++) {
+		_slots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+#ifdef ENABLE_LOGGING
+	setEnabled(true);
+#endif
+}
+
+
+void Tracer::setEnabled(bool enabled)
+{
+	if (enabled) {
+		std::lock_guard<std::mutex> lock(_flusherMutex);
+		if (!_flusher.joinable()) {
+			_flusher = std::thread(&Tracer::flusherLoop, this);
+		}
+	}
+	_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+
+uint64_t Tracer::now() const
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _epoch).count();
+}
+
+
+void Tracer::span(const char *name, TraceCategory category, uint64_t startNs, uint64_t durationNs)
+{
+	TraceEvent event;
+	event.timestampNs = startNs;
+	event.durationNs = durationNs;
+	event.threadId = tlsThreadId;
+	event.phase = 'X';
+	event.category = category;
+	std::strncpy(event.name, name, sizeof(event.name) - 1);
+	event.name[sizeof(event.name) - 1] = '\0';
+	push(event);
+}
+
+
+void Tracer::instant(const char *message, TraceCategory category)
+{
+	if (!enabled())
+		return;
+	TraceEvent event;
+	event.timestampNs = now();
+	event.durationNs = 0;
+	event.threadId = tlsThreadId;
+	event.phase = 'i';
+	event.category = category;
+	std::strncpy(event.name, message, sizeof(event.name) - 1);
+	event.name[sizeof(event.name) - 1] = '\0';
+	push(event);
+}
+
+
+void Tracer::setThreadName(const std::string& name)
+{
+	std::lock_guard<std::mutex> lock(_namesMutex);
+	_threadNames[tlsThreadId] = name;
+}
+
+
+// Bounded multi-producer queue with a sequence number per slot (D. Vyukov): a producer claims
+// a position with a CAS, writes the event, then publishes it by advancing the slot's sequence.
+// Producers never wait, a full ring drops the event.
+bool Tracer::push(const TraceEvent& event)
+{
+	size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+	for (;;) {
+		Slot& slot = _slots[pos & (Capacity - 1)];
+		const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+		const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+		if (diff == 0) {
+			if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				slot.event = event;
+				slot.sequence.store(pos + 1, std::memory_order_release);
+				// a burst fills the ring faster than the flush interval, drain early
+				if ((pos & (Capacity / 4 - 1)) == Capacity / 4 - 1) {
+					_wake.notify_one();
+				}
+				return true;
+			}
+		}
+		else if (diff < 0) {
+			_dropped.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		else {
+			pos = _enqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+
+// Single consumer at a time, the caller holds _drainMutex
+void Tracer::drain()
+{
+	bool wroteLog = false;
+	for (;;) {
+		Slot& slot = _slots[_dequeuePos & (Capacity - 1)];
+		const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+		if (sequence != _dequeuePos + 1)
+			break;
+
+		const TraceEvent event = slot.event;
+		slot.sequence.store(_dequeuePos + Capacity, std::memory_order_release);
+		_dequeuePos++;
+
+		if (_history.size() == MaxHistory) {
+			_history.pop_front();
+		}
+		_history.push_back(event);
+#ifdef ENABLE_LOGGING
+		// only the messages go to the log file: the pool task spans and the per strip
+		// stage spans of a preview run in the thousands, they are for exportChromeTrace
+		if (event.category == TraceCategory::Log) {
+			writeLogLine(event);
+			wroteLog = true;
+		}
+#endif
+	}
+	if (wroteLog) {
+		_logFile.flush();
+	}
+}
+
+
+void Tracer::flusherLoop()
+{
+	setThreadName("trace flusher");
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(_flusherMutex);
+			_wake.wait_for(lock, FlushInterval);
+		}
+		std::lock_guard<std::mutex> lock(_drainMutex);
+		drain();
+	}
+}
+
+
+// The log file is opened once and kept open, it used to be reopened for every message
+void Tracer::writeLogLine(const TraceEvent& event)
+{
+	if (!_logFile.is_open()) {
+		const std::string documentsPath = getDocumentsFolder();
+		if (documentsPath.empty())
+			return;
+		_logFile.open(documentsPath + PathSeparator + TraceLogFileName, std::ios::app);
+		if (!_logFile.is_open())
+			return;
+	}
+
+	const auto wallTime = _wallEpoch + std::chrono::duration_cast<std::chrono::system_clock::duration>(
+		std::chrono::nanoseconds(event.timestampNs));
+	const time_t seconds = std::chrono::system_clock::to_time_t(wallTime);
+	const long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(wallTime.time_since_epoch()).count() % 1000;
+	std::tm localTime{};
+	if (toLocalTime(seconds, &localTime)) {
+		_logFile << "[" << std::put_time(&localTime, "%Y-%m-%d %H:%M:%S") << '.' << std::setfill('0') << std::setw(3) << ms << "] ";
+	}
+	_logFile << "[" << event.threadId << "] " << event.name;
+	if (event.phase == 'X') {
+		_logFile << " " << std::fixed << std::setprecision(3) << event.durationNs / 1e6 << " ms";
+	}
+	_logFile << '\n';
+}
+
+
+static void writeJsonString(std::ostream& out, const char *s)
+{
+	out << '"';
+	for (; *s; s++) {
+		const unsigned char c = static_cast<unsigned char>(*s);
+		if (c == '"' || c == '\\') {
+			out << '\\' << *s;
+		}
+		else if (c < 0x20) {
+			char escaped[8];
+			std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+			out << escaped;
+		}
+		else {
+			out << *s;
+		}
+	}
+	out << '"';
+}
+
+
+static const char *categoryName(TraceCategory category)
+{
+	switch (category) {
+	case TraceCategory::Pipeline: return "pipeline";
+	case TraceCategory::Pool: return "pool";
+	default: return "log";
+	}
+}
+
+
+bool Tracer::exportChromeTrace(const std::string& path)
+{
+	std::ofstream out(path, std::ios::trunc);
+	if (!out.is_open())
+		return false;
+
+	std::lock_guard<std::mutex> lock(_drainMutex);
+	drain();
+
+	// timestamps in microseconds, as the format expects
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	bool first = true;
+	{
+		std::lock_guard<std::mutex> namesLock(_namesMutex);
+		for (const auto& thread : _threadNames) {
+			out << (first ? "" : ",\n") << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << thread.first
+				<< ",\"args\":{\"name\":";
+			writeJsonString(out, thread.second.c_str());
+			out << "}}";
+			first = false;
+		}
+	}
+	out << std::fixed << std::setprecision(3);
+	for (const TraceEvent& event : _history) {
+		out << (first ? "" : ",\n") << "{\"ph\":\"" << event.phase << "\",\"name\":";
+		writeJsonString(out, event.name);
+		out << ",\"cat\":\"" << categoryName(event.category) << "\",\"pid\":1,\"tid\":" << event.threadId
+			<< ",\"ts\":" << event.timestampNs / 1e3;
+		if (event.phase == 'X') {
+			out << ",\"dur\":" << event.durationNs / 1e3;
+		}
+		else {
+			out << ",\"s\":\"t\"";
+		}
+		out << "}";
+		first = false;
+	}
+	out << "\n],\"otherData\":{\"droppedEvents\":" << dropped() << "}}\n";
+	return out.good();
+}
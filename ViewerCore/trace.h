@@ -0,0 +1,142 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+
+// In-memory tracing: fixed-size binary events pushed to a lock-free ring buffer by any
+// thread, drained by a background flusher into a bounded history (and the log file when
+// built with ENABLE_LOGGING). The history exports as Chrome trace-event JSON, to be opened
+// in chrome://tracing or Perfetto.
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+
+enum class TraceCategory : uint8_t
+{
+	Pipeline,
+	Pool,
+	Log,
+};
+
+
+// 128 bytes, copied by value through the ring
+struct TraceEvent
+{
+	uint64_t timestampNs;
+	uint64_t durationNs;
+	uint32_t threadId;
+	char phase;               // 'X' span, 'i' instant
+	TraceCategory category;
+	char name[102];
+};
+static_assert(sizeof(TraceEvent) == 128, "TraceEvent is meant to be 128 bytes");
+
+
+class Tracer
+{
+public:
+	static Tracer& instance();
+
+	void setEnabled(bool enabled);
+	bool enabled() const { return _enabled.load(std::memory_order_relaxed); }
+
+	// Nanoseconds since the tracer was created
+	uint64_t now() const;
+
+	void span(const char *name, TraceCategory category, uint64_t startNs, uint64_t durationNs);
+	void instant(const char *message, TraceCategory category = TraceCategory::Log);
+	void setThreadName(const std::string& name);
+
+	// Drains the ring and writes the history as Chrome trace-event JSON
+	bool exportChromeTrace(const std::string& path);
+
+	// Events lost because the ring was full
+	uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+private:
+	static constexpr size_t Capacity = size_t(1) << 14;
+	static constexpr size_t MaxHistory = size_t(1) << 16;
+
+	struct Slot
+	{
+		std::atomic<size_t> sequence;
+		TraceEvent event;
+	};
+
+	Tracer();
+	bool push(const TraceEvent& event);
+	void drain();
+	void flusherLoop();
+	void writeLogLine(const TraceEvent& event);
+
+	Slot _slots[Capacity];
+	std::atomic<size_t> _enqueuePos;
+	std::atomic<bool> _enabled;
+	std::atomic<uint64_t> _dropped;
+	std::chrono::steady_clock::time_point _epoch;
+	std::chrono::system_clock::time_point _wallEpoch;
+
+	// consumer side: flusher thread and exports
+	std::mutex _drainMutex;
+	size_t _dequeuePos;
+	std::deque<TraceEvent> _history;
+	std::ofstream _logFile;
+
+	std::mutex _namesMutex;
+	std::map<uint32_t, std::string> _threadNames;
+
+	std::mutex _flusherMutex;
+	std::condition_variable _wake;
+	std::thread _flusher;
+};
+
+
+// Records the lifetime of a scope as a span, nothing when tracing is off
+class TraceScope
+{
+public:
+	explicit TraceScope(const char *name, TraceCategory category = TraceCategory::Pipeline)
+		: _name(name), _category(category), _start(Tracer::instance().enabled() ? Tracer::instance().now() : 0), _active(Tracer::instance().enabled()) {}
+	~TraceScope() {
+		if (_active) {
+			Tracer& tracer = Tracer::instance();
+			tracer.span(_name, _category, _start, tracer.now() - _start);
+		}
+	}
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+	const char *_name;
+	TraceCategory _category;
+	uint64_t _start;
+	bool _active;
+};
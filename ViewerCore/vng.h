@@ -0,0 +1,330 @@
+/*
+	QuickFits - FITS file preview plugin for QL-win
+	Copyright (C) 2021 Siyu Zhang
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 2.1 of the License, or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+	USA
+*/
+
+
+
+// Threshold-based Variable Number of Gradients demosaic (Chang, Cheung & Pang, 1999).
+// Around every photosite eight directional gradients are measured on the 5x5 mosaic
+// neighbourhood, and only the directions whose gradient is below a threshold contribute
+// to the colour estimate, so edges aren't averaged across. The image is cut in tiles that
+// are copied with a 2 pixel halo into per tile buffers: the kernels then run without
+// bounds checks and the working memory doesn't depend on the image size.
+
+#ifndef vng_h
+#define vng_h
+
+#include <valarray>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+#include <cmath>
+#include <cstddef>
+#include "bilinear.h"
+#include "threadpool.h"
+
+
+// Output pixels per tile side, even so that tiles keep the CFA column parity
+constexpr int VngTileSize = 128;
+
+// Rows and columns of mosaic read around the produced ones
+constexpr int VngHalo = 2;
+
+// Gradients up to k1 * min + k2 * (max - min) are kept
+constexpr float VngK1 = 1.5f;
+constexpr float VngK2 = 0.5f;
+
+
+// Colour of every CFA site and the weights giving the mean of each colour over the 3x3
+// block centred on a site, the directional estimates VNG averages
+struct VngPattern
+{
+	int color[2][2];    // 0 red, 1 green, 2 blue
+	BilinearTerms means[2][2][3];
+
+	explicit VngPattern(const std::string& pattern) {
+		for (int py = 0; py < 2; py++) {
+			for (int px = 0; px < 2; px++) {
+				const char c = pattern.size() == 4 ? pattern[2 * py + px] : 'G';
+				color[py][px] = c == 'R' ? 0 : c == 'B' ? 2 : 1;
+			}
+		}
+		for (int py = 0; py < 2; py++) {
+			for (int px = 0; px < 2; px++) {
+				const int site = color[py][px];
+				for (int ch = 0; ch < 3; ch++) {
+					BilinearTerms t = { 0, 0, 0, 0 };
+					if (site == 1 && ch == 1) {
+						// the centre and the four corners
+						t.center = 0.2f;
+						t.diagonal = 0.2f;
+					}
+					else if (site == 1) {
+						if (color[py][1 - px] == ch)
+							t.horizontal = 0.5f;
+						else
+							t.vertical = 0.5f;
+					}
+					else if (ch == site) {
+						t.center = 1;
+					}
+					else if (ch == 1) {
+						t.horizontal = 0.25f;
+						t.vertical = 0.25f;
+					}
+					else {
+						t.diagonal = 0.25f;
+					}
+					means[py][px][ch] = t;
+				}
+			}
+		}
+	}
+};
+
+
+// Mirrors a coordinate of the halo into [0, n), keeping its parity when n allows it
+inline int vngReflect(int i, int n) {
+	if (i < 0)
+		i = -i;
+	if (i >= n)
+		i = 2 * (n - 1) - i;
+	return std::min(std::max(i, 0), n - 1);
+}
+
+
+// Largest float that converts to T, integer estimates are clamped to [0, vngSampleMax]
+template <typename T>
+inline float vngSampleMax() {
+	const float max = static_cast<float>(std::numeric_limits<T>::max());
+	// 2^32 - 1 rounds up to 2^32
+	return static_cast<double>(max) > static_cast<double>(std::numeric_limits<T>::max()) ? std::nextafter(max, 0.0f) : max;
+}
+
+template <typename T>
+inline T vngSample(float v, float max, std::true_type) {
+	return static_cast<T>(std::min(std::max(v, 0.0f), max));
+}
+
+template <typename T>
+inline T vngSample(float v, float, std::false_type) {
+	return static_cast<T>(v);
+}
+
+
+// Working memory of one tile, a few hundred kB whatever the image size
+struct VngTileBuffers
+{
+	std::vector<float> raw;         // mosaic with its halo
+	std::vector<float> means;       // 3 planes of 3x3 block colour means
+	std::vector<float> masks;       // 1 where the site has the colour, per row parity and colour
+	std::vector<float> gradients;   // 8 directions of one row
+	std::vector<float> sums;        // 3 colour sums, direction count and threshold of one row
+};
+
+
+// Gradient along d of n consecutive pixels, q being the perpendicular step
+inline void vngGradientRow(const float *p, ptrdiff_t d, ptrdiff_t q, int n, float *g) {
+	for (int x = 0; x < n; x++) {
+		const float *s = p + x;
+		g[x] = std::fabs(s[d] - s[-d]) + std::fabs(s[2 * d] - s[0])
+			+ 0.5f * (std::fabs(s[d + q] - s[q - d]) + std::fabs(s[d - q] - s[-d - q])
+				+ std::fabs(s[2 * d + q] - s[q]) + std::fabs(s[2 * d - q] - s[-q]));
+	}
+}
+
+
+// Diagonal gradient along a + b, a and b being its vertical and horizontal steps. Green
+// sites compare other samples than red and blue ones, both are blended by greenMask.
+inline void vngDiagonalRow(const float *p, ptrdiff_t a, ptrdiff_t b, const float *greenMask, int n, float *g) {
+	const ptrdiff_t d = a + b;
+	for (int x = 0; x < n; x++) {
+		const float *s = p + x;
+		const float green = std::fabs(s[d + a] - s[-b]) + std::fabs(s[d + b] - s[-a]);
+		const float other = 0.5f * (std::fabs(s[a] - s[-b]) + std::fabs(s[b] - s[-a])
+			+ std::fabs(s[d + a] - s[a]) + std::fabs(s[d + b] - s[b]));
+		g[x] = std::fabs(s[d] - s[-d]) + std::fabs(s[2 * d] - s[0]) + greenMask[x] * green + (1.0f - greenMask[x]) * other;
+	}
+}
+
+
+// Output rows [ty0, ty1) and columns [tx0, tx1) of one tile. Every stage is a loop over a
+// row of the tile buffers without branches, which compilers vectorize.
+template <typename T>
+void vngTile(const T *rows, size_t rowStride, int firstRow, int width, int height, int ty0, int ty1, int tx0, int tx1,
+	const VngPattern& pattern, T *out, size_t planeSize, int row0, VngTileBuffers& buffers) {
+	const int tw = tx1 - tx0;
+	const int th = ty1 - ty0;
+	const int rw = tw + 2 * VngHalo;
+	const int rh = th + 2 * VngHalo;
+	const size_t meansPlane = static_cast<size_t>(rw) * (th + 2);
+	buffers.raw.resize(static_cast<size_t>(rw) * rh);
+	buffers.means.resize(3 * meansPlane);
+	buffers.masks.resize(6 * static_cast<size_t>(tw));
+	buffers.gradients.resize(8 * static_cast<size_t>(tw));
+	buffers.sums.resize(5 * static_cast<size_t>(tw));
+	float *raw = &buffers.raw[0];
+
+	// mosaic with its halo, mirrored at the image borders
+	for (int r = 0; r < rh; r++) {
+		const T *src = rows + static_cast<size_t>(vngReflect(ty0 - VngHalo + r, height) - firstRow) * rowStride;
+		float *dst = raw + static_cast<size_t>(r) * rw;
+		for (int k = 0; k < VngHalo; k++) {
+			dst[k] = static_cast<float>(src[vngReflect(tx0 - VngHalo + k, width)]);
+			dst[VngHalo + tw + k] = static_cast<float>(src[vngReflect(tx1 + k, width)]);
+		}
+		for (int x = tx0; x < tx1; x++) {
+			dst[VngHalo + x - tx0] = static_cast<float>(src[x]);
+		}
+	}
+
+	// colour means of the 3x3 blocks around rows [ty0 - 1, ty1 + 1), columns [tx0 - 1, tx1 + 1)
+	const float *meanPlanes[3] = { &buffers.means[0], &buffers.means[meansPlane], &buffers.means[2 * meansPlane] };
+	for (int m = 0; m < th + 2; m++) {
+		const float *cur = raw + static_cast<size_t>(m + 1) * rw;
+		float *const dst[3] = { &buffers.means[static_cast<size_t>(m) * rw], &buffers.means[meansPlane + static_cast<size_t>(m) * rw],
+			&buffers.means[2 * meansPlane + static_cast<size_t>(m) * rw] };
+		bilinearRowInterior(cur - rw, cur, cur + rw, rw, pattern.means[(ty0 - 1 + m) & 1], dst);
+	}
+
+	// site colours, tiles start on even columns
+	for (int py = 0; py < 2; py++) {
+		for (int ch = 0; ch < 3; ch++) {
+			float *mask = &buffers.masks[(3 * py + ch) * static_cast<size_t>(tw)];
+			for (int x = 0; x < tw; x++) {
+				mask[x] = pattern.color[py][x & 1] == ch ? 1.0f : 0.0f;
+			}
+		}
+	}
+
+	// N, S, W, E, NW, NE, SW, SE
+	const ptrdiff_t up = -rw, down = rw, left = -1, right = 1;
+	const ptrdiff_t offsets[8] = { up, down, left, right, up + left, up + right, down + left, down + right };
+	float *g = &buffers.gradients[0];
+	float *sum[3] = { &buffers.sums[0], &buffers.sums[tw], &buffers.sums[2 * static_cast<size_t>(tw)] };
+	float *count = &buffers.sums[3 * static_cast<size_t>(tw)];
+	float *threshold = &buffers.sums[4 * static_cast<size_t>(tw)];
+	typedef std::integral_constant<bool, std::is_integral<T>::value> IsIntegral;
+	const float sampleMax = std::is_integral<T>::value ? vngSampleMax<T>() : 0.0f;
+
+	for (int y = ty0; y < ty1; y++) {
+		const int r = y - ty0 + VngHalo;
+		const float *p = raw + static_cast<size_t>(r) * rw + VngHalo;
+		const size_t meanRow = static_cast<size_t>(r - 1) * rw + VngHalo;
+		const float *mask[3] = { &buffers.masks[3 * (y & 1) * static_cast<size_t>(tw)], &buffers.masks[(3 * (y & 1) + 1) * static_cast<size_t>(tw)],
+			&buffers.masks[(3 * (y & 1) + 2) * static_cast<size_t>(tw)] };
+
+		vngGradientRow(p, up, right, tw, g);
+		vngGradientRow(p, down, right, tw, g + tw);
+		vngGradientRow(p, left, down, tw, g + 2 * tw);
+		vngGradientRow(p, right, down, tw, g + 3 * tw);
+		vngDiagonalRow(p, up, left, mask[1], tw, g + 4 * tw);
+		vngDiagonalRow(p, up, right, mask[1], tw, g + 5 * tw);
+		vngDiagonalRow(p, down, left, mask[1], tw, g + 6 * tw);
+		vngDiagonalRow(p, down, right, mask[1], tw, g + 7 * tw);
+
+		for (int x = 0; x < tw; x++) {
+			float gMin = g[x], gMax = g[x];
+			for (int d = 1; d < 8; d++) {
+				gMin = std::min(gMin, g[d * tw + x]);
+				gMax = std::max(gMax, g[d * tw + x]);
+			}
+			threshold[x] = VngK1 * gMin + VngK2 * (gMax - gMin);
+		}
+
+		// colour means of the directions whose gradient is under the threshold
+		std::fill_n(&buffers.sums[0], 4 * static_cast<size_t>(tw), 0.0f);
+		for (int d = 0; d < 8; d++) {
+			const float *gd = g + d * tw;
+			const float *m0 = meanPlanes[0] + meanRow + offsets[d];
+			const float *m1 = meanPlanes[1] + meanRow + offsets[d];
+			const float *m2 = meanPlanes[2] + meanRow + offsets[d];
+			float *s0 = sum[0], *s1 = sum[1], *s2 = sum[2];
+			for (int x = 0; x < tw; x++) {
+				const float keep = gd[x] <= threshold[x] ? 1.0f : 0.0f;
+				s0[x] += keep * m0[x];
+				s1[x] += keep * m1[x];
+				s2[x] += keep * m2[x];
+				count[x] += keep;
+			}
+		}
+
+		// the sample itself, plus the colour differences along the kept directions
+		// the threshold and count rows are done with, they now hold the site colour mean and 1 / count
+		float *siteMean = threshold;
+		float *scale = count;
+		const float *r0 = mask[0], *r1 = mask[1], *r2 = mask[2];
+		const float *s0 = sum[0], *s1 = sum[1], *s2 = sum[2];
+		for (int x = 0; x < tw; x++) {
+			const float n = count[x] > 1.0f ? count[x] : 1.0f;
+			scale[x] = 1.0f / n;
+			siteMean[x] = (r0[x] * s0[x] + r1[x] * s1[x] + r2[x] * s2[x]) * scale[x];
+		}
+		for (int ch = 0; ch < 3; ch++) {
+			T *dst = out + ch * planeSize + static_cast<size_t>(y - row0) * width + tx0;
+			const float *isSite = mask[ch];
+			const float *s = sum[ch];
+			for (int x = 0; x < tw; x++) {
+				const float v = isSite[x] != 0 ? p[x] : p[x] + s[x] * scale[x] - siteMean[x];
+				dst[x] = vngSample<T>(v, sampleMax, IsIntegral());
+			}
+		}
+	}
+}
+
+
+// Rows [row0, row1) of a width x height mosaic, with the same buffer conventions as
+// bilinearRows. rows must hold the VngHalo rows around the produced ones where they exist.
+template <typename T>
+void vngRows(const T *rows, size_t rowStride, int firstRow, int width, int height, int row0, int row1,
+	const VngPattern& pattern, T *out, size_t planeSize) {
+	if (width <= 0 || height <= 0 || row1 <= row0)
+		return;
+
+	const int tilesX = (width + VngTileSize - 1) / VngTileSize;
+	const int tilesY = (row1 - row0 + VngTileSize - 1) / VngTileSize;
+	const size_t nbTiles = static_cast<size_t>(tilesX) * tilesY;
+
+	// one run of tiles per pool chunk, so that the tile buffers are allocated once per
+	// chunk and not once per tile
+	const size_t nbChunks = std::min<size_t>(nbTiles, 4 * static_cast<size_t>(ThreadPool::instance().size()));
+	parallel_for_tiles(nbTiles, (nbTiles + nbChunks - 1) / nbChunks, [&](size_t first, size_t last) {
+		VngTileBuffers buffers;
+		for (size_t t = first; t < last; t++) {
+			const int ty0 = row0 + static_cast<int>(t / tilesX) * VngTileSize;
+			const int tx0 = static_cast<int>(t % tilesX) * VngTileSize;
+			vngTile(rows, rowStride, firstRow, width, height, ty0, std::min(row1, ty0 + VngTileSize), tx0, std::min(width, tx0 + VngTileSize),
+				pattern, out, planeSize, row0, buffers);
+		}
+	});
+}
+
+
+// Whole mosaic, same output as bilinear_debayer
+template <typename T>
+void vng_debayer(const std::valarray<T>& buf, std::valarray<T>& newbuf, int width, int height, const std::string& pattern) {
+	const int outWidth = width & ~1;
+	const int outHeight = height & ~1;
+	vngRows(&buf[0], static_cast<size_t>(width), 0, outWidth, outHeight, 0, outHeight, VngPattern(pattern),
+		&newbuf[0], static_cast<size_t>(outWidth) * outHeight);
+}
+
+#endif /* vng_h */